@@ -7,29 +7,25 @@
 
 // https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-generating-camera-rays/generating-camera-rays
 void Camera::tracePixels(const Scene &scene) const {
-    // Spawn one core per thread and make them consume work as they finish
-    int numPixels = film.width * film.height;
-    volatile std::atomic<int> nextPixel(0);
+    // One task per thread of the pool, consuming tiles as they finish
 #ifdef DEBUG_ONE_CORE
     int cores = 1;  // only one core, for debug purposes
 #else
-    int cores = std::thread::hardware_concurrency();  // max no. of threads
+    int cores = ThreadPool::global().size();  // max no. of threads
 #endif
+    TileScheduler scheduler(film.width, film.height, TILE_SIZE, cores);
     std::vector<std::future<void>> threadFutures;  // waits for them to finish
     for (int core = 0; core < cores; core++) {
-        threadFutures.emplace_back(std::async([&]() {
-            while (true) {
-                // Get next job ID (or stop if there aren't any)
-                int pixelIndex = nextPixel++;
-                if (pixelIndex >= numPixels) {
-                    break;
-                }
-                // Get direction to center of pixel
-                int x = pixelIndex % film.width;
-                int y = pixelIndex / film.width;
-                Vec4 direction = film.getPixelCenter(x, y);
-                // Generate ppp rays and store mean in result image
-                rayTracer->tracePixel(x, y, film, scene);
+        threadFutures.emplace_back(ThreadPool::global().submit([&, core]() {
+            // Pixels of the current tile, only this thread writes them
+            std::vector<RGBColor> pixels(TILE_SIZE * TILE_SIZE);
+            TileScheduler::Tile tile;
+            while (scheduler.next(core, tile)) {
+                // Generate ppp rays per pixel and store mean in result image
+                rayTracer->traceTile(tile.x0, tile.y0, tile.x1, tile.y1, film,
+                                     scene, seed, pixels.data());
+                rayTracer->storeTile(tile.x0, tile.y0, tile.x1, tile.y1,
+                                     pixels.data());
             }
         }));
     }
@@ -38,7 +34,7 @@ void Camera::tracePixels(const Scene &scene) const {
     auto beginTime = std::chrono::system_clock::now().time_since_epoch();
     printProgress(beginTime, 0.0f);
     while (!finished) {
-        float progress = nextPixel / (float)numPixels;
+        float progress = scheduler.tilesTaken() / (float)scheduler.numTiles();
         printProgress(beginTime, std::fminf(1.0f, progress));
         std::this_thread::sleep_for(std::chrono::seconds(1));
 
@@ -51,6 +47,10 @@ void Camera::tracePixels(const Scene &scene) const {
             }
         }
     }
+    // The rest of them are finishing their last job
+    for (auto &future : threadFutures) {
+        ThreadPool::global().wait(future);
+    }
 }
 
 void Camera::storeResult(const std::string &filename) const {
@@ -1,26 +1,38 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <cmath>
 #include <future>
 #include <memory>
 #include <string>
+#include <thread>
 #include "camera/film.h"
 #include "camera/progress.h"
 #include "camera/raytracer.h"
+#include "camera/tilescheduler.h"
 #include "io/ppmimage.h"
 #include "math/geometry.h"
+#include "parallel/threadpool.h"
 #include "math/random.h"
 #include "scene/figures.h"
 #include "scene/scene.h"
 
 class Camera {
+    // Pixels are traced in square tiles of this size, so tracers can work
+    // on a group of neighbouring pixels at once (see RayTracer::traceTile)
+    // and threads write to the image once per tile (see TileScheduler)
+    static const int TILE_SIZE = 16;
+
     const Film film;
     const RayTracerPtr rayTracer;
+    // Same seed, same render (see Sampler)
+    const uint64_t seed;
 
    public:
-    Camera(const Film &_film, const RayTracerPtr &_rayTracer)
-        : film(_film), rayTracer(_rayTracer) {}
+    Camera(const Film &_film, const RayTracerPtr &_rayTracer,
+           uint64_t _seed = 0)
+        : film(_film), rayTracer(_rayTracer), seed(_seed) {}
 
     // Trace ppp rays from all the pixels of the film
     void tracePixels(const Scene &scene) const;
@@ -41,12 +41,12 @@ struct Film {
     inline Vec4 localToWorld(const Vec4 &v) const { return cob * v; }
 
     // Get random DoF displacement (simulate bigger camera hole)
-    inline Vec4 getDoFDisplacement() const {
+    inline Vec4 getDoFDisplacement(Sampler &sampler) const {
         if (dofRadius == 0.0f) {
             return Vec4();
         } else {
-            float r = dofRadius * sqrtf(Random::ZeroOne());
-            Mat4 rotZ = Mat4::rotationZ(Random::ZeroOne() * 2.0f * M_PI);
+            float r = dofRadius * sqrtf(sampler.zeroOne());
+            Mat4 rotZ = Mat4::rotationZ(sampler.zeroOne() * 2.0f * M_PI);
             return localToWorld(rotZ * Vec4(0.0f, r, 0.0f, 0.0f));
         }
     }
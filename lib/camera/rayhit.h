@@ -1,6 +1,11 @@
 #pragma once
 
 struct RayHit;
+struct HitRecord;
+namespace Figures {
+class Figure;
+class Instance;
+}  // namespace Figures
 
 #include "math/geometry.h"
 #include "scene/material.h"
@@ -12,4 +17,22 @@ struct RayHit {
     MaterialPtr material;
     Vec4 normal;
     bool enters;
+};
+
+// Minimal information saved while looking for the closest hit, the full
+// RayHit is only calculated for the closest one (see Figure::finalize)
+struct HitRecord {
+    float distance;
+    float u, v;                          // barycentric coords. (triangles)
+    int primitive;                       // triangle index (meshes)
+    const Figures::Figure *figure;      // primitive that has been hit
+    const Figures::Instance *instance;  // instance containing it (if any)
+
+    HitRecord()
+        : distance(0.0f),
+          u(0.0f),
+          v(0.0f),
+          primitive(0),
+          figure(nullptr),
+          instance(nullptr) {}
 };
\ No newline at end of file
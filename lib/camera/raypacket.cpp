@@ -0,0 +1,30 @@
+#include "raypacket.h"
+#include "camera/ray.h"
+
+RayPacket::RayPacket(const Ray *_rays, int _size, int _mask)
+    : rays(_rays), size(_size), mask(_mask), coherent(_mask != 0) {
+    // Plain comparisons instead of BBox::extend (std::fmin/fmax aren't
+    // inlined), as it's done for every packet
+    BBox &ob = originBounds, &ib = invDirectionBounds;
+    for (int r = 0; r < size; r++) {
+        if (!(mask & (1 << r))) {
+            continue;
+        }
+        origin[r] = rays[r].origin;
+        invDirection[r] = rays[r].invDirection;
+        for (int i = 0; i < 3; i++) {
+            float o = origin[r].raw[i], id = invDirection[r].raw[i];
+            ob.bb0.raw[i] = o < ob.bb0.raw[i] ? o : ob.bb0.raw[i];
+            ob.bb1.raw[i] = o > ob.bb1.raw[i] ? o : ob.bb1.raw[i];
+            ib.bb0.raw[i] = id < ib.bb0.raw[i] ? id : ib.bb0.raw[i];
+            ib.bb1.raw[i] = id > ib.bb1.raw[i] ? id : ib.bb1.raw[i];
+            // Axis-parallel rays have infinite inverse directions, which
+            // can't be bounded (the frustum would produce NaNs)
+            coherent = coherent && std::isfinite(id);
+        }
+    }
+    // All directions must have the same sign on every axis
+    for (int i = 0; i < 3; i++) {
+        coherent = coherent && (ib.bb0.raw[i] > 0.0f || ib.bb1.raw[i] < 0.0f);
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+class Ray;
+
+#include "math/bbox.h"
+#include "math/geometry.h"
+
+// Group of coherent rays (e.g. the primary rays of a pixel) that are
+// traced together through the acceleration structures: each node is
+// fetched once for all of them, and culled at once using the frustum
+// that bounds them. Rays are selected with the bits of an int mask
+struct RayPacket {
+    // 4x4 rays
+    static const int MAX_SIZE = 16;
+
+    const Ray *rays;
+    int size;
+    int mask;  // rays of the packet that can be traced
+    // Copy of the rays' origins and inverse directions, for the traversal
+    Vec4 origin[MAX_SIZE], invDirection[MAX_SIZE];
+    // Frustum: bounds of the origins and inverse directions of the rays,
+    // only usable if they're coherent (same direction sign on every axis)
+    BBox originBounds, invDirectionBounds;
+    bool coherent;
+
+    RayPacket(const Ray *_rays, int _size, int _mask);
+    RayPacket(const Ray *_rays, int _size)
+        : RayPacket(_rays, _size, (1 << _size) - 1) {}
+};
@@ -1,18 +1,42 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 class RayTracer;
 typedef std::shared_ptr<RayTracer> RayTracerPtr;
 
 #include "camera/film.h"
 #include "camera/ray.h"
+#include "math/random.h"
 #include "scene/scene.h"
 
 // abstract class that handles rays with scene
 class RayTracer {
    public:
-    virtual void tracePixel(const int px, const int py, const Film &film,
-                            const Scene &scene) = 0;
+    // Color of the pixel, all its random numbers come from sampler
+    virtual RGBColor tracePixel(const int px, const int py, const Film &film,
+                                const Scene &scene, Sampler &sampler) = 0;
+    // Trace all pixels in [x0, x1) x [y0, y1) to pixels (row by row), one
+    // by one unless the tracer can do better with the whole tile. Each
+    // pixel has its own random stream of the seed, so the result doesn't
+    // depend on tiles
+    virtual void traceTile(const int x0, const int y0, const int x1,
+                           const int y1, const Film &film, const Scene &scene,
+                           const uint64_t seed, RGBColor pixels[]) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                Sampler sampler(seed, (uint64_t)y * film.width + x);
+                pixels[(y - y0) * (x1 - x0) + x - x0] =
+                    this->tracePixel(x, y, film, scene, sampler);
+            }
+        }
+    }
+    // Save the pixels of a tile traced by traceTile in the result
+    virtual void storeTile(const int x0, const int y0, const int x1,
+                           const int y1, const RGBColor pixels[]) {
+        throw std::domain_error(
+            "This kind of RayTracer doesn't allow for saving results");
+    }
     virtual PPMImage &result() {
         throw std::domain_error(
             "This kind of RayTracer doesn't allow for saving results");
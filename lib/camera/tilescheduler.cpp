@@ -0,0 +1,79 @@
+#include "tilescheduler.h"
+
+TileScheduler::TileScheduler(int width, int height, int tileSize,
+                             int _numWorkers)
+    : numWorkers(_numWorkers), numTaken(0) {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<std::pair<uint32_t, Tile>> codes;
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            // Tiles on the right and bottom borders may be smaller
+            Tile tile = {tx * tileSize, ty * tileSize,
+                         std::min((tx + 1) * tileSize, width),
+                         std::min((ty + 1) * tileSize, height)};
+            codes.push_back(std::make_pair(Morton::encode2(tx, ty), tile));
+        }
+    }
+    std::sort(codes.begin(), codes.end(),
+              [](const std::pair<uint32_t, Tile> &lhs,
+                 const std::pair<uint32_t, Tile> &rhs) {
+                  return lhs.first < rhs.first;
+              });
+    for (const auto &code : codes) {
+        order.push_back(code.second);
+    }
+
+    queues.reset(new Queue[numWorkers]);
+    int numTiles = order.size();
+    for (int w = 0; w < numWorkers; w++) {
+        queues[w].front = numTiles * w / numWorkers;
+        queues[w].back = numTiles * (w + 1) / numWorkers;
+    }
+}
+
+bool TileScheduler::pop(int worker, Tile &tile) {
+    Queue &queue = queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.front == queue.back) {
+        return false;
+    }
+    tile = order[queue.front++];
+    return true;
+}
+
+bool TileScheduler::steal(int worker, int victim) {
+    int front, back;
+    {
+        Queue &queue = queues[victim];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.front == queue.back) {
+            return false;
+        }
+        // The victim keeps the first half (it's working next to it), and
+        // the thief gets at least one tile
+        front = queue.front + (queue.back - queue.front) / 2;
+        back = queue.back;
+        queue.back = front;
+    }
+    Queue &queue = queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.front = front;
+    queue.back = back;
+    return true;
+}
+
+bool TileScheduler::next(int worker, Tile &tile) {
+    while (!this->pop(worker, tile)) {
+        // Steal from the closest worker (in tile order) that has any left
+        bool stolen = false;
+        for (int i = 1; i < numWorkers && !stolen; i++) {
+            stolen = this->steal(worker, (worker + i) % numWorkers);
+        }
+        if (!stolen) {
+            return false;
+        }
+    }
+    numTaken++;
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "math/morton.h"
+
+// Hands out the tiles of an image to a fixed number of workers
+// Tiles are sorted in Morton order and split in one contiguous range per
+// worker, so each worker traces a compact region of the image (and of the
+// scene) and doesn't share image rows with the others. A worker that runs
+// out of tiles steals the last half of the range of another one
+class TileScheduler {
+   public:
+    // Pixels [x0, x1) x [y0, y1)
+    struct Tile {
+        int x0, y0, x1, y1;
+    };
+
+   private:
+    // Tiles left to a worker: order[front..back), only taken with its lock
+    // Padded to a cache line, so workers don't share the ones they use
+    struct Queue {
+        std::mutex mutex;
+        int front, back;
+        char padding[64];
+    };
+
+    std::vector<Tile> order;
+    std::unique_ptr<Queue[]> queues;
+    int numWorkers;
+    std::atomic<int> numTaken;
+
+    // Take the first tile of the worker's own range
+    bool pop(int worker, Tile &tile);
+    // Move the second half of victim's range to worker's (empty) one
+    bool steal(int worker, int victim);
+
+   public:
+    TileScheduler(int width, int height, int tileSize, int _numWorkers);
+
+    // Next tile for worker, false if all of them have been taken
+    bool next(int worker, Tile &tile);
+
+    inline int numTiles() const { return order.size(); }
+    // Tiles taken so far (tracing or already traced)
+    inline int tilesTaken() const { return numTaken.load(); }
+};
@@ -0,0 +1,79 @@
+#include "mappedfile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+MappedFile::MappedFile(const std::string &filename)
+    : data(nullptr), size(0), position(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void *mapped =
+            mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            data = static_cast<const char *>(mapped);
+            size = info.st_size;
+        }
+    }
+    // The mapping stays valid after closing the file
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        munmap(const_cast<char *>(data), size);
+    }
+}
+
+BinaryWriter::BinaryWriter(const std::string &_filename)
+    : filename(_filename) {
+    // Unique for every process and thread writing the same file
+    temporary = filename + "." + std::to_string(getpid()) + "." +
+                std::to_string(
+                    std::hash<std::thread::id>()(std::this_thread::get_id())) +
+                ".tmp";
+    os.open(temporary, std::ios::binary | std::ios::trunc);
+}
+
+BinaryWriter::~BinaryWriter() {
+    if (os.is_open()) {
+        this->close();
+    }
+}
+
+bool BinaryWriter::close() {
+    bool written = os.is_open() && os.good();
+    os.close();
+    written = written && !os.fail() &&
+              std::rename(temporary.c_str(), filename.c_str()) == 0;
+    if (!written) {
+        std::remove(temporary.c_str());
+    }
+    return written;
+}
+
+uint64_t hashBytes(const void *bytes, size_t size, uint64_t seed) {
+    const uint64_t PRIME = 0x100000001b3ULL;
+    const char *data = static_cast<const char *>(bytes);
+    uint64_t hash = seed;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(uint64_t));
+        hash = (hash ^ word) * PRIME;
+        // Multiplying only carries bits upwards, bring high ones down
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * PRIME;
+    }
+    return hash;
+}
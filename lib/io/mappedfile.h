@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Read-only view of a whole file, mapped in memory with mmap so it's only
+// read from disk as it's used (and shared with other processes mapping it)
+// Values are read in order, in the format written by BinaryWriter: plain
+// values as they are in memory, and arrays preceded by their length and
+// size of their elements (so a file written with other types is rejected)
+class MappedFile {
+   private:
+    const char *data;
+    size_t size, position;
+
+   public:
+    // If the file can't be opened, isOpen() is false and nothing is read
+    MappedFile(const std::string &filename);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    inline bool isOpen() const { return data != nullptr; }
+    inline const char *bytes() const { return data; }
+    inline size_t length() const { return size; }
+
+    // Both return false if the file is too short for what's being read
+    template <typename T>
+    bool read(T &value) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "Only plain values can be read from a file");
+        if (data == nullptr || size - position < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, data + position, sizeof(T));
+        position += sizeof(T);
+        return true;
+    }
+    template <typename T>
+    bool read(std::vector<T> &values) {
+        uint64_t count, elementSize;
+        if (!read(count) || !read(elementSize) || elementSize != sizeof(T) ||
+            count > (size - position) / sizeof(T)) {
+            return false;
+        }
+        const T *first = reinterpret_cast<const T *>(data + position);
+        values.assign(first, first + count);
+        position += count * sizeof(T);
+        return true;
+    }
+};
+
+// Writes a file that can be read with MappedFile. It's written to a
+// temporary file first and moved to its place on close, so a file being
+// written by another thread or process is never read half-written
+class BinaryWriter {
+   private:
+    std::string filename, temporary;
+    std::ofstream os;
+
+   public:
+    BinaryWriter(const std::string &filename);
+    ~BinaryWriter();
+
+    template <typename T>
+    void write(const T &value) {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "Only plain values can be written to a file");
+        os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+    template <typename T>
+    void write(const std::vector<T> &values) {
+        write((uint64_t)values.size());
+        write((uint64_t)sizeof(T));
+        os.write(reinterpret_cast<const char *>(values.data()),
+                 values.size() * sizeof(T));
+    }
+
+    // Returns false if the file couldn't be written (it's removed)
+    bool close();
+};
+
+// 64 bit hash based on FNV-1a, a word (8 bytes) at a time instead of a
+// byte at a time to hash big files fast. Not suitable against malicious
+// input, but good enough to tell if a cached file is still up to date
+uint64_t hashBytes(const void *bytes, size_t size,
+                   uint64_t seed = 0xcbf29ce484222325ULL);
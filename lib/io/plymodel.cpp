@@ -1,12 +1,47 @@
 #include "plymodel.h"
 
-PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
-    : uvMaterial(_uvMaterial) {
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <cctype>
+
+// Uncomment to always parse PLY files and build their meshes, without
+// reading or writing any cache file
+// #define DEBUG_NO_PLY_CACHE
+
+PLYModel::PLYModel(const char *_filename, const UVMaterialPtr &_uvMaterial)
+    : filename(_filename),
+      fileHash(0),
+      uvMaterial(_uvMaterial),
+      maxDuplication(0.0f),
+      useKdTree(false),
+      compressTree(false),
+      lazyTree(false),
+      treeCost(0.0f) {
+    MappedFile ply(filename);
+    if (!ply.isOpen()) {
+        std::cerr << "Can't open file " << filename << std::endl;
+        return;
+    }
+    // Hashing the file is much faster than parsing it
+    this->fileHash = hashBytes(ply.bytes(), ply.length());
+#ifndef DEBUG_NO_PLY_CACHE
+    if (this->loadCache()) {
+        return;
+    }
+#endif
+    if (this->parse()) {
+#ifndef DEBUG_NO_PLY_CACHE
+        this->saveCache();
+#endif
+    }
+}
+
+bool PLYModel::parse() {
     std::ifstream is(filename);
     if (!is.is_open()) {
         std::cerr << "Can't open file " << filename << std::endl;
-        is.close();
-        return;
+        return false;
     }
 
     // Read PLY file
@@ -17,7 +52,7 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
     if (ply != "ply" || format != "format ascii 1.0") {
         std::cerr << "Unsupported PLY file format (only ascii 1.0 format)"
                   << std::endl;
-        return;
+        return false;
     }
     // read line-by-line until header end
     bool hasUV = false;  // model has UV mapping included
@@ -42,7 +77,7 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
                     propy != "property float y" ||
                     propz != "property float z") {
                     std::cerr << "Unsupported vertex properties" << std::endl;
-                    return;
+                    return false;
                 }
                 // Check for optional UV mapping data (s, t)
                 std::getline(is, line);
@@ -57,7 +92,7 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
                     } else {
                         // Can't have s without t
                         std::cerr << "Invalid UV information" << std::endl;
-                        return;
+                        return false;
                     }
                 }
                 // Already has read the next line
@@ -69,14 +104,14 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
                 std::getline(is, propf);
                 if (propf != "property list uchar uint vertex_indices") {
                     std::cerr << "Unsupported face properties" << std::endl;
-                    return;
+                    return false;
                 }
                 // Read next line
                 std::getline(is, line);
             } else {
                 std::cerr << "Unsupported element info in PLY file"
                           << std::endl;
-                return;
+                return false;
             }
         }
     }
@@ -84,11 +119,11 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
     // Check valid header info
     if (is.eof()) {
         std::cerr << "Reading PLY file ended unexpectedly" << std::endl;
-        return;
+        return false;
     }
     if (verts.size() == 0 || faces.size() == 0) {
         std::cerr << "Invalid header (vert or face info)" << std::endl;
-        return;
+        return false;
     }
 
     // Read vert and face info
@@ -105,7 +140,7 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
         if (fsize != 3) {
             std::cerr << "Only triangles are supported for PLY files"
                       << std::endl;
-            return;
+            return false;
         }
         is >> faces[f][0] >> faces[f][1] >> faces[f][2];
     }
@@ -113,9 +148,58 @@ PLYModel::PLYModel(const char *filename, const UVMaterialPtr &_uvMaterial)
     // Check if file was read correctly
     if (is.eof()) {
         std::cerr << "Reading PLY file ended unexpectedly" << std::endl;
-        return;
+        return false;
     }
     is.close();
+    return true;
+}
+
+bool PLYModel::loadCache() {
+    MappedFile cache(filename + ".cache");
+    uint64_t magic, hash;
+    uint32_t version;
+    if (!cache.read(magic) || !cache.read(version) || !cache.read(hash) ||
+        magic != CACHE_MAGIC || version != CACHE_VERSION ||
+        hash != fileHash) {
+        return false;
+    }
+    std::vector<Vec4> cachedVerts;
+    std::vector<std::array<int, 3>> cachedFaces;
+    std::vector<std::array<float, 2>> cachedUvs;
+    if (!cache.read(cachedVerts) || !cache.read(cachedFaces) ||
+        !cache.read(cachedUvs)) {
+        return false;
+    }
+    // A damaged cache is parsed again instead of used (UVs are optional)
+    int nverts = cachedVerts.size();
+    if (!cachedUvs.empty() && cachedUvs.size() != nverts) {
+        return false;
+    }
+    for (const std::array<int, 3> &face : cachedFaces) {
+        for (int v : face) {
+            if (v < 0 || v >= nverts) {
+                return false;
+            }
+        }
+    }
+    this->verts = std::move(cachedVerts);
+    this->faces = std::move(cachedFaces);
+    this->uvs = std::move(cachedUvs);
+    return true;
+}
+
+void PLYModel::saveCache() const {
+    BinaryWriter cache(filename + ".cache");
+    cache.write((uint64_t)CACHE_MAGIC);
+    cache.write((uint32_t)CACHE_VERSION);
+    cache.write(fileHash);
+    cache.write(verts);
+    cache.write(faces);
+    cache.write(uvs);
+    if (!cache.close()) {
+        std::cerr << "Can't write cache file " << filename << ".cache"
+                  << std::endl;
+    }
 }
 
 void PLYModel::transform(const Mat4 &modelMatrix) {
@@ -128,107 +212,128 @@ MaterialPtr PLYModel::material(const float uvx, const float uvy) const {
     return uvMaterial->get(uvx, uvy);
 }
 
-void PLYModel::getBoundingBox(const std::vector<int> &findex, Vec4 &bb0,
-                              Vec4 &bb1) const {
-    // Initialise with first vertex of first face
-    bb0 = Vec4(this->vert(this->face(findex[0])[0]));
-    bb1 = Vec4(this->vert(this->face(findex[0])[0]));
-    // Check against all vertices of all faces
-    for (int fi : findex) {
-        std::array<int, 3> vi = this->face(fi);
-        for (int i = 0; i < 3; i++) {
-            Vec4 v = this->vert(vi[i]);
-            // save min components in bb0
-            bb0.x = v.x < bb0.x ? v.x : bb0.x;
-            bb0.y = v.y < bb0.y ? v.y : bb0.y;
-            bb0.z = v.z < bb0.z ? v.z : bb0.z;
-            // save max components in bb1
-            bb1.x = v.x > bb1.x ? v.x : bb1.x;
-            bb1.y = v.y > bb1.y ? v.y : bb1.y;
-            bb1.z = v.z > bb1.z ? v.z : bb1.z;
+FigurePtr PLYModel::getFigure() {
+    std::shared_ptr<Figures::Mesh> root;
+    if (lazyTree) {
+        root.reset(new Figures::Mesh(verts, faces, uvs, uvMaterial, 0.0f,
+                                     false, false, true));
+        this->treeCost = 0.0f;
+        this->mesh = root;
+        std::cout << "PLY model with " << this->nfaces()
+                  << " triangles has a tree built on demand" << std::endl;
+        return root;
+    }
+#ifndef DEBUG_NO_PLY_CACHE
+    // The mesh only depends on the model's current state and settings (and
+    // the tree builder's ones, saved and checked by the mesh)
+    uint64_t hash = hashBytes(verts.data(), verts.size() * sizeof(Vec4));
+    hash = hashBytes(faces.data(), faces.size() * sizeof(faces[0]), hash);
+    hash = hashBytes(uvs.data(), uvs.size() * sizeof(uvs[0]), hash);
+    hash = hashBytes(&maxDuplication, sizeof(maxDuplication), hash);
+    hash = hashBytes(&useKdTree, sizeof(useKdTree), hash);
+    hash = hashBytes(&compressTree, sizeof(compressTree), hash);
+    char hashName[17];
+    snprintf(hashName, sizeof(hashName), "%016llx", (unsigned long long)hash);
+    std::string cacheName = filename + "." + hashName + ".cache";
+    {
+        MappedFile cache(cacheName);
+        uint64_t magic;
+        uint32_t version;
+        if (cache.read(magic) && cache.read(version) &&
+            magic == CACHE_MAGIC && version == CACHE_VERSION) {
+            root = Figures::Mesh::load(cache, uvMaterial);
         }
     }
+    if (root != nullptr) {
+        // Mark it as used (mapping it doesn't), see pruneMeshCaches
+        utime(cacheName.c_str(), nullptr);
+    }
+#endif
+    bool cached = root != nullptr;
+    if (!cached) {
+        // Mesh copies all vertices & faces, and builds the tree
+        root.reset(new Figures::Mesh(verts, faces, uvs, uvMaterial,
+                                     maxDuplication, useKdTree,
+                                     compressTree));
+#ifndef DEBUG_NO_PLY_CACHE
+        BinaryWriter cache(cacheName);
+        cache.write((uint64_t)CACHE_MAGIC);
+        cache.write((uint32_t)CACHE_VERSION);
+        root->save(cache);
+        if (!cache.close()) {
+            std::cerr << "Can't write cache file " << cacheName << std::endl;
+        }
+        this->pruneMeshCaches();
+#endif
+    }
+    this->treeCost = root->getCost();
+    this->mesh = root;
+    std::cout << "PLY model with " << this->nfaces()
+              << " triangles has SAH cost " << this->treeCost
+              << (cached ? " (cached)" : "") << std::endl;
+    return root;
 }
 
-FigurePtr PLYModel::divideNode(const FigurePtrVector &triangles,
-                               const std::vector<int> &findex,
-                               std::vector<Vec4 *>::iterator &vbegin,
-                               std::vector<Vec4 *>::iterator &vend,
-                               int numIterations) {
-    // Find bounding box of all vertices
-    Vec4 bb0, bb1;
-    this->getBoundingBox(findex, bb0, bb1);
-    FigurePtr nodeBbox = FigurePtr(new Figures::Box(bb0, bb1));
-    if (numIterations == 0) {
-        // Add all triangles that correspond to the faces inside bbox
-        FigurePtrVector nodeTriangles;
-        for (int fi : findex) {
-            nodeTriangles.push_back(triangles[fi]);
-        }
-        // Generate child node (children are triangles, not kdnodes)
-        return FigurePtr(new Figures::BVNode(nodeTriangles, nodeBbox));
-    } else {
-        // Find biggest axis in bbox, store in axis
-        // dot(axis, vector) only has vector's desired axis
-        Vec4 bbox = bb1 - bb0;
-        Vec4 axis(0.0f, 0.0f, 0.0f, 0.0f);
-        if (bbox.x > bbox.y && bbox.x > bbox.z) {
-            axis.x = 1.0f;
-        } else if (bbox.y > bbox.x && bbox.y > bbox.z) {
-            axis.y = 1.0f;
-        } else {
-            axis.z = 1.0f;
+void PLYModel::pruneMeshCaches() const {
+    // Mesh caches are filename.<16 hex digits>.cache, next to the PLY file
+    size_t slash = filename.find_last_of('/');
+    std::string dir =
+        slash == std::string::npos ? "." : filename.substr(0, slash);
+    std::string prefix = filename.substr(slash + 1) + ".";  // npos + 1 = 0
+    const std::string suffix = ".cache";
+    DIR *entries = opendir(dir.c_str());
+    if (entries == nullptr) {
+        return;
+    }
+    std::vector<std::pair<time_t, std::string>> caches;
+    while (dirent *entry = readdir(entries)) {
+        std::string name = entry->d_name;
+        if (name.size() != prefix.size() + 16 + suffix.size() ||
+            name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(prefix.size() + 16, suffix.size(), suffix) != 0 ||
+            !std::all_of(name.begin() + prefix.size(),
+                         name.begin() + prefix.size() + 16,
+                         [](char c) { return std::isxdigit(c) != 0; })) {
+            continue;
         }
-        // Find median of all vertices' coordinates in that axis
-        std::vector<Vec4 *>::iterator vmedian = vbegin + (vend - vbegin) / 2;
-        std::nth_element(vbegin, vmedian, vend,
-                         [&axis](const Vec4 *lhs, const Vec4 *rhs) {
-                             return dot(*lhs, axis) < dot(*rhs, axis);
-                         });
-        // Find all triangles that correspond to first half and second half
-        std::vector<int> findexFirst, findexLast;
-        for (int fi : findex) {
-            std::array<int, 3> vi = this->face(fi);
-            // If it has any of its vertices inside the bbox, add it to first
-            if (std::find(vbegin, vmedian, &verts[vi[0]]) != vmedian ||
-                std::find(vbegin, vmedian, &verts[vi[1]]) != vmedian ||
-                std::find(vbegin, vmedian, &verts[vi[2]]) != vmedian) {
-                findexFirst.push_back(fi);
-            }
-            // Same for last
-            if (std::find(vmedian, vend, &verts[vi[0]]) != vend ||
-                std::find(vmedian, vend, &verts[vi[1]]) != vend ||
-                std::find(vmedian, vend, &verts[vi[2]]) != vend) {
-                findexLast.push_back(fi);
-            }
+        std::string path = dir + "/" + name;
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0) {
+            caches.push_back(std::make_pair(info.st_mtime, path));
         }
-        // Further subdivide children nodes
-        FigurePtr leftChild = this->divideNode(triangles, findexFirst, vbegin,
-                                               vmedian, numIterations - 1);
-        FigurePtr rightChild = this->divideNode(triangles, findexLast, vmedian,
-                                                vend, numIterations - 1);
-        return FigurePtr(
-            new Figures::KdTreeNode(leftChild, rightChild, nodeBbox));
+    }
+    closedir(entries);
+    // Most recently used (loaded or written) first
+    std::sort(caches.begin(), caches.end(),
+              [](const std::pair<time_t, std::string> &lhs,
+                 const std::pair<time_t, std::string> &rhs) {
+                  return lhs.first > rhs.first;
+              });
+    for (int i = MAX_MESH_CACHES; i < caches.size(); i++) {
+        std::remove(caches[i].second.c_str());
     }
 }
 
-FigurePtr PLYModel::getFigure(int subdivisions) {
-    // Create vector of all triangles & faces to be used
-    FigurePtrVector triangles;
-    std::vector<int> faceIndexes;
-    for (int f = 0; f < this->nfaces(); f++) {
-        faceIndexes.push_back(f);
-        std::array<int, 3> vi = this->face(f);  // face = vertex indices
-        triangles.push_back(
-            FigurePtr(new Figures::Triangle(this, vi[0], vi[1], vi[2])));
-    }
-    // Same with pointers to vertices
-    std::vector<Vec4 *> vertexPtrs;
-    for (int v = 0; v < this->nverts(); v++) {
-        vertexPtrs.push_back(&verts[v]);
+bool PLYModel::updateFigure(float maxCostRatio) {
+    if (mesh == nullptr) {
+        throw std::domain_error("PLY model doesn't have a figure to update");
     }
-    // Call divideNode, which optimizes the model with given subdivisions
-    std::vector<Vec4 *>::iterator vbegin = std::begin(vertexPtrs);
-    std::vector<Vec4 *>::iterator vend = std::end(vertexPtrs);
-    return this->divideNode(triangles, faceIndexes, vbegin, vend, subdivisions);
-}
\ No newline at end of file
+    bool rebuilt = mesh->setVertices(verts, maxCostRatio);
+    this->treeCost = mesh->getCost();
+    return rebuilt;
+}
+
+std::vector<FigurePtr> PLYModel::getFigures(
+    const std::vector<PLYModel *> &models) {
+    // Each model is built in its own task (and their trees use more)
+    std::vector<std::future<FigurePtr>> builds;
+    for (PLYModel *model : models) {
+        builds.push_back(
+            ThreadPool::global().submit([=]() { return model->getFigure(); }));
+    }
+    std::vector<FigurePtr> figures;
+    for (auto &build : builds) {
+        figures.push_back(ThreadPool::global().wait(build));
+    }
+    return figures;
+}
@@ -1,39 +1,69 @@
 #pragma once
 
 class PLYModel;
+namespace Figures {
+class Mesh;
+}  // namespace Figures
 
 #include <algorithm>
 #include <array>
+#include <cstdio>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <vector>
+#include "io/mappedfile.h"
 #include "math/geometry.h"
 #include "math/rgbcolor.h"
+#include "parallel/threadpool.h"
 #include "scene/figures.h"
 #include "scene/uvmaterial.h"
 
+// The parsed model and its meshes are cached in binary files next to the
+// PLY file (see getFigure), so next runs can skip parsing and building
 class PLYModel {
    private:
+    // Cache files start with this, version must change with their format
+    static const uint64_t CACHE_MAGIC = 0x4548434143594c50ULL;  // PLYCACHE
+    static const uint32_t CACHE_VERSION = 5;
+    // Mesh caches kept for each PLY file (see getFigure)
+    static const int MAX_MESH_CACHES = 4;
+
+    std::string filename;
+    // Hash of the PLY file's contents
+    uint64_t fileHash;
+
     std::vector<Vec4> verts;
     std::vector<std::array<int, 3>> faces;
     std::vector<std::array<float, 2>> uvs;
 
     const UVMaterialPtr uvMaterial;
+    // Extra references allowed for spatial splits (see setSpatialSplits)
+    float maxDuplication;
+    // Build a k-d tree instead of a BVH (see setKdTree)
+    bool useKdTree;
+    // Build BVHs with compressed nodes (see setCompressedTree)
+    bool compressTree;
+    // Build trees on demand (see setLazyTree)
+    bool lazyTree;
+
+    // SAH cost of the last tree generated by getFigure
+    float treeCost;
+    // Last mesh generated by getFigure, updated by updateFigure
+    std::shared_ptr<Figures::Mesh> mesh;
 
-    // Find bounding box of all faces whose indexes are in findex
-    // Box defined as 2 points: min (bb0) and max (bb1)
-    void getBoundingBox(const std::vector<int> &findex, Vec4 &bb0,
-                        Vec4 &bb1) const;
-    // Returns a FigurePtr containing either:
-    // - numIterations == 0: BVNode whose children are triangles
-    // - numIterations > 0: Divide model in half on its biggest axis,
-    //                      return KdTreeNode with those two children
-    FigurePtr divideNode(const FigurePtrVector &triangles,
-                         const std::vector<int> &findex,
-                         std::vector<Vec4 *>::iterator &vbegin,
-                         std::vector<Vec4 *>::iterator &vend,
-                         int numIterations);
+    // Read vertices, faces and UVs from the PLY file, false on error
+    bool parse();
+    // Read/write the parsed model from/to filename.cache, only valid if
+    // it has been written for a PLY file with the same hash and its faces'
+    // vertices are in range
+    bool loadCache();
+    void saveCache() const;
+    // Delete the least recently used mesh caches of the PLY file, keeping
+    // only MAX_MESH_CACHES of them
+    void pruneMeshCaches() const;
 
    public:
     PLYModel(const char *filename, const UVMaterialPtr &uvMaterial);
@@ -49,7 +79,51 @@ class PLYModel {
 
     // Apply model matrix to all vertices
     void transform(const Mat4 &modelMatrix);
+    // Build the trees of the next meshes from getFigure with spatial splits
+    // (SBVH), allowing up to maxDuplication * nfaces() extra references to
+    // faces (e.g. 0.3). It takes longer and more memory, but traversal is
+    // faster in meshes with big, long or thin triangles. 0 disables them
+    void setSpatialSplits(float _maxDuplication) {
+        maxDuplication = _maxDuplication;
+    }
+    // Build the next meshes from getFigure with a k-d tree instead of a BVH
+    // (spatial splits are ignored then). Its leaves don't overlap, so
+    // closest hits are found sooner in scenes seen from inside (e.g. rooms)
+    // but rays aren't traced in packets
+    void setKdTree(bool _useKdTree) { useKdTree = _useKdTree; }
+    // Build the BVH of the next meshes from getFigure with compressed nodes,
+    // for models with tens of millions of faces: the tree and its leaves'
+    // faces take about 8 times less memory (9 MB instead of 73 MB with 1M
+    // faces, 31 MB instead of 95 MB counting the mesh itself), but
+    // traversal is slower and the tree is built again instead of refit in
+    // updateFigure
+    void setCompressedTree(bool _compressTree) {
+        compressTree = _compressTree;
+    }
+    // Only build the root of the next meshes' trees from getFigure, the
+    // rest is built by the rays that reach it while rendering (see
+    // LazyBVH), so the first pixels are ready sooner and the faces that
+    // are never seen aren't even sorted. Other tree settings are ignored,
+    // and these meshes aren't cached
+    void setLazyTree(bool _lazyTree) { lazyTree = _lazyTree; }
 
-    // Get FigurePtr representing the model
-    FigurePtr getFigure(int subdivisions = 1);
+    // Get FigurePtr representing the model, as a triangle mesh with a
+    // bounding volume hierarchy built using the surface area heuristic (SAH)
+    // The mesh has its own copy of the model, so it can be destroyed
+    // Meshes are saved to filename.<hash>.cache, where the hash is made of
+    // the model's current vertices, faces, UVs and tree settings,
+    // so the same mesh is loaded from it instead of built while they don't
+    // change. Every change writes a new one: only the MAX_MESH_CACHES most
+    // recently used of them are kept, older ones are deleted
+    FigurePtr getFigure();
+    // Same as getFigure for several models, building all of them at once
+    static std::vector<FigurePtr> getFigures(
+        const std::vector<PLYModel *> &models);
+    // Move the vertices of the last figure got from getFigure to the
+    // model's current ones (e.g. after transform), refitting its tree
+    // instead of building it again (see Figures::Mesh::setVertices)
+    // Returns true if the tree has been built again anyway
+    bool updateFigure(float maxCostRatio = 0.0f);
+    // SAH cost of the last tree built by getFigure (lower is better)
+    float getTreeCost() const { return treeCost; }
 };
\ No newline at end of file
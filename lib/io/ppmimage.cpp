@@ -1,5 +1,6 @@
 #include "ppmimage.h"
 #include <fstream>
+#include <sstream>
 #include "pngimage.h"
 
 void PPMImage::clearData(int width, int height) {
@@ -121,28 +122,37 @@ bool PPMImage::writeFile(const char* filename, bool ldr) const {
     } else {
         os << colorResolution << std::endl;
     }
-    // Pixel color data
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if (ldr) {
-                // Assumes color data is on 0..1 range
-                os << int(data[y][x].r * LDR_RESOLUTION) << " "
-                   << int(data[y][x].g * LDR_RESOLUTION) << " "
-                   << int(data[y][x].b * LDR_RESOLUTION) << "     ";
-            } else {
-                // Write data in same HDR range
+    // Pixel color data, formatted by several threads (a range of rows each)
+    // and written in order
+    ThreadPool &pool = ThreadPool::global();
+    std::vector<std::ostringstream> chunks(pool.size());
+    pool.parallelFor(0, height, chunks.size(), [&](int y0, int y1, int chunk) {
+        std::ostringstream &rows = chunks[chunk];
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                if (ldr) {
+                    // Assumes color data is on 0..1 range
+                    rows << int(data[y][x].r * LDR_RESOLUTION) << " "
+                         << int(data[y][x].g * LDR_RESOLUTION) << " "
+                         << int(data[y][x].b * LDR_RESOLUTION) << "     ";
+                } else {
+                    // Write data in same HDR range
 #define clamp(value) \
     ((unsigned)(value) > colorResolution ? colorResolution : (unsigned)(value))
-                float rangeR = std::fmin(1.0f, data[y][x].r / max);
-                float rangeG = std::fmin(1.0f, data[y][x].g / max);
-                float rangeB = std::fmin(1.0f, data[y][x].b / max);
-                os << clamp(rangeR * colorResolution) << " "
-                   << clamp(rangeG * colorResolution) << " "
-                   << clamp(rangeB * colorResolution) << "     ";
+                    float rangeR = std::fmin(1.0f, data[y][x].r / max);
+                    float rangeG = std::fmin(1.0f, data[y][x].g / max);
+                    float rangeB = std::fmin(1.0f, data[y][x].b / max);
+                    rows << clamp(rangeR * colorResolution) << " "
+                         << clamp(rangeG * colorResolution) << " "
+                         << clamp(rangeB * colorResolution) << "     ";
 #undef clamp
+                }
             }
+            rows << std::endl;
         }
-        os << std::endl;
+    });
+    for (const std::ostringstream &chunk : chunks) {
+        os << chunk.str();
     }
 
     return true;
@@ -151,23 +161,25 @@ bool PPMImage::writeFile(const char* filename, bool ldr) const {
 void PPMImage::applyToneMap(PPMImage& result, const ToneMapper& tm,
                             bool useLab) {
     result.initialize(width, height, colorResolution, max);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if (useLab) {
-                // Convert RGB data to Lab data
-                RGBColor labColor = data[y][x].rgb2lab(max);
-                // Map [0, max] luminance to [0, 1] using tm.map function
-                labColor.lab.l = tm.map(labColor.lab.l);
-                // Convert back to RGB
-                result.data[y][x] = labColor.lab2rgb(max);
-            } else {
-                // Map [0, max] RGB components to [0, 1]
-                result.data[y][x].r = tm.map(data[y][x].r);
-                result.data[y][x].g = tm.map(data[y][x].g);
-                result.data[y][x].b = tm.map(data[y][x].b);
+    ThreadPool::global().parallelFor(0, height, [&](int y0, int y1, int) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                if (useLab) {
+                    // Convert RGB data to Lab data
+                    RGBColor labColor = data[y][x].rgb2lab(max);
+                    // Map [0, max] luminance to [0, 1] using tm.map function
+                    labColor.lab.l = tm.map(labColor.lab.l);
+                    // Convert back to RGB
+                    result.data[y][x] = labColor.lab2rgb(max);
+                } else {
+                    // Map [0, max] RGB components to [0, 1]
+                    result.data[y][x].r = tm.map(data[y][x].r);
+                    result.data[y][x].g = tm.map(data[y][x].g);
+                    result.data[y][x].b = tm.map(data[y][x].b);
+                }
             }
         }
-    }
+    });
 }
 
 void PPMImage::fillPixels(const RGBColor& backgroundColor) {
@@ -187,6 +199,15 @@ void PPMImage::setPixel(const int x, const int y, const RGBColor& color) {
     }
 }
 
+void PPMImage::setPixels(const int x0, const int y0, const int x1,
+                         const int y1, const RGBColor colors[]) {
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            this->setPixel(x, y, colors[(y - y0) * (x1 - x0) + x - x0]);
+        }
+    }
+}
+
 RGBColor PPMImage::getPixel(const int x, const int y) const {
     RGBColor color;
     if (x >= 0 && x < this->width && y >= 0 && y < this->height) {
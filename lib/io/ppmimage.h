@@ -6,6 +6,7 @@ class PPMImage;
 #include <vector>
 #include "io/pngimage.h"
 #include "io/tonemapper.h"
+#include "parallel/threadpool.h"
 #include "math/rgbcolor.h"
 
 /*
@@ -65,6 +66,9 @@ class PPMImage {
     void flipVertically();
 
     void setPixel(const int x, const int y, const RGBColor& color);
+    // Set pixels [x0, x1) x [y0, y1) from colors (row by row)
+    void setPixels(const int x0, const int y0, const int x1, const int y1,
+                   const RGBColor colors[]);
     RGBColor getPixel(const int x, const int y) const;
 
     void addImage(const PPMImage &image);
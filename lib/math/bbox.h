@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include "math/geometry.h"
+
+// Axis-aligned bounding box, defined by its min (bb0) and max (bb1) corners
+// Default constructed boxes are empty (bb0 > bb1) and grow with extend()
+struct BBox {
+    Vec4 bb0, bb1;
+
+    BBox()
+        : bb0(std::numeric_limits<float>::max(),
+              std::numeric_limits<float>::max(),
+              std::numeric_limits<float>::max(), 1.0f),
+          bb1(std::numeric_limits<float>::max() * -1.0f,
+              std::numeric_limits<float>::max() * -1.0f,
+              std::numeric_limits<float>::max() * -1.0f, 1.0f) {}
+    BBox(const Vec4 &_bb0, const Vec4 &_bb1) : bb0(_bb0), bb1(_bb1) {}
+
+    inline bool empty() const {
+        return bb0.x > bb1.x || bb0.y > bb1.y || bb0.z > bb1.z;
+    }
+
+    // Grow box so it contains point p
+    inline void extend(const Vec4 &p) {
+        bb0.x = std::fmin(bb0.x, p.x);
+        bb0.y = std::fmin(bb0.y, p.y);
+        bb0.z = std::fmin(bb0.z, p.z);
+        bb1.x = std::fmax(bb1.x, p.x);
+        bb1.y = std::fmax(bb1.y, p.y);
+        bb1.z = std::fmax(bb1.z, p.z);
+    }
+    // Grow box so it contains other box
+    inline void extend(const BBox &other) {
+        bb0.x = std::fmin(bb0.x, other.bb0.x);
+        bb0.y = std::fmin(bb0.y, other.bb0.y);
+        bb0.z = std::fmin(bb0.z, other.bb0.z);
+        bb1.x = std::fmax(bb1.x, other.bb1.x);
+        bb1.y = std::fmax(bb1.y, other.bb1.y);
+        bb1.z = std::fmax(bb1.z, other.bb1.z);
+    }
+
+    // Box contained in both boxes (empty if they don't overlap)
+    inline BBox intersection(const BBox &other) const {
+        return BBox(Vec4(std::fmax(bb0.x, other.bb0.x),
+                         std::fmax(bb0.y, other.bb0.y),
+                         std::fmax(bb0.z, other.bb0.z), 1.0f),
+                    Vec4(std::fmin(bb1.x, other.bb1.x),
+                         std::fmin(bb1.y, other.bb1.y),
+                         std::fmin(bb1.z, other.bb1.z), 1.0f));
+    }
+
+    inline Vec4 centroid() const {
+        return Vec4((bb0.x + bb1.x) * 0.5f, (bb0.y + bb1.y) * 0.5f,
+                    (bb0.z + bb1.z) * 0.5f, 1.0f);
+    }
+    inline Vec4 diagonal() const { return bb1 - bb0; }
+
+    // Axis (0 = x, 1 = y, 2 = z) where the box is the biggest
+    inline int maxAxis() const {
+        Vec4 d = this->diagonal();
+        if (d.x > d.y && d.x > d.z) {
+            return 0;
+        } else if (d.y > d.z) {
+            return 1;
+        } else {
+            return 2;
+        }
+    }
+
+    // Used by the surface area heuristic (SAH), empty boxes have no area
+    inline float surfaceArea() const {
+        if (this->empty()) {
+            return 0.0f;
+        }
+        Vec4 d = this->diagonal();
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+// Morton (Z-order) codes: interleave the bits of integer coordinates, so
+// points that are close in space get close codes
+// https://fgiesen.wordpress.com/2009/12/13/decoding-morton-codes/
+namespace Morton {
+
+// Spread the lowest 16 bits of x to every other bit
+inline uint32_t expandBits2(uint32_t x) {
+    x &= 0x0000ffff;
+    x = (x ^ (x << 8)) & 0x00ff00ff;
+    x = (x ^ (x << 4)) & 0x0f0f0f0f;
+    x = (x ^ (x << 2)) & 0x33333333;
+    x = (x ^ (x << 1)) & 0x55555555;
+    return x;
+}
+
+// 32 bit code of a point with coordinates in 0..65535
+inline uint32_t encode2(uint32_t x, uint32_t y) {
+    return (expandBits2(y) << 1) | expandBits2(x);
+}
+
+// Spread the lowest 10 bits of x to every third bit
+inline uint32_t expandBits3(uint32_t x) {
+    x &= 0x000003ff;
+    x = (x ^ (x << 16)) & 0xff0000ff;
+    x = (x ^ (x << 8)) & 0x0300f00f;
+    x = (x ^ (x << 4)) & 0x030c30c3;
+    x = (x ^ (x << 2)) & 0x09249249;
+    return x;
+}
+
+// 30 bit code of a point with coordinates in 0..1023
+inline uint32_t encode3(uint32_t x, uint32_t y, uint32_t z) {
+    return (expandBits3(z) << 2) | (expandBits3(y) << 1) | expandBits3(x);
+}
+
+// Coordinate of a value in lo..hi (scale is 1 / (hi - lo)) on a grid of
+// 1024 cells, clamped to it
+inline uint32_t quantize(float value, float lo, float scale) {
+    float cell = (value - lo) * scale * 1024.0f;
+    return cell < 0.0f ? 0 : (cell > 1023.0f ? 1023 : (uint32_t)cell);
+}
+
+};  // namespace Morton
@@ -1,32 +1,63 @@
 #pragma once
 
-#include <random>
+#include <cstdint>
 #include "math/geometry.h"
 
-namespace Random {
+// Random number generator owned by whoever needs it (a pixel, a path or a
+// photon), so threads never share one. PCG32, see: https://www.pcg-random.org
+// The numbers only depend on the seed and the stream, so a render can be
+// repeated exactly no matter how the work is split between threads
+class Sampler {
+    uint64_t state;
+    uint64_t increment;  // odd, selects the stream
 
-// Generate random real number from 0..1
-inline float ZeroOne() {
-    static std::random_device rd;
-    static std::mt19937 mtgen(rd());
-    static std::uniform_real_distribution<float> random01(0.0f, 1.0f);
-    return random01(mtgen);
-}
+    // splitmix64 hash, so close streams don't give similar sequences
+    static inline uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+   public:
+    Sampler(uint64_t seed, uint64_t stream)
+        : state(0), increment(mix(stream) << 1 | 1) {
+        this->next();
+        state += mix(seed);
+        this->next();
+    }
+
+    // Uniformly distributed 32 bit integer
+    inline uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + increment;
+        uint32_t xorShifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rotation = old >> 59;
+        return (xorShifted >> rotation) | (xorShifted << (-rotation & 31));
+    }
+
+    // Generate random real number from 0..1 (1 excluded)
+    inline float zeroOne() {
+        return (this->next() >> 8) * (1.0f / 16777216.0f);
+    }
+};
+
+namespace Random {
 
 // Random cos-weighted point on unit hemisphere given cob matrix
-inline Vec4 CosHemisphere(const Mat4 &cob) {
-    float incl = acosf(sqrtf(ZeroOne()));
-    float azim = 2 * M_PI * ZeroOne();
+inline Vec4 CosHemisphere(const Mat4 &cob, Sampler &sampler) {
+    float incl = acosf(sqrtf(sampler.zeroOne()));
+    float azim = 2 * M_PI * sampler.zeroOne();
     return cob * Vec4(sinf(incl) * cosf(azim), sinf(incl) * sinf(azim),
                       cosf(incl), 0.0f);
 }
 
 // Random point on unit sphere
-inline Vec4 Sphere() {
-    float incl = acosf(1.0f - 2.0f * ZeroOne());
-    float azim = 2 * M_PI * ZeroOne();
+inline Vec4 Sphere(Sampler &sampler) {
+    float incl = acosf(1.0f - 2.0f * sampler.zeroOne());
+    float azim = 2 * M_PI * sampler.zeroOne();
     return Vec4(sinf(incl) * cosf(azim), sinf(incl) * sinf(azim), cosf(incl),
                 0.0f);
 }
 
-};  // namespace Random
\ No newline at end of file
+};  // namespace Random
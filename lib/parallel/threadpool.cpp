@@ -0,0 +1,94 @@
+#include "threadpool.h"
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+int ThreadPool::globalThreads = 0;
+bool ThreadPool::globalPinned = false;
+
+ThreadPool::ThreadPool(int numThreads, bool pinned) : stopping(false) {
+    if (numThreads <= 0) {
+        numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    for (int i = 0; i < numThreads; i++) {
+        threads.emplace_back(&ThreadPool::work, this);
+        if (pinned) {
+            pin(threads.back(), i);
+        }
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+ThreadPool &ThreadPool::global() {
+    // Started on first use (thread-safe), stopped when the program ends
+    static ThreadPool pool(globalThreads, globalPinned);
+    return pool;
+}
+
+void ThreadPool::configure(int numThreads, bool pinned) {
+    globalThreads = numThreads;
+    globalPinned = pinned;
+}
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeUp.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;  // stopping, and nothing left to do
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+bool ThreadPool::runPending() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.empty()) {
+            return false;
+        }
+        task = std::move(tasks.front());
+        tasks.pop_front();
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::pin(std::thread &thread, int index) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    // index-th allowed core (wrapping around if there are more threads)
+    int numAllowed = CPU_COUNT(&allowed);
+    int target = index % numAllowed;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+            return;
+        }
+    }
+#endif
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Threads started once and shared by all the parallel work of the program
+// (building trees, emitting photons, rendering, writing images), instead
+// of starting and stopping new ones every time
+// Tasks can submit more tasks and wait for them: a thread that waits runs
+// other queued tasks meanwhile, so nested parallelism can't deadlock
+class ThreadPool {
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;  // protects tasks and stopping
+    std::condition_variable wakeUp;
+    bool stopping;
+
+    // Settings of the global pool (see configure)
+    static int globalThreads;
+    static bool globalPinned;
+
+    // Loop of each thread of the pool
+    void work();
+    // Runs the first queued task, false if there weren't any
+    bool runPending();
+    // Restricts thread to the index-th core the process can use
+    static void pin(std::thread &thread, int index);
+
+   public:
+    // numThreads <= 0 means one per core
+    ThreadPool(int numThreads = 0, bool pinned = false);
+    // Waits for the queued tasks to finish
+    ~ThreadPool();
+
+    inline int size() const { return threads.size(); }
+
+    // Pool shared by the whole program, started the first time it's used
+    static ThreadPool &global();
+    // Settings of the global pool, only used if it hasn't been started
+    // yet: number of threads (<= 0, one per core) and whether each of them
+    // is pinned to a core (the ones the process is allowed to run on, so
+    // several renders can share a machine with taskset)
+    static void configure(int numThreads, bool pinned);
+
+    // Run f() in the pool, returns the future of its result
+    template <typename F>
+    std::future<typename std::result_of<F()>::type> submit(F f) {
+        typedef typename std::result_of<F()>::type T;
+        auto task = std::make_shared<std::packaged_task<T()>>(f);
+        std::future<T> future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.emplace_back([task]() { (*task)(); });
+        }
+        wakeUp.notify_one();
+        return future;
+    }
+
+    // Result of a task of the pool, running other tasks while it's not
+    // finished (the calling thread might be one of the pool's)
+    template <typename T>
+    T wait(std::future<T> &future) {
+        while (future.wait_for(std::chrono::seconds(0)) !=
+               std::future_status::ready) {
+            if (!this->runPending()) {
+                future.wait_for(std::chrono::microseconds(100));
+            }
+        }
+        return future.get();
+    }
+
+    // Calls f(chunkBegin, chunkEnd, chunk) for numChunks consecutive
+    // chunks of [begin, end) in the pool (the last one in this thread),
+    // and waits for all of them
+    template <typename F>
+    void parallelFor(int begin, int end, int numChunks, F f) {
+        std::vector<std::future<void>> futures;
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            int chunkBegin = begin + (long)(end - begin) * chunk / numChunks;
+            int chunkEnd =
+                begin + (long)(end - begin) * (chunk + 1) / numChunks;
+            if (chunk == numChunks - 1) {
+                f(chunkBegin, chunkEnd, chunk);
+            } else {
+                futures.push_back(this->submit([=]() {
+                    f(chunkBegin, chunkEnd, chunk);
+                }));
+            }
+        }
+        for (auto &future : futures) {
+            this->wait(future);
+        }
+    }
+    // Same, with one chunk per thread of the pool
+    template <typename F>
+    void parallelFor(int begin, int end, F f) {
+        this->parallelFor(begin, end, this->size(), f);
+    }
+};
@@ -0,0 +1,761 @@
+#include "bvh.h"
+
+// Adds all nodes of subtree at the end of out, moving its leaves'
+// primitives indexBase positions if they're appended to the indices too
+static void appendSubtree(std::vector<BVH::Node> &out,
+                          const std::vector<BVH::Node> &subtree,
+                          int indexBase = 0) {
+    int base = out.size();
+    for (const BVH::Node &node : subtree) {
+        out.push_back(node);
+        out.back().offset += node.leaf() ? indexBase : base;
+    }
+}
+
+struct BVH::SpatialBuild {
+    const std::vector<Triangle> &triangles;
+    // Minimum overlap of an object split's children to try spatial splits
+    float minOverlap;
+};
+
+BVH::BVH(const std::vector<BBox> &bounds, int _groupSize)
+    : groupSize(_groupSize), cost(0.0f), builtCost(0.0f) {
+    if (bounds.empty()) {
+        return;
+    }
+    indices.resize(bounds.size());
+    for (int i = 0; i < bounds.size(); i++) {
+        indices[i] = i;
+    }
+    // binary tree with at least 1 primitive/leaf has less than 2n nodes
+    nodes.reserve(2 * bounds.size());
+    int threads = ThreadPool::global().size();
+    this->cost = this->buildNode(bounds, 0, bounds.size(), 1, threads, nodes);
+    this->builtCost = cost;
+    nodes.shrink_to_fit();
+}
+
+BVH::BVH(const std::vector<Triangle> &triangles, int _groupSize,
+         float maxDuplication)
+    : groupSize(_groupSize), cost(0.0f), builtCost(0.0f) {
+    if (triangles.empty()) {
+        return;
+    }
+    // Every triangle starts with one reference to its whole bounding box
+    std::vector<Reference> references(triangles.size());
+    BBox rootBounds;
+    for (int i = 0; i < triangles.size(); i++) {
+        references[i].primitive = i;
+        for (const Vec4 &vertex : triangles[i]) {
+            references[i].bounds.extend(vertex);
+        }
+        rootBounds.extend(references[i].bounds);
+    }
+    int maxDuplicates = triangles.size() * std::max(0.0f, maxDuplication);
+    SpatialBuild build = {
+        triangles, rootBounds.surfaceArea() * SPATIAL_SPLIT_MIN_OVERLAP};
+    nodes.reserve(2 * (triangles.size() + maxDuplicates));
+    indices.reserve(triangles.size() + maxDuplicates);
+    int threads = ThreadPool::global().size();
+    this->cost = this->buildSpatialNode(build, references, maxDuplicates, 1,
+                                        threads, nodes, indices);
+    this->builtCost = cost;
+    nodes.shrink_to_fit();
+    indices.shrink_to_fit();
+}
+
+bool BVH::refit(const std::vector<BBox> &bounds, float maxCostRatio) {
+    if (nodes.empty()) {
+        return false;
+    }
+    // Children are always after their parent, so going backwards they
+    // are updated before it
+    std::vector<float> nodeCost(nodes.size());
+    for (int i = nodes.size() - 1; i >= 0; i--) {
+        Node &node = nodes[i];
+        BBox box;
+        if (node.leaf()) {
+            for (int p = node.offset; p < node.offset + node.count; p++) {
+                box.extend(bounds[indices[p]]);
+            }
+            nodeCost[i] = this->groups(node.count) * INTERSECTION_COST;
+        } else {
+            BBox left = nodes[i + 1].bounds();
+            BBox right = nodes[node.offset].bounds();
+            box.extend(left);
+            box.extend(right);
+            nodeCost[i] = interiorCost(box, left, nodeCost[i + 1], right,
+                                       nodeCost[node.offset]);
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            node.bb0[axis] = box.bb0.raw[axis];
+            node.bb1[axis] = box.bb1.raw[axis];
+        }
+    }
+    this->cost = nodeCost[0];
+    if (maxCostRatio > 0.0f && cost > builtCost * maxCostRatio) {
+        *this = BVH(bounds, groupSize);
+        return true;
+    }
+    return false;
+}
+
+void BVH::save(BinaryWriter &file) const {
+    file.write((int)SAH_BINS);
+    file.write((int)MAX_LEAF_SIZE);
+    file.write((float)TRAVERSAL_COST);
+    file.write((float)INTERSECTION_COST);
+    file.write((float)SPATIAL_SPLIT_MIN_OVERLAP);
+    file.write(groupSize);
+    file.write(cost);
+    file.write(builtCost);
+    file.write(nodes);
+    file.write(indices);
+}
+
+bool BVH::load(MappedFile &file, int numPrimitives) {
+    int bins, maxLeafSize;
+    float traversalCost, intersectionCost, minOverlap;
+    BVH tree;
+    if (!file.read(bins) || !file.read(maxLeafSize) ||
+        !file.read(traversalCost) || !file.read(intersectionCost) ||
+        !file.read(minOverlap) || !file.read(tree.groupSize) ||
+        !file.read(tree.cost) || !file.read(tree.builtCost) ||
+        !file.read(tree.nodes) || !file.read(tree.indices)) {
+        return false;
+    }
+    if (bins != SAH_BINS || maxLeafSize != MAX_LEAF_SIZE ||
+        traversalCost != TRAVERSAL_COST ||
+        intersectionCost != INTERSECTION_COST ||
+        minOverlap != SPATIAL_SPLIT_MIN_OVERLAP ||
+        !tree.isValid(numPrimitives)) {
+        return false;
+    }
+    *this = std::move(tree);
+    return true;
+}
+
+bool BVH::isValid(int numPrimitives) const {
+    if (groupSize < 1) {
+        return false;
+    }
+    for (int primitive : indices) {
+        if (primitive < 0 || primitive >= numPrimitives) {
+            return false;
+        }
+    }
+    int numNodes = nodes.size(), numIndices = indices.size();
+    // Levels down to each node (0 if it isn't reached from the root)
+    std::vector<int> depth(numNodes, 0);
+    if (numNodes > 0) {
+        depth[0] = 1;
+    }
+    for (int i = 0; i < numNodes; i++) {
+        const Node &node = nodes[i];
+        if (node.count < 0) {
+            return false;
+        } else if (node.leaf()) {
+            if (node.offset < 0 || node.offset > numIndices - node.count) {
+                return false;
+            }
+        } else if (node.offset <= i + 1 || node.offset >= numNodes ||
+                   node.axis < 0 || node.axis > 2) {
+            return false;
+        } else if (depth[i] > 0) {
+            if (depth[i] == MAX_DEPTH) {
+                return false;
+            }
+            depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+            depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+        }
+    }
+    return true;
+}
+
+BBox BVH::getBoundingBox(int node) const {
+    if (nodes.empty()) {
+        return BBox();
+    }
+    return nodes[node].bounds();
+}
+
+// Binned SAH construction, see:
+// http://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf
+template <typename F>
+BVH::Split BVH::objectSplit(int begin, int end, int chunks, int groupSize,
+                            const BBox &nodeBounds, const BBox &centroidBounds,
+                            F primitiveBounds) {
+    auto groups = [&](int numPrimitives) {
+        return (numPrimitives + groupSize - 1) / groupSize;
+    };
+    Split best;
+    Vec4 cmin = centroidBounds.bb0, extent = centroidBounds.diagonal();
+    float nodeArea = nodeBounds.surfaceArea();
+    float binFactor[3];
+    for (int axis = 0; axis < 3; axis++) {
+        // 0 if all centroids are in the same place
+        binFactor[axis] = extent.raw[axis] < 1e-9f
+                              ? 0.0f
+                              : SAH_BINS * (1.0f - 1e-5f) / extent.raw[axis];
+    }
+
+    // Distribute primitives in bins by their centroid, on all axes
+    struct Bins {
+        int count[3][SAH_BINS] = {};
+        BBox bounds[3][SAH_BINS];
+    };
+    std::vector<Bins> chunkBins(chunks);
+    ThreadPool::global().parallelFor(
+        begin, end, chunks, [&](int b, int e, int chunk) {
+        Bins &bins = chunkBins[chunk];
+        for (int i = b; i < e; i++) {
+            const BBox &primBounds = primitiveBounds(i);
+            Vec4 centroid = primBounds.centroid();
+            for (int axis = 0; axis < 3; axis++) {
+                int bin =
+                    (centroid.raw[axis] - cmin.raw[axis]) * binFactor[axis];
+                bins.count[axis][bin]++;
+                bins.bounds[axis][bin].extend(primBounds);
+            }
+        }
+    });
+    Bins &bins = chunkBins[0];
+    for (int chunk = 1; chunk < chunks; chunk++) {
+        for (int axis = 0; axis < 3; axis++) {
+            for (int bin = 0; bin < SAH_BINS; bin++) {
+                bins.count[axis][bin] += chunkBins[chunk].count[axis][bin];
+                bins.bounds[axis][bin].extend(
+                    chunkBins[chunk].bounds[axis][bin]);
+            }
+        }
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (binFactor[axis] == 0.0f) {
+            continue;
+        }
+        const int *binCount = bins.count[axis];
+        const BBox *binBounds = bins.bounds[axis];
+        // Sweep from the right to get bounds/count of all right sides
+        BBox rightBounds[SAH_BINS];
+        int rightCount[SAH_BINS];
+        BBox accumBounds;
+        int accumCount = 0;
+        for (int bin = SAH_BINS - 1; bin > 0; bin--) {
+            accumBounds.extend(binBounds[bin]);
+            accumCount += binCount[bin];
+            rightBounds[bin] = accumBounds;
+            rightCount[bin] = accumCount;
+        }
+        // Sweep from the left, splitting between bin - 1 and bin
+        accumBounds = BBox();
+        accumCount = 0;
+        for (int bin = 1; bin < SAH_BINS; bin++) {
+            accumBounds.extend(binBounds[bin - 1]);
+            accumCount += binCount[bin - 1];
+            if (accumCount == 0 || rightCount[bin] == 0) {
+                continue;
+            }
+            float splitCost =
+                TRAVERSAL_COST +
+                INTERSECTION_COST *
+                    (accumBounds.surfaceArea() * groups(accumCount) +
+                     rightBounds[bin].surfaceArea() *
+                         groups(rightCount[bin])) /
+                    nodeArea;
+            if (splitCost < best.cost) {
+                best.axis = axis;
+                best.bin = bin;
+                best.cost = splitCost;
+                best.binMin = cmin.raw[axis];
+                best.binScale = binFactor[axis];
+                best.left = accumBounds;
+                best.right = rightBounds[bin];
+                best.leftCount = accumCount;
+                best.rightCount = rightCount[bin];
+            }
+        }
+    }
+    return best;
+}
+
+BVH::Split BVH::objectSplit(const std::vector<BBox> &bounds,
+                            const std::vector<int> &ids, int begin, int end,
+                            int groupSize, const BBox &nodeBounds,
+                            const BBox &centroidBounds) {
+    return objectSplit(
+        begin, end, 1, groupSize, nodeBounds, centroidBounds,
+        [&](int i) -> const BBox & { return bounds[ids[i]]; });
+}
+
+float BVH::buildNode(const std::vector<BBox> &bounds, int begin, int end,
+                     int depth, int threads, std::vector<Node> &out) {
+    // Big nodes are binned and partitioned in chunks, one per thread
+    int numPrimitives = end - begin;
+    int chunks = std::max(
+        1, std::min(threads, numPrimitives / PARALLEL_MIN_PRIMITIVES));
+
+    // Bounding box of all primitives, and of all their centroids
+    std::vector<BBox> chunkBounds(chunks), chunkCentroids(chunks);
+    ThreadPool::global().parallelFor(
+        begin, end, chunks, [&](int b, int e, int chunk) {
+        for (int i = b; i < e; i++) {
+            chunkBounds[chunk].extend(bounds[indices[i]]);
+            chunkCentroids[chunk].extend(bounds[indices[i]].centroid());
+        }
+    });
+    BBox nodeBounds, centroidBounds;
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        nodeBounds.extend(chunkBounds[chunk]);
+        centroidBounds.extend(chunkCentroids[chunk]);
+    }
+    int nodeIndex = out.size();
+    out.push_back(Node());
+    for (int i = 0; i < 3; i++) {
+        out[nodeIndex].bb0[i] = nodeBounds.bb0.raw[i];
+        out[nodeIndex].bb1[i] = nodeBounds.bb1.raw[i];
+    }
+
+    // Cost of not splitting the node (intersect with all of its primitives)
+    float leafCost = this->groups(numPrimitives) * INTERSECTION_COST;
+
+    // Find the split with the lowest cost on all three axes
+    Split best;
+    if (numPrimitives > 1) {
+        best = objectSplit(
+            begin, end, chunks, groupSize, nodeBounds, centroidBounds,
+            [&](int i) -> const BBox & { return bounds[indices[i]]; });
+    }
+
+    if (numPrimitives == 1 ||
+        (best.cost >= leafCost && numPrimitives <= MAX_LEAF_SIZE)) {
+        // Leaf node with all primitives inside bbox
+        out[nodeIndex].offset = begin;
+        out[nodeIndex].count = numPrimitives;
+        out[nodeIndex].axis = 0;
+        return leafCost;
+    }
+
+    int split, bestAxis = best.axis;
+    if (bestAxis == -1 || depth > MAX_DEPTH / 2) {
+        // Can't split by centroid or tree is getting too deep: split in
+        // half on the biggest axis, so the subtree is balanced
+        bestAxis = centroidBounds.maxAxis();
+        split = begin + numPrimitives / 2;
+        std::nth_element(indices.begin() + begin, indices.begin() + split,
+                         indices.begin() + end, [&](int lhs, int rhs) {
+                             return bounds[lhs].centroid().raw[bestAxis] <
+                                    bounds[rhs].centroid().raw[bestAxis];
+                         });
+    } else {
+        // Move primitives on the left side of the split to the beginning
+        auto isLeft = [&](int pi) { return best.isLeft(bounds[pi]); };
+        if (chunks == 1) {
+            std::vector<int>::iterator mid = std::partition(
+                indices.begin() + begin, indices.begin() + end, isLeft);
+            split = mid - indices.begin();
+        } else {
+            // Count left side of each chunk, so every chunk knows where
+            // to copy its primitives on both sides
+            std::vector<int> leftCount(chunks, 0);
+            ThreadPool::global().parallelFor(
+                begin, end, chunks, [&](int b, int e, int chunk) {
+                for (int i = b; i < e; i++) {
+                    leftCount[chunk] += isLeft(indices[i]);
+                }
+            });
+            std::vector<int> leftBefore(chunks, 0);
+            for (int chunk = 1; chunk < chunks; chunk++) {
+                leftBefore[chunk] =
+                    leftBefore[chunk - 1] + leftCount[chunk - 1];
+            }
+            int numLeft = leftBefore[chunks - 1] + leftCount[chunks - 1];
+            std::vector<int> partitioned(numPrimitives);
+            ThreadPool::global().parallelFor(
+                begin, end, chunks, [&](int b, int e, int chunk) {
+                int left = leftBefore[chunk];
+                int right = numLeft + (b - begin) - leftBefore[chunk];
+                for (int i = b; i < e; i++) {
+                    if (isLeft(indices[i])) {
+                        partitioned[left++] = indices[i];
+                    } else {
+                        partitioned[right++] = indices[i];
+                    }
+                }
+            });
+            std::copy(partitioned.begin(), partitioned.end(),
+                      indices.begin() + begin);
+            split = begin + numLeft;
+        }
+    }
+
+    // First child goes right after this node, second one after the subtree
+    out[nodeIndex].count = 0;
+    out[nodeIndex].axis = bestAxis;
+    float leftCost, rightCost;
+    int rightIndex;
+    if (threads > 1 &&
+        std::min(split - begin, end - split) >= PARALLEL_MIN_PRIMITIVES) {
+        // Build first subtree in another thread, each one on its own array
+        std::vector<Node> leftNodes, rightNodes;
+        int leftThreads = threads / 2;
+        std::future<float> leftBuild = ThreadPool::global().submit([&]() {
+            return this->buildNode(bounds, begin, split, depth + 1,
+                                   leftThreads, leftNodes);
+        });
+        rightCost = this->buildNode(bounds, split, end, depth + 1,
+                                    threads - leftThreads, rightNodes);
+        leftCost = ThreadPool::global().wait(leftBuild);
+        appendSubtree(out, leftNodes);
+        rightIndex = out.size();
+        appendSubtree(out, rightNodes);
+    } else {
+        leftCost =
+            this->buildNode(bounds, begin, split, depth + 1, threads, out);
+        rightIndex = out.size();
+        rightCost =
+            this->buildNode(bounds, split, end, depth + 1, threads, out);
+    }
+    out[nodeIndex].offset = rightIndex;
+
+    return interiorCost(nodeBounds, out[nodeIndex + 1].bounds(), leftCost,
+                        out[rightIndex].bounds(), rightCost);
+}
+
+/// Spatial splits ///
+
+// Bin of a coordinate for spatial splits, all bins have the same width
+static inline int spatialBin(float position, float binMin, float binScale,
+                             int numBins) {
+    int bin = (position - binMin) * binScale;
+    return std::min(std::max(bin, 0), numBins - 1);
+}
+
+void BVH::splitReference(const SpatialBuild &build,
+                         const Reference &reference, int axis,
+                         float position, Reference &left, Reference &right) {
+    // Split every edge of the triangle by the plane
+    const Triangle &triangle = build.triangles[reference.primitive];
+    BBox leftBounds, rightBounds;
+    for (int i = 0; i < 3; i++) {
+        const Vec4 &v0 = triangle[i], &v1 = triangle[(i + 1) % 3];
+        float p0 = v0.raw[axis], p1 = v1.raw[axis];
+        if (p0 <= position) {
+            leftBounds.extend(v0);
+        }
+        if (p0 >= position) {
+            rightBounds.extend(v0);
+        }
+        if ((p0 < position && p1 > position) ||
+            (p0 > position && p1 < position)) {
+            Vec4 crossing = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+            crossing.raw[axis] = position;
+            leftBounds.extend(crossing);
+            rightBounds.extend(crossing);
+        }
+    }
+    // The reference may have been clipped before
+    left.primitive = right.primitive = reference.primitive;
+    left.bounds = leftBounds.intersection(reference.bounds);
+    right.bounds = rightBounds.intersection(reference.bounds);
+}
+
+BVH::Split BVH::spatialSplit(const SpatialBuild &build,
+                             const std::vector<Reference> &references,
+                             const BBox &nodeBounds, int chunks) const {
+    Split best;
+    float nodeArea = nodeBounds.surfaceArea();
+    Vec4 extent = nodeBounds.diagonal();
+    float binScale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        binScale[axis] =
+            extent.raw[axis] < 1e-9f ? 0.0f : SAH_BINS / extent.raw[axis];
+    }
+
+    // Clip every reference to all the bins it goes through, counting
+    // where it enters and where it exits
+    struct Bins {
+        int entries[3][SAH_BINS] = {}, exits[3][SAH_BINS] = {};
+        BBox bounds[3][SAH_BINS];
+    };
+    std::vector<Bins> chunkBins(chunks);
+    ThreadPool::global().parallelFor(
+        0, references.size(), chunks, [&](int b, int e, int chunk) {
+        Bins &bins = chunkBins[chunk];
+        for (int i = b; i < e; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                if (binScale[axis] == 0.0f) {
+                    continue;
+                }
+                float binMin = nodeBounds.bb0.raw[axis];
+                Reference rest = references[i];
+                int first = spatialBin(rest.bounds.bb0.raw[axis], binMin,
+                                       binScale[axis], SAH_BINS);
+                int last = spatialBin(rest.bounds.bb1.raw[axis], binMin,
+                                      binScale[axis], SAH_BINS);
+                for (int bin = first; bin < last; bin++) {
+                    Reference inBin;
+                    splitReference(build, rest, axis,
+                                   binMin + (bin + 1) / binScale[axis],
+                                   inBin, rest);
+                    bins.bounds[axis][bin].extend(inBin.bounds);
+                }
+                bins.bounds[axis][last].extend(rest.bounds);
+                bins.entries[axis][first]++;
+                bins.exits[axis][last]++;
+            }
+        }
+    });
+    Bins &bins = chunkBins[0];
+    for (int chunk = 1; chunk < chunks; chunk++) {
+        for (int axis = 0; axis < 3; axis++) {
+            for (int bin = 0; bin < SAH_BINS; bin++) {
+                bins.entries[axis][bin] += chunkBins[chunk].entries[axis][bin];
+                bins.exits[axis][bin] += chunkBins[chunk].exits[axis][bin];
+                bins.bounds[axis][bin].extend(
+                    chunkBins[chunk].bounds[axis][bin]);
+            }
+        }
+    }
+
+    // Same sweeps as objectSplit, references that cross the plane are
+    // counted on both sides
+    for (int axis = 0; axis < 3; axis++) {
+        if (binScale[axis] == 0.0f) {
+            continue;
+        }
+        BBox rightBounds[SAH_BINS];
+        int rightCount[SAH_BINS];
+        BBox accumBounds;
+        int accumCount = 0;
+        for (int bin = SAH_BINS - 1; bin > 0; bin--) {
+            accumBounds.extend(bins.bounds[axis][bin]);
+            accumCount += bins.exits[axis][bin];
+            rightBounds[bin] = accumBounds;
+            rightCount[bin] = accumCount;
+        }
+        accumBounds = BBox();
+        accumCount = 0;
+        for (int bin = 1; bin < SAH_BINS; bin++) {
+            accumBounds.extend(bins.bounds[axis][bin - 1]);
+            accumCount += bins.entries[axis][bin - 1];
+            if (accumCount == 0 || rightCount[bin] == 0) {
+                continue;
+            }
+            float splitCost =
+                TRAVERSAL_COST +
+                INTERSECTION_COST *
+                    (accumBounds.surfaceArea() * this->groups(accumCount) +
+                     rightBounds[bin].surfaceArea() *
+                         this->groups(rightCount[bin])) /
+                    nodeArea;
+            if (splitCost < best.cost) {
+                best.axis = axis;
+                best.bin = bin;
+                best.cost = splitCost;
+                best.binMin = nodeBounds.bb0.raw[axis];
+                best.binScale = binScale[axis];
+                best.left = accumBounds;
+                best.right = rightBounds[bin];
+                best.leftCount = accumCount;
+                best.rightCount = rightCount[bin];
+            }
+        }
+    }
+    return best;
+}
+
+float BVH::buildSpatialNode(const SpatialBuild &build,
+                            std::vector<Reference> &references,
+                            int maxDuplicates, int depth, int threads,
+                            std::vector<Node> &out,
+                            std::vector<int> &outIndices) {
+    int numReferences = references.size();
+    int chunks = std::max(
+        1, std::min(threads, numReferences / PARALLEL_MIN_PRIMITIVES));
+
+    BBox nodeBounds, centroidBounds;
+    for (const Reference &reference : references) {
+        nodeBounds.extend(reference.bounds);
+        centroidBounds.extend(reference.bounds.centroid());
+    }
+    int nodeIndex = out.size();
+    out.push_back(Node());
+    for (int i = 0; i < 3; i++) {
+        out[nodeIndex].bb0[i] = nodeBounds.bb0.raw[i];
+        out[nodeIndex].bb1[i] = nodeBounds.bb1.raw[i];
+    }
+
+    float leafCost = this->groups(numReferences) * INTERSECTION_COST;
+
+    // Spatial splits are only worth it if object split's children overlap
+    Split object, spatial;
+    bool balance = depth > MAX_DEPTH / 2;
+    if (numReferences > 1) {
+        object = objectSplit(
+            0, numReferences, chunks, groupSize, nodeBounds, centroidBounds,
+            [&](int i) -> const BBox & { return references[i].bounds; });
+        float overlap =
+            object.axis == -1
+                ? std::numeric_limits<float>::max()
+                : object.left.intersection(object.right).surfaceArea();
+        if (!balance && overlap > build.minOverlap &&
+            maxDuplicates > 0) {
+            spatial = this->spatialSplit(build, references, nodeBounds,
+                                         chunks);
+        }
+    }
+
+    if (numReferences == 1 ||
+        (std::min(object.cost, spatial.cost) >= leafCost &&
+         numReferences <= MAX_LEAF_SIZE)) {
+        out[nodeIndex].offset = outIndices.size();
+        out[nodeIndex].count = numReferences;
+        out[nodeIndex].axis = 0;
+        for (const Reference &reference : references) {
+            outIndices.push_back(reference.primitive);
+        }
+        return leafCost;
+    }
+
+    std::vector<Reference> left, right;
+    int bestAxis = -1, duplicates = 0;
+    if (!balance && spatial.cost < object.cost) {
+        Split &split = spatial;
+        BBox leftBounds = split.left, rightBounds = split.right;
+        int leftCount = split.leftCount, rightCount = split.rightCount;
+        float position = split.binMin + split.bin / split.binScale;
+        for (const Reference &reference : references) {
+            int first = spatialBin(reference.bounds.bb0.raw[split.axis],
+                                   split.binMin, split.binScale, SAH_BINS);
+            int last = spatialBin(reference.bounds.bb1.raw[split.axis],
+                                  split.binMin, split.binScale, SAH_BINS);
+            if (last < split.bin) {
+                left.push_back(reference);
+                continue;
+            } else if (first >= split.bin) {
+                right.push_back(reference);
+                continue;
+            }
+            Reference leftPart, rightPart;
+            splitReference(build, reference, split.axis, position, leftPart,
+                           rightPart);
+            if (leftPart.bounds.empty()) {
+                right.push_back(rightPart);
+                leftCount--;
+                continue;
+            } else if (rightPart.bounds.empty()) {
+                left.push_back(leftPart);
+                rightCount--;
+                continue;
+            }
+            // Reference unsplitting: keep it whole on one side if cheaper
+            BBox leftWith = leftBounds, rightWith = rightBounds;
+            leftWith.extend(reference.bounds);
+            rightWith.extend(reference.bounds);
+            float splitCost = leftBounds.surfaceArea() * leftCount +
+                              rightBounds.surfaceArea() * rightCount;
+            float leftCost = leftWith.surfaceArea() * leftCount +
+                             rightBounds.surfaceArea() * (rightCount - 1);
+            float rightCost = leftBounds.surfaceArea() * (leftCount - 1) +
+                              rightWith.surfaceArea() * rightCount;
+            if (splitCost < std::min(leftCost, rightCost) &&
+                duplicates < maxDuplicates) {
+                duplicates++;
+                left.push_back(leftPart);
+                right.push_back(rightPart);
+            } else if (leftCost <= rightCost) {
+                left.push_back(reference);
+                leftBounds = leftWith;
+                rightCount--;
+            } else {
+                right.push_back(reference);
+                rightBounds = rightWith;
+                leftCount--;
+            }
+        }
+        if (left.empty() || right.empty()) {
+            // Everything went to the same side, nothing has been duplicated
+            references = left.empty() ? std::move(right) : std::move(left);
+            left.clear();
+            right.clear();
+        } else {
+            bestAxis = split.axis;
+        }
+    }
+    if (bestAxis == -1 && !balance && object.axis != -1) {
+        for (const Reference &reference : references) {
+            if (object.isLeft(reference.bounds)) {
+                left.push_back(reference);
+            } else {
+                right.push_back(reference);
+            }
+        }
+        if (left.empty() || right.empty()) {
+            left.clear();
+            right.clear();
+        } else {
+            bestAxis = object.axis;
+        }
+    }
+    if (bestAxis == -1) {
+        // Same as buildNode, split in half on the biggest axis
+        bestAxis = centroidBounds.maxAxis();
+        int split = numReferences / 2;
+        std::nth_element(references.begin(), references.begin() + split,
+                         references.end(),
+                         [&](const Reference &lhs, const Reference &rhs) {
+                             return lhs.bounds.centroid().raw[bestAxis] <
+                                    rhs.bounds.centroid().raw[bestAxis];
+                         });
+        left.assign(references.begin(), references.begin() + split);
+        right.assign(references.begin() + split, references.end());
+    }
+    // Only the children's references are needed from here on
+    std::vector<Reference>().swap(references);
+    // Duplicates left are shared by the children by their size, so they
+    // aren't all used by the first subtree built
+    int duplicatesLeft = maxDuplicates - duplicates;
+    int leftDuplicates =
+        (long)duplicatesLeft * left.size() / (left.size() + right.size());
+    int rightDuplicates = duplicatesLeft - leftDuplicates;
+
+    out[nodeIndex].count = 0;
+    out[nodeIndex].axis = bestAxis;
+    float leftCost, rightCost;
+    int rightIndex;
+    if (threads > 1 &&
+        std::min(left.size(), right.size()) >=
+            (size_t)PARALLEL_MIN_PRIMITIVES) {
+        std::vector<Node> leftNodes, rightNodes;
+        std::vector<int> leftIndices, rightIndices;
+        int leftThreads = threads / 2;
+        std::future<float> leftBuild = ThreadPool::global().submit([&]() {
+            return this->buildSpatialNode(build, left, leftDuplicates,
+                                          depth + 1, leftThreads, leftNodes,
+                                          leftIndices);
+        });
+        rightCost = this->buildSpatialNode(build, right, rightDuplicates,
+                                           depth + 1, threads - leftThreads,
+                                           rightNodes, rightIndices);
+        leftCost = ThreadPool::global().wait(leftBuild);
+        appendSubtree(out, leftNodes, outIndices.size());
+        outIndices.insert(outIndices.end(), leftIndices.begin(),
+                          leftIndices.end());
+        rightIndex = out.size();
+        appendSubtree(out, rightNodes, outIndices.size());
+        outIndices.insert(outIndices.end(), rightIndices.begin(),
+                          rightIndices.end());
+    } else {
+        leftCost = this->buildSpatialNode(build, left, leftDuplicates,
+                                          depth + 1, threads, out, outIndices);
+        rightIndex = out.size();
+        rightCost = this->buildSpatialNode(build, right, rightDuplicates,
+                                           depth + 1, threads, out,
+                                           outIndices);
+    }
+    out[nodeIndex].offset = rightIndex;
+
+    return interiorCost(nodeBounds, out[nodeIndex + 1].bounds(), leftCost,
+                        out[rightIndex].bounds(), rightCost);
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "io/mappedfile.h"
+#include "math/bbox.h"
+#include "math/geometry.h"
+#include "parallel/threadpool.h"
+
+// Bounding volume hierarchy stored as a flat array of nodes, built over
+// a set of primitives given their bounding boxes using binned SAH
+// Nodes are stored in depth-first order: the first child of an interior
+// node is always the next node in the array, so only the second child's
+// position is saved (no pointers, no separate heap allocations)
+// Big subtrees are built in parallel, using all the cores available
+// Trees over triangles can also be split by planes (spatial splits, see
+// the SBVH constructor), then a triangle may be in more than one leaf
+class BVH {
+   public:
+    // Maximum depth of the tree (also size of the traversal stack)
+    static const int MAX_DEPTH = 64;
+
+    // 32 bytes, two nodes fit in a cache line
+    struct Node {
+        float bb0[3];  // bounding box min
+        int offset;    // leaf: first primitive in indices, else second child
+        float bb1[3];  // bounding box max
+        short count;   // number of primitives (0 for interior nodes)
+        short axis;    // split axis, used to traverse children in order
+
+        inline bool leaf() const { return count > 0; }
+        inline BBox bounds() const {
+            return BBox(Vec4(bb0[0], bb0[1], bb0[2], 1.0f),
+                        Vec4(bb1[0], bb1[1], bb1[2], 1.0f));
+        }
+    };
+
+    // Vertices of a triangle, to build a tree with spatial splits
+    typedef std::array<Vec4, 3> Triangle;
+
+   private:
+    // BVH4 is built by collapsing the nodes of a binary BVH
+    friend class BVH4;
+    // LazyBVH splits its nodes with the same builder
+    friend class LazyBVH;
+
+    // Binned SAH builder settings: number of bins per axis and
+    // relative costs of traversing a node and intersecting a primitive
+    static const int SAH_BINS = 16;
+    static const int MAX_LEAF_SIZE = 16;
+    static const constexpr float TRAVERSAL_COST = 1.0f;
+    static const constexpr float INTERSECTION_COST = 1.0f;
+    // Nodes are only binned and partitioned in parallel, and subtrees built
+    // in their own thread, if each thread gets at least this many primitives
+    static const int PARALLEL_MIN_PRIMITIVES = 4096;
+    // Spatial splits are only tried in nodes where the children of the
+    // best object split overlap, with an area over this ratio of the root's
+    static const constexpr float SPATIAL_SPLIT_MIN_OVERLAP = 1e-5f;
+
+    // Flattened nodes, root is nodes[0]
+    std::vector<Node> nodes;
+    // Primitive indices, leaves reference a contiguous range of them
+    std::vector<int> indices;
+    // Leaves' primitives are intersected in groups of this size at the
+    // cost of one (e.g. with SIMD), so the SAH counts groups, not primitives
+    int groupSize;
+    // SAH cost of the tree, and right after it was built (see refit)
+    float cost, builtCost;
+
+    // Best way found to split a node in two, by the primitives' centroids
+    // (object split) or by a plane (spatial split, see buildSpatialNode)
+    struct Split {
+        int axis = -1;  // -1 if the node can't be split
+        int bin = -1;   // primitives in bins [0, bin) go to the left
+        float cost = std::numeric_limits<float>::max();
+        // Bin of a centroid (object splits) or of a coordinate (spatial
+        // splits) on the split axis is (x - binMin) * binScale
+        float binMin = 0.0f, binScale = 0.0f;
+        // Bounds and number of primitives of each side
+        BBox left, right;
+        int leftCount = 0, rightCount = 0;
+
+        inline bool isLeft(const BBox &primitiveBounds) const {
+            int b = (primitiveBounds.centroid().raw[axis] - binMin) * binScale;
+            return b < bin;
+        }
+    };
+    // Binned SAH over the centroids of primitives [begin, end), whose
+    // bounding boxes are given by primitiveBounds(i), in chunks threads
+    // (static, so trees built in other ways can use it, see LazyBVH)
+    template <typename F>
+    static Split objectSplit(int begin, int end, int chunks, int groupSize,
+                             const BBox &nodeBounds,
+                             const BBox &centroidBounds, F primitiveBounds);
+    // Same for primitives ids[begin, end), in this thread
+    static Split objectSplit(const std::vector<BBox> &bounds,
+                             const std::vector<int> &ids, int begin, int end,
+                             int groupSize, const BBox &nodeBounds,
+                             const BBox &centroidBounds);
+
+    inline int groups(int numPrimitives) const {
+        return (numPrimitives + groupSize - 1) / groupSize;
+    }
+    // SAH cost of an interior node, given its children's cost weighted by
+    // the probability of hitting them
+    static inline float interiorCost(const BBox &box, const BBox &left,
+                                     float leftCost, const BBox &right,
+                                     float rightCost) {
+        float area = box.surfaceArea();
+        if (area <= 0.0f) {
+            return TRAVERSAL_COST;
+        }
+        return TRAVERSAL_COST + (left.surfaceArea() * leftCost +
+                                 right.surfaceArea() * rightCost) /
+                                    area;
+    }
+
+    // Whether nodes and indices read from a file are in range: children
+    // after their parent, leaves inside indices, primitives below
+    // numPrimitives and no more than MAX_DEPTH levels, so a damaged file
+    // can't make traversal read out of bounds
+    bool isValid(int numPrimitives) const;
+
+    // Adds node for primitives in indices[begin, end) and its subtree to
+    // out, using up to the given number of threads (interior nodes'
+    // offsets are relative to out, so subtrees can be built apart)
+    // Primitives are reordered in that range, returns node's SAH cost
+    float buildNode(const std::vector<BBox> &bounds, int begin, int end,
+                    int depth, int threads, std::vector<Node> &out);
+
+    // Triangle referenced by a leaf of a tree with spatial splits, and its
+    // bounding box clipped to the node that has it
+    struct Reference {
+        int primitive;
+        BBox bounds;
+    };
+    // Triangles and settings of a spatial split build
+    struct SpatialBuild;
+    // Split reference by a plane, clipping its triangle to both sides
+    static void splitReference(const SpatialBuild &build,
+                               const Reference &reference, int axis,
+                               float position, Reference &left,
+                               Reference &right);
+    // Binned SAH over planes that cut the node's references
+    Split spatialSplit(const SpatialBuild &build,
+                       const std::vector<Reference> &references,
+                       const BBox &nodeBounds, int chunks) const;
+    // Same as buildNode, with the node's references given in a vector
+    // (emptied, they are moved to its children), adding its leaves'
+    // references to outIndices. Tries both object splits and spatial
+    // splits, duplicating up to maxDuplicates references in its subtree
+    float buildSpatialNode(const SpatialBuild &build,
+                           std::vector<Reference> &references,
+                           int maxDuplicates, int depth, int threads,
+                           std::vector<Node> &out,
+                           std::vector<int> &outIndices);
+
+   public:
+    BVH() : groupSize(1), cost(0.0f), builtCost(0.0f) {}
+    // Build tree over primitives 0..bounds.size()-1
+    BVH(const std::vector<BBox> &bounds, int groupSize = 1);
+    // Spatial split BVH (SBVH) over triangles, see:
+    // https://www.nvidia.com/docs/IO/77714/sbvh.pdf
+    // Nodes whose children would overlap too much are split by a plane
+    // instead if it's cheaper, and triangles that cross it are referenced
+    // by both children, clipped to each side. It takes longer to build
+    // but big or long and thin triangles don't make boxes overlap as much
+    // maxDuplication is the ratio of references that can be added over
+    // the number of triangles (e.g. 0.3 for at most 30% more)
+    BVH(const std::vector<Triangle> &triangles, int groupSize,
+        float maxDuplication);
+
+    // Update the tree after its primitives have moved (new bounds for the
+    // same primitives), keeping its topology: nodes' boxes are fitted to
+    // their children's from the leaves up. As the tree gets worse when
+    // primitives move too much, it's built again if maxCostRatio > 0 and
+    // the SAH cost has grown more than that ratio since it was built
+    // (e.g. 1.5). Returns true if the tree has been built again
+    // Leaves of trees with spatial splits are fitted to their whole
+    // primitives, and they are built again without spatial splits
+    bool refit(const std::vector<BBox> &bounds, float maxCostRatio = 0.0f);
+
+    // Write the tree to a file, to load it later instead of building it
+    void save(BinaryWriter &file) const;
+    // Read a tree over numPrimitives primitives written by save, returns
+    // false if the file is invalid (see isValid) or it was built with other
+    // settings (then the tree is left unchanged)
+    bool load(MappedFile &file, int numPrimitives);
+
+    inline bool empty() const { return nodes.empty(); }
+    inline float getCost() const { return cost; }
+    inline float getBuiltCost() const { return builtCost; }
+    inline int numNodes() const { return nodes.size(); }
+    // Bounding box of given node (by default, the root's one)
+    BBox getBoundingBox(int node = 0) const;
+
+    // Ray-box intersection against node's bbox, true if the box is hit
+    // closer than tMax (see Figures::Box for more details)
+    static inline bool hitsNode(const Node &node, const Vec4 &origin,
+                                const Vec4 &invDirection, const float tMax) {
+        float tmin = 0.0f, tmax = tMax;
+        for (int i = 0; i < 3; i++) {
+            float t1 = (node.bb0[i] - origin.raw[i]) * invDirection.raw[i];
+            float t2 = (node.bb1[i] - origin.raw[i]) * invDirection.raw[i];
+            tmin = std::fmax(tmin, std::fmin(t1, t2));
+            tmax = std::fmin(tmax, std::fmax(t1, t2));
+        }
+        return tmin <= tmax;
+    }
+
+    // Front-to-back traversal of the tree with an explicit stack
+    // fIntersect(primitive, tMax) is called for the primitives of every
+    // leaf whose bbox is hit closer than tMax, and returns true if it has
+    // found a closer hit (it should update tMax with its distance)
+    // Returns true if any of the calls to fIntersect has returned true
+    template <typename F>
+    bool traverse(const Vec4 &origin, const Vec4 &invDirection, float &tMax,
+                  F fIntersect) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        bool hit = false;
+        int stack[MAX_DEPTH];
+        int stackSize = 0;
+        int current = 0;
+        while (true) {
+            const Node &node = nodes[current];
+            if (hitsNode(node, origin, invDirection, tMax)) {
+                if (node.leaf()) {
+                    for (int i = node.offset; i < node.offset + node.count;
+                         i++) {
+                        hit = fIntersect(indices[i], tMax) || hit;
+                    }
+                } else if (invDirection.raw[node.axis] < 0.0f) {
+                    // Ray goes backwards on split axis, visit second first
+                    stack[stackSize++] = current + 1;
+                    current = node.offset;
+                    continue;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    current = current + 1;
+                    continue;
+                }
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            current = stack[--stackSize];
+        }
+        return hit;
+    }
+
+    // Any-hit traversal of the tree, stops as soon as fOccluded(primitive)
+    // returns true for a primitive of a leaf whose bbox is hit before tMax
+    // (children aren't visited in order, as any hit is enough)
+    template <typename F>
+    bool occluded(const Vec4 &origin, const Vec4 &invDirection,
+                  const float tMax, F fOccluded) const {
+        if (nodes.empty()) {
+            return false;
+        }
+        int stack[MAX_DEPTH];
+        int stackSize = 0;
+        int current = 0;
+        while (true) {
+            const Node &node = nodes[current];
+            if (hitsNode(node, origin, invDirection, tMax)) {
+                if (node.leaf()) {
+                    for (int i = node.offset; i < node.offset + node.count;
+                         i++) {
+                        if (fOccluded(indices[i])) {
+                            return true;
+                        }
+                    }
+                } else {
+                    stack[stackSize++] = node.offset;
+                    current = current + 1;
+                    continue;
+                }
+            }
+            if (stackSize == 0) {
+                return false;
+            }
+            current = stack[--stackSize];
+        }
+    }
+};
@@ -0,0 +1,266 @@
+#include "bvh4.h"
+
+BVH4::BVH4(const BVH &bvh, int _groupSize, bool compressed)
+    : groupSize(_groupSize),
+      cost(bvh.getCost()),
+      bounds(bvh.getBoundingBox()) {
+    if (bvh.empty()) {
+        return;
+    }
+    indices.reserve(bvh.indices.size());
+    // every node has at least 2 children (but the root), so there are
+    // fewer 4-wide nodes than interior binary nodes
+    nodes.reserve(bvh.nodes.size() / 2 + 1);
+    this->collapse(bvh, 0);
+    if (!compressed || !this->compress()) {
+        nodes.shrink_to_fit();
+    }
+}
+
+void BVH4::save(BinaryWriter &file) const {
+    file.write(groupSize);
+    file.write(cost);
+    file.write(bounds);
+    file.write(nodes);
+    file.write(compressedNodes);
+    file.write(indices);
+}
+
+bool BVH4::load(MappedFile &file, int numPrimitives) {
+    BVH4 tree;
+    if (!file.read(tree.groupSize) || !file.read(tree.cost) ||
+        !file.read(tree.bounds) || !file.read(tree.nodes) ||
+        !file.read(tree.compressedNodes) || !file.read(tree.indices) ||
+        !tree.isValid(numPrimitives)) {
+        return false;
+    }
+    *this = std::move(tree);
+    return true;
+}
+
+bool BVH4::isValid(int numPrimitives) const {
+    if (groupSize < 1 || (!nodes.empty() && !compressedNodes.empty())) {
+        return false;
+    }
+    for (int primitive : indices) {
+        if (primitive < -1 || primitive >= numPrimitives) {
+            return false;
+        }
+    }
+    int numNodes = this->numNodes();
+    int64_t numIndices = indices.size();
+    auto validLeaf = [&](int64_t offset, int64_t count) {
+        return offset >= 0 && offset % groupSize == 0 &&
+               count % groupSize == 0 && offset + count <= numIndices;
+    };
+    // Levels down to each node (0 if it isn't reached from the root)
+    std::vector<int> depth(numNodes, 0);
+    if (numNodes > 0) {
+        depth[0] = 1;
+    }
+    auto validChild = [&](int parent, int child) {
+        if (child <= parent || child >= numNodes) {
+            return false;
+        } else if (depth[parent] > 0) {
+            if (depth[parent] == BVH::MAX_DEPTH) {
+                return false;
+            }
+            depth[child] = std::max(depth[child], depth[parent] + 1);
+        }
+        return true;
+    };
+    for (int i = 0; i < numNodes; i++) {
+        if (!compressedNodes.empty()) {
+            const CompressedNode &node = compressedNodes[i];
+            if (node.numChildren < 1 || node.numChildren > 4) {
+                return false;
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                if (node.exponent[axis] < -126) {
+                    return false;
+                }
+            }
+            int child = node.firstChild;
+            int64_t first = node.firstIndex;
+            for (int c = 0; c < node.numChildren; c++) {
+                int64_t count = (int64_t)node.groups[c] * groupSize;
+                if (count > 0 ? !validLeaf(first, count)
+                              : !validChild(i, child++)) {
+                    return false;
+                }
+                first += count;
+            }
+            continue;
+        }
+        const Node &node = nodes[i];
+        if (node.numChildren < 1 || node.numChildren > 4) {
+            return false;
+        }
+        for (int c = 0; c < node.numChildren; c++) {
+            if (node.count[c] < 0 ||
+                (node.count[c] > 0 ? !validLeaf(node.offset[c], node.count[c])
+                                   : !validChild(i, node.offset[c]))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int BVH4::collapse(const BVH &bvh, int binaryNode) {
+    const std::vector<BVH::Node> &binary = bvh.nodes;
+    // Children of the new node, as binary node indices
+    int children[4], numChildren = 0;
+    if (binary[binaryNode].leaf()) {
+        children[numChildren++] = binaryNode;  // tree with only one leaf
+    } else {
+        children[numChildren++] = binaryNode + 1;
+        children[numChildren++] = binary[binaryNode].offset;
+    }
+    // Replace the interior child with the biggest area by its own
+    // children, as it's the one most likely to be hit
+    while (numChildren < 4) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (int c = 0; c < numChildren; c++) {
+            float area = bvh.getBoundingBox(children[c]).surfaceArea();
+            if (!binary[children[c]].leaf() && area > bestArea) {
+                best = c;
+                bestArea = area;
+            }
+        }
+        if (best == -1) {
+            break;  // all children are leaves
+        }
+        int opened = children[best];
+        children[best] = opened + 1;
+        children[numChildren++] = binary[opened].offset;
+    }
+
+    int nodeIndex = nodes.size();
+    nodes.push_back(Node());
+    Node &node = nodes[nodeIndex];
+    node.numChildren = numChildren;
+    for (int c = 0; c < 4; c++) {
+        // Unused lanes get an empty box (they're masked out anyway)
+        BBox bounds = c < numChildren ? bvh.getBoundingBox(children[c])
+                                      : BBox();
+        for (int i = 0; i < 3; i++) {
+            node.bb0[i][c] = bounds.bb0.raw[i];
+            node.bb1[i][c] = bounds.bb1.raw[i];
+        }
+        node.offset[c] = 0;
+        node.count[c] = 0;
+    }
+    for (int c = 0; c < numChildren; c++) {
+        const BVH::Node &child = binary[children[c]];
+        if (child.leaf()) {
+            // Copy leaf's primitives, padded to a multiple of groupSize
+            int count = (child.count + groupSize - 1) / groupSize * groupSize;
+            nodes[nodeIndex].offset[c] = indices.size();
+            nodes[nodeIndex].count[c] = count;
+            for (int i = 0; i < count; i++) {
+                indices.push_back(i < child.count
+                                      ? bvh.indices[child.offset + i]
+                                      : -1);
+            }
+        } else {
+            // nodes may be reallocated, don't keep references through this
+            int childIndex = this->collapse(bvh, children[c]);
+            nodes[nodeIndex].offset[c] = childIndex;
+        }
+    }
+    return nodeIndex;
+}
+
+bool BVH4::quantize(const Node &node, int axis, int exponent,
+                    CompressedNode &out) {
+    float origin = out.origin[axis], scale = powerOfTwo(exponent);
+    for (int c = 0; c < 4; c++) {
+        out.qbb0[axis][c] = out.qbb1[axis][c] = 0;
+        if (c >= node.numChildren) {
+            continue;
+        }
+        float bb0 = node.bb0[axis][c], bb1 = node.bb1[axis][c];
+        int q0 = std::max(0, (int)std::floor((bb0 - origin) / scale));
+        int q1 = (int)std::ceil((bb1 - origin) / scale);
+        // Check them decoding them as getNode does
+        while (q0 > 0 && origin + q0 * scale > bb0) {
+            q0--;
+        }
+        while (q1 <= 255 && origin + q1 * scale < bb1) {
+            q1++;
+        }
+        if (q1 > 255) {
+            return false;
+        }
+        out.qbb0[axis][c] = q0;
+        out.qbb1[axis][c] = q1;
+    }
+    out.exponent[axis] = exponent;
+    return true;
+}
+
+bool BVH4::compress() {
+    std::vector<CompressedNode> compressed(nodes.size());
+    std::vector<int> sorted;
+    sorted.reserve(indices.size());
+    // Node of the uncompressed tree for each compressed one, nodes are
+    // added as their parents are compressed, so siblings are consecutive
+    std::vector<int> order;
+    order.reserve(nodes.size());
+    order.push_back(0);
+    for (int n = 0; n < order.size(); n++) {
+        const Node &node = nodes[order[n]];
+        CompressedNode &out = compressed[n];
+        out.numChildren = node.numChildren;
+        out.firstChild = order.size();
+        out.firstIndex = sorted.size();
+        for (int c = 0; c < 4; c++) {
+            out.groups[c] = 0;
+            if (c >= node.numChildren) {
+                continue;
+            }
+            if (node.count[c] == 0) {
+                order.push_back(node.offset[c]);
+                continue;
+            }
+            int groups = node.count[c] / groupSize;
+            if (groups > 255) {
+                return false;
+            }
+            out.groups[c] = groups;
+            sorted.insert(sorted.end(), indices.begin() + node.offset[c],
+                          indices.begin() + node.offset[c] + node.count[c]);
+        }
+
+        for (int i = 0; i < 3; i++) {
+            float lo = node.bb0[i][0], hi = node.bb1[i][0];
+            for (int c = 1; c < node.numChildren; c++) {
+                lo = node.bb0[i][c] < lo ? node.bb0[i][c] : lo;
+                hi = node.bb1[i][c] > hi ? node.bb1[i][c] : hi;
+            }
+            out.origin[i] = lo;
+            if (!std::isfinite(hi - lo)) {
+                return false;
+            }
+            // Smallest scale whose grid covers the box in 255 steps
+            int exponent = -126;
+            if (hi > lo) {
+                exponent =
+                    std::max(exponent, std::ilogb((hi - lo) / 255.0f) + 1);
+            }
+            // Rounding outwards might need one step more, then the scale
+            // is made bigger until all children fit
+            while (!this->quantize(node, i, exponent, out)) {
+                if (++exponent > 127) {
+                    return false;
+                }
+            }
+        }
+    }
+    compressedNodes = std::move(compressed);
+    indices = std::move(sorted);
+    std::vector<Node>().swap(nodes);
+    return true;
+}
@@ -0,0 +1,473 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "math/bbox.h"
+#include "camera/raypacket.h"
+#include "math/geometry.h"
+#include "scene/bvh.h"
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 4-wide bounding volume hierarchy, made by collapsing a binary BVH so
+// each node has up to 4 children whose bounding boxes are stored as a
+// structure of arrays: a ray is tested against all of them at once
+// (with SSE if it's available, which is always the case in x86-64)
+// Children are traversed front to back by their hit distance
+// Nodes can also be stored compressed, with their children's bounding
+// boxes quantized to 8 bits in a grid over the node's own box (see
+// CompressedNode), for trees too big to fit in memory otherwise, see:
+// https://research.nvidia.com/sites/default/files/publications/ylitie2017hpg-paper.pdf
+class BVH4 {
+   public:
+    // Size of the traversal stack (each level pushes at most 3 nodes
+    // more than it pops, and the binary tree is at most MAX_DEPTH deep)
+    static const int STACK_SIZE = 4 * BVH::MAX_DEPTH;
+
+    // 124 bytes, about two cache lines (nodes aren't aligned to them)
+    struct Node {
+        float bb0[3][4];  // children's bounding box min (axis, child)
+        float bb1[3][4];  // children's bounding box max (axis, child)
+        int offset[4];    // leaf: first primitive in indices, else node
+        short count[4];   // number of primitives (0 for interior nodes)
+        int numChildren;  // children are always the first ones
+    };
+
+    // 52 bytes instead of 124. Children's boxes are given in units of
+    // 2^exponent from origin, rounded outwards and widened until their
+    // decoded bounds (origin + q * scale, which can round) contain the
+    // original ones, so traversal stays conservative
+    // Interior children are consecutive nodes, and the primitives of leaf
+    // children are consecutive in indices, both in the children's order
+    struct CompressedNode {
+        float origin[3];      // min corner of the node's bounding box
+        int8_t exponent[3];   // scale of the grid on each axis
+        uint8_t numChildren;  // children are always the first ones
+        uint8_t qbb0[3][4];   // children's quantized bounding box min
+        uint8_t qbb1[3][4];   // children's quantized bounding box max
+        int firstChild;       // node of the first interior child
+        int firstIndex;       // first primitive of the first leaf child
+        uint8_t groups[4];    // groups of primitives (0 for interior nodes)
+    };
+
+   private:
+    // Flattened nodes, root is nodes[0] (or compressedNodes[0] instead,
+    // if the tree is compressed, then nodes is empty)
+    std::vector<Node> nodes;
+    std::vector<CompressedNode> compressedNodes;
+    // Primitive indices, leaves reference a contiguous range of them
+    // Each leaf's range starts at a multiple of groupSize and is padded
+    // with -1 up to a multiple of it
+    std::vector<int> indices;
+    int groupSize;
+    // Of the binary tree it's been made from
+    float cost;
+    BBox bounds;
+
+    // Adds node that contains the children of the binary node, opening
+    // the biggest interior children until there are 4 of them
+    int collapse(const BVH &bvh, int binaryNode);
+    // Moves nodes to compressedNodes (in breadth-first order) and sorts
+    // indices by node. Returns false and does nothing if a leaf has too
+    // many primitives to be compressed
+    bool compress();
+    // Whether nodes and indices read from a file are in range, as in
+    // BVH::isValid: leaves are also aligned to groups, indices can be -1
+    // (padding) and compressed nodes' exponents are in powerOfTwo's range
+    bool isValid(int numPrimitives) const;
+    // Quantizes the children's bounds of node on axis into out (with its
+    // origin already set), false if they don't fit with that exponent
+    static bool quantize(const Node &node, int axis, int exponent,
+                         CompressedNode &out);
+
+    // 2^exponent, built from its bits (exponent must be in -126..127)
+    static inline float powerOfTwo(int exponent) {
+        uint32_t bits = (uint32_t)(exponent + 127) << 23;
+        float value;
+        std::memcpy(&value, &bits, sizeof(float));
+        return value;
+    }
+    // Node at index, decoded into decoded if the tree is compressed
+    inline const Node &getNode(int index, Node &decoded) const {
+        if (compressedNodes.empty()) {
+            return nodes[index];
+        }
+        const CompressedNode &node = compressedNodes[index];
+        decoded.numChildren = node.numChildren;
+        int child = node.firstChild, first = node.firstIndex;
+        for (int c = 0; c < 4; c++) {
+            int count = node.groups[c] * groupSize;
+            decoded.offset[c] = count > 0 ? first : child++;
+            decoded.count[c] = count;
+            first += count;
+        }
+        for (int i = 0; i < 3; i++) {
+            float scale = powerOfTwo(node.exponent[i]);
+#ifdef __SSE2__
+            __m128 o = _mm_set1_ps(node.origin[i]), s = _mm_set1_ps(scale);
+            __m128i zero = _mm_setzero_si128();
+            int32_t q0, q1;
+            std::memcpy(&q0, node.qbb0[i], sizeof(q0));
+            std::memcpy(&q1, node.qbb1[i], sizeof(q1));
+            // Widen the 4 bytes to 32 bit integers, then to floats
+            __m128i b0 = _mm_unpacklo_epi16(
+                _mm_unpacklo_epi8(_mm_cvtsi32_si128(q0), zero), zero);
+            __m128i b1 = _mm_unpacklo_epi16(
+                _mm_unpacklo_epi8(_mm_cvtsi32_si128(q1), zero), zero);
+            _mm_storeu_ps(decoded.bb0[i],
+                          _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(b0), s)));
+            _mm_storeu_ps(decoded.bb1[i],
+                          _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(b1), s)));
+#else
+            for (int c = 0; c < 4; c++) {
+                decoded.bb0[i][c] = node.origin[i] + node.qbb0[i][c] * scale;
+                decoded.bb1[i][c] = node.origin[i] + node.qbb1[i][c] * scale;
+            }
+#endif
+        }
+        return decoded;
+    }
+
+    // Sorts the children in mask from the furthest to the closest one, so
+    // the closest is the next one taken from the stack if pushed in order
+    static inline int sortChildren(int mask, const float tNear[4],
+                                   int order[4]) {
+        int numHits = 0;
+        for (int c = 0; c < 4; c++) {
+            if (mask & (1 << c)) {
+                int j = numHits++;
+                for (; j > 0 && tNear[order[j - 1]] < tNear[c]; j--) {
+                    order[j] = order[j - 1];
+                }
+                order[j] = c;
+            }
+        }
+        return numHits;
+    }
+
+   public:
+    BVH4() : groupSize(1), cost(0.0f) {}
+    // If compressed, nodes are stored as CompressedNode (unless a leaf has
+    // more than 255 groups of primitives, then they aren't)
+    BVH4(const BVH &bvh, int _groupSize = 1, bool compressed = false);
+
+    // Write the tree to a file / read a tree over numPrimitives primitives
+    // written by save, returns false if the file is invalid (see isValid,
+    // then the tree is left unchanged)
+    void save(BinaryWriter &file) const;
+    bool load(MappedFile &file, int numPrimitives);
+
+    inline bool empty() const {
+        return nodes.empty() && compressedNodes.empty();
+    }
+    inline int numNodes() const {
+        return nodes.size() + compressedNodes.size();
+    }
+    inline bool isCompressed() const { return !compressedNodes.empty(); }
+    // Bytes used by nodes and indices
+    inline size_t memoryUsage() const {
+        return nodes.size() * sizeof(Node) +
+               compressedNodes.size() * sizeof(CompressedNode) +
+               indices.size() * sizeof(int);
+    }
+    inline float getCost() const { return cost; }
+    inline int getGroupSize() const { return groupSize; }
+    inline const BBox &getBoundingBox() const { return bounds; }
+    inline const std::vector<int> &getIndices() const { return indices; }
+
+    // Ray-box intersection against node's children, returns a mask with
+    // the children hit closer than tMax (bit i for child i) and saves the
+    // distance where the ray enters them in tNear
+    static inline int hitsChildren(const Node &node, const Vec4 &origin,
+                                   const Vec4 &invDirection, const float tMax,
+                                   float tNear[4]) {
+#ifdef __SSE__
+        // If t1 or t2 is NaN (ray inside the slab plane), it's ignored
+        // as min/max return their second operand in that case
+        __m128 tmin = _mm_setzero_ps(), tmax = _mm_set1_ps(tMax);
+        for (int i = 0; i < 3; i++) {
+            __m128 o = _mm_set1_ps(origin.raw[i]);
+            __m128 id = _mm_set1_ps(invDirection.raw[i]);
+            __m128 b0 = _mm_loadu_ps(node.bb0[i]);
+            __m128 b1 = _mm_loadu_ps(node.bb1[i]);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(b0, o), id);
+            __m128 t2 = _mm_mul_ps(_mm_sub_ps(b1, o), id);
+            tmin = _mm_max_ps(_mm_min_ps(t1, t2), tmin);
+            tmax = _mm_min_ps(_mm_max_ps(t1, t2), tmax);
+        }
+        _mm_storeu_ps(tNear, tmin);
+        int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+        int mask = 0;
+        for (int c = 0; c < 4; c++) {
+            float tmin = 0.0f, tmax = tMax;
+            for (int i = 0; i < 3; i++) {
+                float id = invDirection.raw[i];
+                float t1 = (node.bb0[i][c] - origin.raw[i]) * id;
+                float t2 = (node.bb1[i][c] - origin.raw[i]) * id;
+                tmin = std::fmax(tmin, std::fmin(t1, t2));
+                tmax = std::fmin(tmax, std::fmax(t1, t2));
+            }
+            tNear[c] = tmin;
+            mask |= (tmin <= tmax) << c;
+        }
+#endif
+        return mask & ((1 << node.numChildren) - 1);
+    }
+
+    // Same as hitsChildren for all the rays of a coherent packet at once,
+    // using interval arithmetic on its frustum: returns a mask with the
+    // children that might be hit by any of them closer than tMax, and a
+    // lower bound of the distance where they enter them in tNear
+    // (it's conservative: children not in the mask aren't hit by any ray)
+    static inline int hitsChildren(const Node &node, const RayPacket &packet,
+                                   const float tMax, float tNear[4]) {
+        const BBox &ob = packet.originBounds, &ib = packet.invDirectionBounds;
+#ifdef __SSE__
+        __m128 tmin = _mm_setzero_ps(), tmax = _mm_set1_ps(tMax);
+        for (int i = 0; i < 3; i++) {
+            // Near and far planes are the same for all rays of the packet
+            bool positive = ib.bb0.raw[i] > 0.0f;
+            __m128 near = _mm_loadu_ps(positive ? node.bb0[i] : node.bb1[i]);
+            __m128 far = _mm_loadu_ps(positive ? node.bb1[i] : node.bb0[i]);
+            __m128 o0 = _mm_set1_ps(ob.bb0.raw[i]);
+            __m128 o1 = _mm_set1_ps(ob.bb1.raw[i]);
+            __m128 id0 = _mm_set1_ps(ib.bb0.raw[i]);
+            __m128 id1 = _mm_set1_ps(ib.bb1.raw[i]);
+            // Bounds of (plane - origin) * invDirection for all rays are
+            // the min/max of the products of the intervals' ends
+            __m128 n0 = _mm_sub_ps(near, o0), n1 = _mm_sub_ps(near, o1);
+            __m128 f0 = _mm_sub_ps(far, o0), f1 = _mm_sub_ps(far, o1);
+            __m128 nearMin = _mm_min_ps(
+                _mm_min_ps(_mm_mul_ps(n0, id0), _mm_mul_ps(n0, id1)),
+                _mm_min_ps(_mm_mul_ps(n1, id0), _mm_mul_ps(n1, id1)));
+            __m128 farMax = _mm_max_ps(
+                _mm_max_ps(_mm_mul_ps(f0, id0), _mm_mul_ps(f0, id1)),
+                _mm_max_ps(_mm_mul_ps(f1, id0), _mm_mul_ps(f1, id1)));
+            tmin = _mm_max_ps(nearMin, tmin);
+            tmax = _mm_min_ps(farMax, tmax);
+        }
+        _mm_storeu_ps(tNear, tmin);
+        int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+        int mask = 0;
+        for (int c = 0; c < 4; c++) {
+            float tmin = 0.0f, tmax = tMax;
+            for (int i = 0; i < 3; i++) {
+                bool positive = ib.bb0.raw[i] > 0.0f;
+                float near = positive ? node.bb0[i][c] : node.bb1[i][c];
+                float far = positive ? node.bb1[i][c] : node.bb0[i][c];
+                float n0 = near - ob.bb0.raw[i], n1 = near - ob.bb1.raw[i];
+                float f0 = far - ob.bb0.raw[i], f1 = far - ob.bb1.raw[i];
+                float id0 = ib.bb0.raw[i], id1 = ib.bb1.raw[i];
+                float nearMin = std::fmin(std::fmin(n0 * id0, n0 * id1),
+                                          std::fmin(n1 * id0, n1 * id1));
+                float farMax = std::fmax(std::fmax(f0 * id0, f0 * id1),
+                                         std::fmax(f1 * id0, f1 * id1));
+                tmin = std::fmax(tmin, nearMin);
+                tmax = std::fmin(tmax, farMax);
+            }
+            tNear[c] = tmin;
+            mask |= (tmin <= tmax) << c;
+        }
+#endif
+        return mask & ((1 << node.numChildren) - 1);
+    }
+
+    // Front-to-back traversal of the tree, same as BVH::traverse
+    // fIntersect(primitive, tMax) is called for the primitives of every
+    // leaf whose bbox is hit closer than tMax, and returns true if it has
+    // found a closer hit (it should update tMax with its distance)
+    template <typename F>
+    bool traverse(const Vec4 &origin, const Vec4 &invDirection, float &tMax,
+                  F fIntersect) const {
+        return this->traverseLeaves(
+            origin, invDirection, tMax,
+            [&](int first, int count, float &tMax) {
+                bool hit = false;
+                for (int i = first; i < first + count; i++) {
+                    if (indices[i] >= 0) {
+                        hit = fIntersect(indices[i], tMax) || hit;
+                    }
+                }
+                return hit;
+            });
+    }
+
+    // Same as traverse, but fLeaf(first, count, tMax) is called once per
+    // leaf with its range in getIndices(), so primitives can be
+    // intersected together (count is a multiple of groupSize)
+    // The traversal starts from the given node (by default, the root)
+    template <typename F>
+    bool traverseLeaves(const Vec4 &origin, const Vec4 &invDirection,
+                        float &tMax, F fLeaf, int root = 0) const {
+        if (this->empty()) {
+            return false;
+        }
+        // Nodes or leaves to visit, and the distance where they are hit
+        struct Entry {
+            int offset, count;
+            float distance;
+        } stack[STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = {root, 0, 0.0f};
+        bool hit = false;
+        while (stackSize > 0) {
+            const Entry entry = stack[--stackSize];
+            if (entry.distance > tMax) {
+                continue;  // a closer hit has been found since it was added
+            }
+            if (entry.count > 0) {
+                hit = fLeaf(entry.offset, entry.count, tMax) || hit;
+                continue;
+            }
+            Node decoded;
+            const Node &node = this->getNode(entry.offset, decoded);
+            float tNear[4];
+            int mask = hitsChildren(node, origin, invDirection, tMax, tNear);
+            int order[4], numHits = sortChildren(mask, tNear, order);
+            for (int j = 0; j < numHits; j++) {
+                int c = order[j];
+                stack[stackSize++] = {node.offset[c], node.count[c],
+                                      tNear[c]};
+            }
+        }
+        return hit;
+    }
+
+    // Front-to-back traversal of the tree with the rays of the packet in
+    // mask, each one with its own tMax. fLeaf(first, count, mask, tMax) is
+    // called once per leaf with the rays that might hit it, returning a
+    // mask with the ones that have found a closer hit (it should update
+    // their tMax). Returns a mask with the rays that have found a hit
+    // Coherent packets are culled with their frustum only (one test per
+    // node for all rays), the rest of the rays are traversed one by one,
+    // as well as the last ray left in a subtree once the others are done
+    template <typename F>
+    int traversePacket(const RayPacket &packet, int mask, float tMax[],
+                       F fLeaf) const {
+        if (this->empty()) {
+            return 0;
+        }
+        // Traverse subtree with only one of the rays
+        auto traverseRay = [&](int r, int root) {
+            int rayMask = 1 << r;
+            return this->traverseLeaves(
+                       packet.origin[r], packet.invDirection[r], tMax[r],
+                       [&](int first, int count, float &) {
+                           return fLeaf(first, count, rayMask, tMax) != 0;
+                       },
+                       root)
+                       ? rayMask
+                       : 0;
+        };
+        int hits = 0;
+        if (!packet.coherent) {
+            for (int r = 0; r < packet.size; r++) {
+                if (mask & (1 << r)) {
+                    hits |= traverseRay(r, 0);
+                }
+            }
+            return hits;
+        }
+        // Nodes or leaves to visit, the rays that might hit them and the
+        // minimum distance where they could be hit
+        struct Entry {
+            int offset, count, mask;
+            float distance;
+        } stack[STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = {0, 0, mask, 0.0f};
+        while (stackSize > 0) {
+            Entry entry = stack[--stackSize];
+            // Drop the rays that have found a closer hit since it was added
+            float maxTMax = 0.0f;
+            int last = -1;
+            for (int r = 0; r < packet.size; r++) {
+                if (entry.mask & (1 << r)) {
+                    if (entry.distance > tMax[r]) {
+                        entry.mask &= ~(1 << r);
+                    } else {
+                        maxTMax = tMax[r] > maxTMax ? tMax[r] : maxTMax;
+                        last = r;
+                    }
+                }
+            }
+            if (entry.mask == 0) {
+                continue;
+            }
+            if (entry.count > 0) {
+                hits |= fLeaf(entry.offset, entry.count, entry.mask, tMax);
+            } else if ((entry.mask & (entry.mask - 1)) == 0) {
+                hits |= traverseRay(last, entry.offset);
+            } else {
+                Node decoded;
+                const Node &node = this->getNode(entry.offset, decoded);
+                float tNear[4];
+                int hitMask = hitsChildren(node, packet, maxTMax, tNear);
+                int order[4], numHits = sortChildren(hitMask, tNear, order);
+                for (int j = 0; j < numHits; j++) {
+                    int c = order[j];
+                    stack[stackSize++] = {node.offset[c], node.count[c],
+                                          entry.mask, tNear[c]};
+                }
+            }
+        }
+        return hits;
+    }
+
+    // Any-hit traversal of the tree, same as BVH::occluded
+    // (children aren't visited in order, as any hit is enough)
+    template <typename F>
+    bool occluded(const Vec4 &origin, const Vec4 &invDirection,
+                  const float tMax, F fOccluded) const {
+        return this->occludedLeaves(
+            origin, invDirection, tMax, [&](int first, int count) {
+                for (int i = first; i < first + count; i++) {
+                    if (indices[i] >= 0 && fOccluded(indices[i])) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+    }
+
+    // Same as occluded, calling fLeaf(first, count) once per leaf
+    template <typename F>
+    bool occludedLeaves(const Vec4 &origin, const Vec4 &invDirection,
+                        const float tMax, F fLeaf) const {
+        if (this->empty()) {
+            return false;
+        }
+        int stack[STACK_SIZE];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0) {
+            Node decoded;
+            const Node &node = this->getNode(stack[--stackSize], decoded);
+            float tNear[4];
+            int mask = hitsChildren(node, origin, invDirection, tMax, tNear);
+            for (int c = 0; c < node.numChildren; c++) {
+                if (!(mask & (1 << c))) {
+                    continue;
+                }
+                if (node.count[c] == 0) {
+                    stack[stackSize++] = node.offset[c];
+                    continue;
+                }
+                if (fLeaf(node.offset[c], node.count[c])) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
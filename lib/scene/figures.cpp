@@ -2,7 +2,62 @@
 
 namespace Figures {
 
-bool Plane::intersection(const Ray &ray, RayHit &hit) const {
+bool Figure::intersection(const Ray &ray, RayHit &hit, float tMax) const {
+    HitRecord record;
+    if (!this->closestHit(ray, record, tMax)) {
+        return false;
+    }
+    // Full hit information only for the closest one
+    if (record.instance != nullptr) {
+        record.instance->finalize(ray, record, hit);
+    } else {
+        record.figure->finalize(ray, record, hit);
+    }
+    return true;
+}
+
+int Figure::closestHitPacket(const RayPacket &packet, int mask,
+                             HitRecord records[], float tMax[]) const {
+    int hits = 0;
+    for (int r = 0; r < packet.size; r++) {
+        HitRecord record;
+        if ((mask & (1 << r)) &&
+            this->closestHit(packet.rays[r], record, tMax[r])) {
+            tMax[r] = record.distance;
+            records[r] = record;
+            hits |= 1 << r;
+        }
+    }
+    return hits;
+}
+
+int Figure::intersection(const RayPacket &packet, RayHit hits[]) const {
+    HitRecord records[RayPacket::MAX_SIZE];
+    float tMax[RayPacket::MAX_SIZE];
+    for (int r = 0; r < packet.size; r++) {
+        tMax[r] = std::numeric_limits<float>::max();
+    }
+    int mask = this->closestHitPacket(packet, packet.mask, records, tMax);
+    // Full hit information only for the closest ones
+    for (int r = 0; r < packet.size; r++) {
+        if (!(mask & (1 << r))) {
+            continue;
+        }
+        if (records[r].instance != nullptr) {
+            records[r].instance->finalize(packet.rays[r], records[r], hits[r]);
+        } else {
+            records[r].figure->finalize(packet.rays[r], records[r], hits[r]);
+        }
+    }
+    return mask;
+}
+
+bool Figure::occluded(const Ray &ray, float tMax) const {
+    HitRecord record;
+    return this->closestHit(ray, record, tMax);
+}
+
+bool Plane::closestHit(const Ray &ray, HitRecord &record, float tMax) const {
     // Check if rayDir is perpendicular to plane normal (dot product is near 0)
     if (std::abs(dot(ray.direction, this->normal)) < 1e-5f) {
         // Ray direction and plane are parallel, they don't meet
@@ -11,21 +66,28 @@ bool Plane::intersection(const Ray &ray, RayHit &hit) const {
     // Ray intersects with plane, return intersection point
     float alpha = (this->distToOrigin - dot(this->normal, ray.origin)) /
                   dot(ray.direction, this->normal);
-    if (alpha < 1e-5f) {
-        // Intersection is behind the camera, it isn't visible
+    if (alpha < 1e-5f || alpha >= tMax) {
+        // Intersection is behind the camera or further than a known hit
         return false;
     }
     // Intersection in front of the camera
-    hit.distance = alpha;
-    hit.point = ray.project(alpha);
-    if (!this->getMaterial(hit.point, hit.material)) {
+    MaterialPtr material;
+    if (!this->getMaterial(ray.project(alpha), material)) {
         // plane is not infinite and it has hit outside
         return false;
     }
-    // material is stored in hit.material
+    record.distance = alpha;
+    record.figure = this;
+    return true;
+}
+
+void Plane::finalize(const Ray &ray, const HitRecord &record,
+                     RayHit &hit) const {
+    hit.distance = record.distance;
+    hit.point = ray.project(record.distance);
+    this->getMaterial(hit.point, hit.material);
     hit.enters = dot(this->normal, ray.direction) > 1e-5f;
     hit.normal = hit.enters ? this->normal * -1.0f : this->normal;
-    return true;
 }
 
 bool TexturedPlane::getMaterial(const Vec4 &hitPoint,
@@ -59,22 +121,23 @@ void TexturedPlane::setUVMaterial(const UVMaterialPtr &_uvMaterial,
     this->uvY = _uvY;
 }
 
-Vec4 TexturedPlane::randomPoint() const {
+Vec4 TexturedPlane::randomPoint(Sampler &sampler) const {
     float rx, ry;
     do {
-        rx = Random::ZeroOne();
-        ry = Random::ZeroOne();
+        rx = sampler.zeroOne();
+        ry = sampler.zeroOne();
     } while (this->uvMaterial->get(rx, ry) == nullptr ||
              !this->uvMaterial->get(rx, ry)->emitsLight);
     return this->uvOrigin + this->uvX * rx + this->uvY * ry;
 }
 
-Vec4 TexturedPlane::randomDirection(const Vec4 &point) const {
+Vec4 TexturedPlane::randomDirection(const Vec4 &point,
+                                    Sampler &sampler) const {
     Vec4 z = this->normal;
     Vec4 x = this->uvX.normalize();
     Vec4 y = this->uvY.normalize();
     Mat4 cob = Mat4::changeOfBasis(x, y, z, Vec4(0.0f));
-    return Random::CosHemisphere(cob);
+    return Random::CosHemisphere(cob, sampler);
 }
 
 float TexturedPlane::getTotalArea() const {
@@ -85,7 +148,8 @@ float TexturedPlane::getTotalArea() const {
 
 // Ray-sphere intersection algorithm source:
 // https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-sphere-intersection
-bool Sphere::intersection(const Ray &ray, RayHit &hit) const {
+bool Sphere::closestHit(const Ray &ray, HitRecord &record,
+                        float tMax) const {
     Vec4 l = this->center - ray.origin;
     float tca = dot(l, ray.direction);
     if (tca < 1e-5f) {
@@ -99,6 +163,7 @@ bool Sphere::intersection(const Ray &ray, RayHit &hit) const {
         return false;
     }
     float thc = sqrtf(radius2 - d2);
+    float distance;
     if (tca - thc < 1e-5f) {
         // First hit is behind the camera
         if (tca + thc < 1e-5f) {
@@ -106,29 +171,37 @@ bool Sphere::intersection(const Ray &ray, RayHit &hit) const {
             return false;
         } else {
             // Return second hit (from inside the sphere)
-            hit.distance = tca + thc;
-            hit.point = ray.project(tca + thc);
-            hit.material = this->material;
-            hit.normal = (this->center - hit.point).normalize();
-            hit.enters = false;
-            return true;
+            distance = tca + thc;
         }
     } else {
         // Return first hit (from outside the sphere)
-        hit.distance = tca - thc;
-        hit.point = ray.project(tca - thc);
-        hit.material = this->material;
-        hit.normal = (hit.point - this->center).normalize();
-        hit.enters = true;
-        return true;
+        distance = tca - thc;
+    }
+    if (distance >= tMax) {
+        // Further than a known hit
+        return false;
     }
+    record.distance = distance;
+    record.figure = this;
+    return true;
 }
 
-Vec4 Sphere::randomPoint() const {
-    return this->center + Random::Sphere() * this->radius;
+void Sphere::finalize(const Ray &ray, const HitRecord &record,
+                      RayHit &hit) const {
+    hit.distance = record.distance;
+    hit.point = ray.project(record.distance);
+    hit.material = this->material;
+    // Ray enters if it hits the side of the sphere facing it
+    Vec4 outNormal = (hit.point - this->center).normalize();
+    hit.enters = dot(outNormal, ray.direction) < 0.0f;
+    hit.normal = hit.enters ? outNormal : outNormal * -1.0f;
 }
 
-Vec4 Sphere::randomDirection(const Vec4 &point) const {
+Vec4 Sphere::randomPoint(Sampler &sampler) const {
+    return this->center + Random::Sphere(sampler) * this->radius;
+}
+
+Vec4 Sphere::randomDirection(const Vec4 &point, Sampler &sampler) const {
     Vec4 z = (point - this->center).normalize();
     Vec4 x;
     if (std::fabs(z.x) > std::fabs(z.y)) {
@@ -138,7 +211,7 @@ Vec4 Sphere::randomDirection(const Vec4 &point) const {
     }
     Vec4 y = cross(x, z);
     Mat4 cob = Mat4::changeOfBasis(x, y, z, Vec4(0.0f));
-    return Random::CosHemisphere(cob);
+    return Random::CosHemisphere(cob, sampler);
 }
 
 float Sphere::getTotalArea() const {
@@ -159,35 +232,9 @@ Triangle::Triangle(const PLYModel *_model, int _v0i, int _v1i, int _v2i)
       edge1(v2 - v0),
       normal(cross(edge1, edge0).normalize()) {}
 
-// https://github.com/ssloy/tinyrenderer/wiki/Lesson-2:-Triangle-rasterization-and-back-face-culling
-Vec4 Triangle::getBarycentric(const Vec4 &p) const {
-    // Triangle abc, find barycentric coordinates of p
-    Vec4 ab = edge0;
-    Vec4 ac = edge1;
-    Vec4 pa = v0 - p;
-    // Find u, v s.t. u*ab + v*ac + pa = 0
-    // To solve (u v 1)'*(abx acx pax) = 0 and (u v 1)'*(aby acy pay) = 0,
-    // result is cross product of both (scaled so z = 1: x/z, y/z, z/z = 1)
-    Vec4 vx = Vec4(ab.x, ac.x, pa.x, 0.0f);
-    Vec4 vy = Vec4(ab.y, ac.y, pa.y, 0.0f);
-    Vec4 vcross = cross(vx, vy);
-    // p is inside the triangle if (u, v, 1-u-v) are all greater than 0
-    // u = vcross.x / vcross.z, v = vcross.y / vcross.z
-    // In other words: x, y & z have the same sign (so u and v are positive)
-    // also (x + y) <= z (so 1-u-v is also positive)
-    // Finally, if z = 0 the triangle is degenerate and shouldn't be drawn
-    Vec4 coords(-1.0f, -1.0f, -1.0f, 0.0f);
-    if (std::abs(vcross.z) > 1e-5f) {  // check degenerate triangle
-        coords.y = vcross.x / vcross.z;
-        coords.z = vcross.y / vcross.z;
-        // add small epsilon to prevent float precision errors
-        coords.x = 1.0f + 1e-5f - (vcross.x + vcross.y) / vcross.z;
-    }
-    return coords;
-}
-
 // https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-bool Triangle::intersection(const Ray &ray, RayHit &hit) const {
+bool Triangle::closestHit(const Ray &ray, HitRecord &record,
+                          float tMax) const {
     Vec4 h, s, q;
     float a, f, u, v;
     h = cross(ray.direction, this->edge1);
@@ -209,17 +256,26 @@ bool Triangle::intersection(const Ray &ray, RayHit &hit) const {
     // At this stage we can compute t to find out where the intersection point
     // is on the line.
     float t = f * dot(this->edge1, q);
-    if (t < 1e-5f) {
-        // Intersection is behind the camera
+    if (t < 1e-5f || t >= tMax) {
+        // Intersection is behind the camera or further than a known hit
         return false;
     }
-    // Ray intersection
-    hit.distance = t;
-    hit.point = ray.project(t);
+    // u, v are the barycentric coordinates of v1 and v2
+    record.distance = t;
+    record.u = u;
+    record.v = v;
+    record.figure = this;
+    return true;
+}
+
+void Triangle::finalize(const Ray &ray, const HitRecord &record,
+                        RayHit &hit) const {
+    hit.distance = record.distance;
+    hit.point = ray.project(record.distance);
     // Calculate texture coordinates
-    Vec4 b = getBarycentric(hit.point);
-    float tex0 = uv0[0] * b.x + uv1[0] * b.y + uv2[0] * b.z;
-    float tex1 = uv0[1] * b.x + uv1[1] * b.y + uv2[1] * b.z;
+    float w = 1.0f - record.u - record.v;
+    float tex0 = uv0[0] * w + uv1[0] * record.u + uv2[0] * record.v;
+    float tex1 = uv0[1] * w + uv1[1] * record.u + uv2[1] * record.v;
     // Clamp between 0-1
     tex0 = tex0 < 1e-5f ? 0.0f : tex0;
     tex0 = tex0 > 1.0f - 1e-5f ? 1.0f - 1e-5f : tex0;
@@ -229,13 +285,476 @@ bool Triangle::intersection(const Ray &ray, RayHit &hit) const {
     // Calculate normal as it was a plane
     hit.enters = dot(this->normal, ray.direction) < -1e-5f;
     hit.normal = hit.enters ? this->normal : this->normal * -1.0f;
+}
+
+/// Mesh ///
+
+Mesh::Mesh(const std::vector<Vec4> &verts,
+           const std::vector<std::array<int, 3>> &faces,
+           const std::vector<std::array<float, 2>> &uvs,
+           const UVMaterialPtr &_uvMaterial, float _maxDuplication,
+           bool _useKdTree, bool _compressTree, bool _lazyTree)
+    : uvMaterial(_uvMaterial),
+      maxDuplication(_maxDuplication),
+      compressTree(_compressTree),
+      useKdTree(_useKdTree),
+      lazyTree(_lazyTree) {
+    vx.resize(verts.size());
+    vy.resize(verts.size());
+    vz.resize(verts.size());
+    uvx.resize(verts.size(), 0.0f);
+    uvy.resize(verts.size(), 0.0f);
+    for (int i = 0; i < verts.size(); i++) {
+        vx[i] = verts[i].x;
+        vy[i] = verts[i].y;
+        vz[i] = verts[i].z;
+        if (!uvs.empty()) {
+            uvx[i] = uvs[i][0];
+            uvy[i] = uvs[i][1];
+        }
+    }
+    f0.resize(faces.size());
+    f1.resize(faces.size());
+    f2.resize(faces.size());
+    for (int f = 0; f < faces.size(); f++) {
+        f0[f] = faces[f][0];
+        f1[f] = faces[f][1];
+        f2[f] = faces[f][2];
+    }
+    this->buildTree();
+    this->buildPackets();
+}
+
+void Mesh::buildTree() {
+    // Leaves are intersected a packet at a time, so build the tree
+    // counting the cost of a packet instead of a face
+    if (lazyTree) {
+        this->lazyBvh = LazyBVH(this->faceBounds());
+        return;
+    } else if (useKdTree) {
+        this->kdtree = KdTree(this->faceBounds(), PACKET_SIZE);
+        return;
+    } else if (maxDuplication <= 0.0f) {
+        this->bvh = BVH(this->faceBounds(), PACKET_SIZE);
+        return;
+    }
+    std::vector<BVH::Triangle> triangles(this->nfaces());
+    for (int f = 0; f < this->nfaces(); f++) {
+        triangles[f] = {{this->vertex(f0[f]), this->vertex(f1[f]),
+                         this->vertex(f2[f])}};
+    }
+    this->bvh = BVH(triangles, PACKET_SIZE, maxDuplication);
+}
+
+std::vector<BBox> Mesh::faceBounds() const {
+    std::vector<BBox> bounds(this->nfaces());
+    for (int f = 0; f < this->nfaces(); f++) {
+        bounds[f].extend(this->vertex(f0[f]));
+        bounds[f].extend(this->vertex(f1[f]));
+        bounds[f].extend(this->vertex(f2[f]));
+    }
+    return bounds;
+}
+
+void Mesh::buildPackets() {
+    if (lazyTree) {
+        return;  // leaves aren't known yet
+    }
+    if (!useKdTree) {
+        this->bvh4 = BVH4(bvh, PACKET_SIZE, compressTree);
+        if (compressTree) {
+            this->bvh = BVH();
+        }
+    }
+    if (compressTree && !useKdTree) {
+        this->packets = std::vector<FacePacket>();  // see getPacket
+        return;
+    }
+    const std::vector<int> &indices =
+        useKdTree ? kdtree.getIndices() : bvh4.getIndices();
+    packets.resize(indices.size() / PACKET_SIZE);
+    for (int p = 0; p < packets.size(); p++) {
+        this->packFaces(indices, p, packets[p]);
+    }
+}
+
+void Mesh::packFaces(const std::vector<int> &indices, int p,
+                     FacePacket &packet) const {
+    for (int c = 0; c < PACKET_SIZE; c++) {
+        int face = indices[p * PACKET_SIZE + c];
+        // Padding is a degenerate face at the origin, it's never hit
+        Vec4 v0, edge0, edge1;
+        if (face >= 0) {
+            v0 = this->vertex(f0[face]);
+            edge0 = this->vertex(f1[face]) - v0;
+            edge1 = this->vertex(f2[face]) - v0;
+        }
+        for (int i = 0; i < 3; i++) {
+            packet.v0[i][c] = v0.raw[i];
+            packet.edge0[i][c] = edge0.raw[i];
+            packet.edge1[i][c] = edge1.raw[i];
+        }
+        packet.face[c] = face;
+    }
+}
+
+bool Mesh::setVertices(const std::vector<Vec4> &verts, float maxCostRatio) {
+    if (verts.size() != vx.size()) {
+        throw std::domain_error(
+            "Mesh vertices can only be moved, not added or removed");
+    }
+    for (int i = 0; i < verts.size(); i++) {
+        vx[i] = verts[i].x;
+        vy[i] = verts[i].y;
+        vz[i] = verts[i].z;
+    }
+    bool rebuilt;
+    if (useKdTree || compressTree || lazyTree) {
+        this->buildTree();
+        rebuilt = true;
+    } else if (maxDuplication <= 0.0f) {
+        rebuilt = bvh.refit(this->faceBounds(), maxCostRatio);
+    } else {
+        // The tree can only build itself again without spatial splits
+        bvh.refit(this->faceBounds());
+        rebuilt = maxCostRatio > 0.0f &&
+                  bvh.getCost() > bvh.getBuiltCost() * maxCostRatio;
+        if (rebuilt) {
+            this->buildTree();
+        }
+    }
+    // The 4-wide tree and the packets are cheap to make from the refit one
+    this->buildPackets();
+    return rebuilt;
+}
+
+void Mesh::save(BinaryWriter &file) const {
+    file.write((int)PACKET_SIZE);
+    file.write(maxDuplication);
+    file.write(useKdTree);
+    file.write(compressTree);
+    file.write(lazyTree);
+    file.write(vx);
+    file.write(vy);
+    file.write(vz);
+    file.write(uvx);
+    file.write(uvy);
+    file.write(f0);
+    file.write(f1);
+    file.write(f2);
+    if (lazyTree) {
+        return;  // there's nothing built to save
+    } else if (useKdTree) {
+        kdtree.save(file);
+    } else {
+        bvh.save(file);
+        bvh4.save(file);
+    }
+    file.write(packets);
+}
+
+std::shared_ptr<Mesh> Mesh::load(MappedFile &file,
+                                 const UVMaterialPtr &uvMaterial) {
+    std::shared_ptr<Mesh> mesh(new Mesh(uvMaterial));
+    int packetSize;
+    if (!file.read(packetSize) || packetSize != PACKET_SIZE ||
+        !file.read(mesh->maxDuplication) || !file.read(mesh->useKdTree) ||
+        !file.read(mesh->compressTree) || !file.read(mesh->lazyTree) ||
+        !file.read(mesh->vx) ||
+        !file.read(mesh->vy) || !file.read(mesh->vz) ||
+        !file.read(mesh->uvx) || !file.read(mesh->uvy) ||
+        !file.read(mesh->f0) || !file.read(mesh->f1) ||
+        !file.read(mesh->f2) || !mesh->isValid()) {
+        return nullptr;
+    }
+    if (mesh->lazyTree) {
+        mesh->buildTree();
+        return mesh;
+    }
+    int nfaces = mesh->nfaces();
+    bool loaded = mesh->useKdTree
+                      ? mesh->kdtree.load(file, nfaces) &&
+                            mesh->kdtree.getGroupSize() == PACKET_SIZE
+                      : mesh->bvh.load(file, nfaces) &&
+                            mesh->bvh4.load(file, nfaces) &&
+                            mesh->bvh4.getGroupSize() == PACKET_SIZE;
+    if (!loaded || !file.read(mesh->packets) || !mesh->validPackets()) {
+        return nullptr;
+    }
+    return mesh;
+}
+
+bool Mesh::isValid() const {
+    int nverts = vx.size();
+    if (vy.size() != nverts || vz.size() != nverts ||
+        uvx.size() != nverts || uvy.size() != nverts ||
+        f1.size() != f0.size() || f2.size() != f0.size()) {
+        return false;
+    }
+    for (int f = 0; f < this->nfaces(); f++) {
+        if (f0[f] < 0 || f0[f] >= nverts || f1[f] < 0 || f1[f] >= nverts ||
+            f2[f] < 0 || f2[f] >= nverts) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Mesh::validPackets() const {
+    if (compressTree && !useKdTree) {
+        return packets.empty();  // see getPacket
+    }
+    const std::vector<int> &indices =
+        useKdTree ? kdtree.getIndices() : bvh4.getIndices();
+    if (packets.size() * PACKET_SIZE != indices.size()) {
+        return false;
+    }
+    for (int p = 0; p < packets.size(); p++) {
+        for (int c = 0; c < PACKET_SIZE; c++) {
+            if (packets[p].face[c] != indices[p * PACKET_SIZE + c]) {
+                return false;
+            }
+        }
+    }
     return true;
 }
 
+// Same as Triangle::closestHit (Moller-Trumbore), without precomputed edges
+bool Mesh::hitFace(int face, const Ray &ray, float tMax, float &t, float &u,
+                   float &v) const {
+    Vec4 v0 = this->vertex(f0[face]);
+    Vec4 edge0 = this->vertex(f1[face]) - v0;
+    Vec4 edge1 = this->vertex(f2[face]) - v0;
+    Vec4 h = cross(ray.direction, edge1);
+    float a = dot(edge0, h);
+    if (std::abs(a) < 1e-5f) {
+        return false;  // This ray is parallel to this triangle.
+    }
+    float f = 1.0f / a;
+    Vec4 s = ray.origin - v0;
+    u = f * dot(s, h);
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    Vec4 q = cross(s, edge0);
+    v = f * dot(ray.direction, q);
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    t = f * dot(edge1, q);
+    // Intersection behind the camera or further than a known hit
+    return t >= 1e-5f && t < tMax;
+}
+
+#ifdef __SSE__
+int Mesh::hitPacket(const FacePacket &packet, const Ray &ray, float tMax,
+                    float t[4], float u[4], float v[4]) const {
+    // Same operations as hitFace, with each face in a lane
+    __m128 dx = _mm_set1_ps(ray.direction.x);
+    __m128 dy = _mm_set1_ps(ray.direction.y);
+    __m128 dz = _mm_set1_ps(ray.direction.z);
+    __m128 e0x = _mm_loadu_ps(packet.edge0[0]);
+    __m128 e0y = _mm_loadu_ps(packet.edge0[1]);
+    __m128 e0z = _mm_loadu_ps(packet.edge0[2]);
+    __m128 e1x = _mm_loadu_ps(packet.edge1[0]);
+    __m128 e1y = _mm_loadu_ps(packet.edge1[1]);
+    __m128 e1z = _mm_loadu_ps(packet.edge1[2]);
+    // h = cross(direction, edge1), a = dot(edge0, h)
+    __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+    __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+    __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+    __m128 a = _mm_add_ps(
+        _mm_add_ps(_mm_mul_ps(e0x, hx), _mm_mul_ps(e0y, hy)),
+        _mm_mul_ps(e0z, hz));
+    // Rays parallel to the face (and padding faces, with a = 0)
+    __m128 absA = _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+    __m128 mask = _mm_cmpge_ps(absA, _mm_set1_ps(1e-5f));
+    __m128 f = _mm_div_ps(_mm_set1_ps(1.0f), a);
+    // s = origin - v0, u = f * dot(s, h)
+    __m128 sx = _mm_sub_ps(_mm_set1_ps(ray.origin.x),
+                           _mm_loadu_ps(packet.v0[0]));
+    __m128 sy = _mm_sub_ps(_mm_set1_ps(ray.origin.y),
+                           _mm_loadu_ps(packet.v0[1]));
+    __m128 sz = _mm_sub_ps(_mm_set1_ps(ray.origin.z),
+                           _mm_loadu_ps(packet.v0[2]));
+    __m128 uu = _mm_mul_ps(
+        f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)),
+                      _mm_mul_ps(sz, hz)));
+    // q = cross(s, edge0), v = f * dot(direction, q), t = f * dot(edge1, q)
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e0z), _mm_mul_ps(sz, e0y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e0x), _mm_mul_ps(sx, e0z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e0y), _mm_mul_ps(sy, e0x));
+    __m128 vv = _mm_mul_ps(
+        f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                      _mm_mul_ps(dz, qz)));
+    __m128 tt = _mm_mul_ps(
+        f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, qx), _mm_mul_ps(e1y, qy)),
+                      _mm_mul_ps(e1z, qz)));
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(uu, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(uu, one));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(vv, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(uu, vv), one));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(tt, _mm_set1_ps(1e-5f)));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, _mm_set1_ps(tMax)));
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(u, uu);
+    _mm_storeu_ps(v, vv);
+    return _mm_movemask_ps(mask);
+}
+#else
+int Mesh::hitPacket(const FacePacket &packet, const Ray &ray, float tMax,
+                    float t[4], float u[4], float v[4]) const {
+    int mask = 0;
+    for (int c = 0; c < PACKET_SIZE; c++) {
+        if (packet.face[c] >= 0 &&
+            this->hitFace(packet.face[c], ray, tMax, t[c], u[c], v[c])) {
+            mask |= 1 << c;
+        }
+    }
+    return mask;
+}
+#endif
+
+bool Mesh::closestHit(const Ray &ray, HitRecord &record, float tMax) const {
+    auto hitLeaf = [&](int first, int count, float &tMax) {
+        bool hit = false;
+        for (int p = first / PACKET_SIZE; p < (first + count) / PACKET_SIZE;
+             p++) {
+            FacePacket gathered;
+            const FacePacket &faces = this->getPacket(p, gathered);
+            float t[4], u[4], v[4];
+            int mask = this->hitPacket(faces, ray, tMax, t, u, v);
+            for (int c = 0; c < PACKET_SIZE; c++) {
+                // tMax decreases with every hit, recheck it
+                if ((mask & (1 << c)) && t[c] < tMax) {
+                    tMax = t[c];
+                    record.distance = t[c];
+                    record.u = u[c];
+                    record.v = v[c];
+                    record.primitive = faces.face[c];
+                    record.figure = this;
+                    hit = true;
+                }
+            }
+        }
+        return hit;
+    };
+    if (lazyTree) {
+        return lazyBvh.traverse(
+            ray.origin, ray.invDirection, tMax, [&](int face, float &tMax) {
+                float t, u, v;
+                if (!this->hitFace(face, ray, tMax, t, u, v)) {
+                    return false;
+                }
+                tMax = t;
+                record.distance = t;
+                record.u = u;
+                record.v = v;
+                record.primitive = face;
+                record.figure = this;
+                return true;
+            });
+    } else if (useKdTree) {
+        return kdtree.traverseLeaves(ray.origin, ray.direction,
+                                     ray.invDirection, tMax, hitLeaf);
+    }
+    return bvh4.traverseLeaves(ray.origin, ray.invDirection, tMax, hitLeaf);
+}
+
+int Mesh::closestHitPacket(const RayPacket &packet, int mask,
+                           HitRecord records[], float tMax[]) const {
+    if (useKdTree || lazyTree) {
+        // Rays go through different leaves, trace them one by one
+        return Figure::closestHitPacket(packet, mask, records, tMax);
+    }
+    return bvh4.traversePacket(
+        packet, mask, tMax, [&](int first, int count, int mask, float tMax[]) {
+            int hits = 0;
+            for (int p = first / PACKET_SIZE;
+                 p < (first + count) / PACKET_SIZE; p++) {
+                // Packed once for all the rays
+                FacePacket gathered;
+                const FacePacket &faces = this->getPacket(p, gathered);
+                for (int r = 0; r < packet.size; r++) {
+                    if (!(mask & (1 << r))) {
+                        continue;
+                    }
+                    float t[4], u[4], v[4];
+                    int hit = this->hitPacket(faces, packet.rays[r], tMax[r],
+                                              t, u, v);
+                    for (int c = 0; c < PACKET_SIZE; c++) {
+                        if ((hit & (1 << c)) && t[c] < tMax[r]) {
+                            tMax[r] = t[c];
+                            records[r].distance = t[c];
+                            records[r].u = u[c];
+                            records[r].v = v[c];
+                            records[r].primitive = faces.face[c];
+                            records[r].figure = this;
+                            records[r].instance = nullptr;
+                            hits |= 1 << r;
+                        }
+                    }
+                }
+            }
+            return hits;
+        });
+}
+
+bool Mesh::occluded(const Ray &ray, float tMax) const {
+    auto hitsLeaf = [&](int first, int count) {
+        for (int p = first / PACKET_SIZE; p < (first + count) / PACKET_SIZE;
+             p++) {
+            FacePacket gathered;
+            float t[4], u[4], v[4];
+            if (this->hitPacket(this->getPacket(p, gathered), ray, tMax, t, u,
+                                v) != 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+    if (lazyTree) {
+        return lazyBvh.occluded(
+            ray.origin, ray.invDirection, tMax, [&](int face) {
+                float t, u, v;
+                return this->hitFace(face, ray, tMax, t, u, v);
+            });
+    } else if (useKdTree) {
+        return kdtree.occludedLeaves(ray.origin, ray.direction,
+                                     ray.invDirection, tMax, hitsLeaf);
+    }
+    return bvh4.occludedLeaves(ray.origin, ray.invDirection, tMax, hitsLeaf);
+}
+
+void Mesh::finalize(const Ray &ray, const HitRecord &record,
+                    RayHit &hit) const {
+    int i0 = f0[record.primitive], i1 = f1[record.primitive],
+        i2 = f2[record.primitive];
+    hit.distance = record.distance;
+    hit.point = ray.project(record.distance);
+    // Calculate texture coordinates
+    float w = 1.0f - record.u - record.v;
+    float tex0 = uvx[i0] * w + uvx[i1] * record.u + uvx[i2] * record.v;
+    float tex1 = uvy[i0] * w + uvy[i1] * record.u + uvy[i2] * record.v;
+    // Clamp between 0-1 (NaN, e.g. from a damaged cache, fails >= too)
+    tex0 = tex0 >= 1e-5f ? tex0 : 0.0f;
+    tex0 = tex0 > 1.0f - 1e-5f ? 1.0f - 1e-5f : tex0;
+    tex1 = tex1 >= 1e-5f ? tex1 : 0.0f;
+    tex1 = tex1 > 1.0f - 1e-5f ? 1.0f - 1e-5f : tex1;
+    hit.material = this->uvMaterial->get(tex0, tex1);
+    // Calculate normal as it was a plane
+    Vec4 v0 = this->vertex(i0);
+    Vec4 normal =
+        cross(this->vertex(i2) - v0, this->vertex(i1) - v0).normalize();
+    hit.enters = dot(normal, ray.direction) < -1e-5f;
+    hit.normal = hit.enters ? normal : normal * -1.0f;
+}
+
 /// Box ///
 
 // https://tavianator.com/fast-branchless-raybounding-box-intersections-part-2-nans/
-bool Box::intersection(const Ray &ray, RayHit &hit) const {
+bool Box::closestHit(const Ray &ray, HitRecord &record, float tMax) const {
     // find intersection point for each of the 6 planes that define the box
     float t1, t2;
     float tmin = std::numeric_limits<float>::max() * -1.0f;
@@ -251,56 +770,127 @@ bool Box::intersection(const Ray &ray, RayHit &hit) const {
     if (tmax < std::fmax(tmin, 0.0f)) {
         // No hit
         return false;
-    } else {
-        // If first hit is behind the camera, take the second one
-        hit.distance = tmin < 0.0f ? tmax : tmin;
-        hit.point = ray.project(hit.distance);
-        // As boxes are only used for BVH/KdTree nodes, they don't
-        // have a material and don't return info about normal/etc.
-        return true;
     }
+    // If first hit is behind the camera, take the second one
+    float distance = tmin < 0.0f ? tmax : tmin;
+    if (distance >= tMax) {
+        return false;
+    }
+    record.distance = distance;
+    record.figure = this;
+    return true;
+}
+
+void Box::finalize(const Ray &ray, const HitRecord &record,
+                   RayHit &hit) const {
+    hit.distance = record.distance;
+    hit.point = ray.project(record.distance);
+    // As boxes are only used for BVH/KdTree nodes, they don't
+    // have a material and don't return info about normal/etc.
+}
+
+bool Box::peek(const Ray &ray, HitRecord &record, float tMax) const {
+    // Same as intersection, but clipping the ray to [0, tMax) so it also
+    // hits when it starts inside the box (contents may be in front of it)
+    float t1, t2;
+    float tmin = 0.0f, tmax = tMax;
+    for (int i = 0; i < 3; i++) {
+        t1 = (bb0.raw[i] - ray.origin.raw[i]) * ray.invDirection.raw[i];
+        t2 = (bb1.raw[i] - ray.origin.raw[i]) * ray.invDirection.raw[i];
+        tmin = std::fmax(tmin, std::fmin(t1, t2));
+        tmax = std::fmin(tmax, std::fmax(t1, t2));
+    }
+    if (tmax < tmin || tmin >= tMax) {
+        return false;
+    }
+    // Only the distance is saved, peeks can't be finalized
+    record.distance = tmin;
+    return true;
 }
 
 /// BVNode ///
 
-bool BVNode::peek(const Ray &ray, RayHit &hit) const {
+bool BVNode::peek(const Ray &ray, HitRecord &record, float tMax) const {
     // shouldn't be called if alwaysHits = true
-    return bbox->intersection(ray, hit);
+    return bbox->peek(ray, record, tMax);
 }
 
-bool BVNode::intersection(const Ray &ray, RayHit &hit) const {
-    // Check if ray doesn't hit box
-    if (!this->alwaysHits && !this->bbox->intersection(ray, hit)) {
+bool BVNode::closestHit(const Ray &ray, HitRecord &record, float tMax) const {
+    // Check if ray doesn't hit box before tMax
+    HitRecord bboxHit;
+    if (!this->alwaysHits && !this->bbox->peek(ray, bboxHit, tMax)) {
         return false;
     }
-    float minDistance = std::numeric_limits<float>::max();
+    bool found = false;
     // Intersect with all figures in scene
     for (auto const &figure : this->children) {
-        RayHit figureHit;
-        if (figure->intersection(ray, figureHit) &&
-            figureHit.distance < minDistance) {
-            // Only save intersection if hits the closest object
-            minDistance = figureHit.distance;
-            hit = figureHit;
+        HitRecord figureHit;
+        if (figure->closestHit(ray, figureHit, tMax)) {
+            // Only hits closer than the current one are returned
+            tMax = figureHit.distance;
+            record = figureHit;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool BVNode::occluded(const Ray &ray, float tMax) const {
+    // Check if ray doesn't hit box before tMax
+    HitRecord bboxHit;
+    if (!this->alwaysHits && !this->bbox->peek(ray, bboxHit, tMax)) {
+        return false;
+    }
+    for (auto const &figure : this->children) {
+        if (figure->occluded(ray, tMax)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BVNode::getBoundingBox(BBox &bbox) const {
+    bbox = BBox();
+    for (auto const &figure : this->children) {
+        BBox figureBox;
+        if (!figure->getBoundingBox(figureBox)) {
+            return false;
         }
+        bbox.extend(figureBox);
     }
-    return minDistance != std::numeric_limits<float>::max();
+    return true;
 }
 
 /// KdTreeNode ///
 
-bool KdTreeNode::peek(const Ray &ray, RayHit &hit) const {
-    return bbox->intersection(ray, hit);
+bool KdTreeNode::peek(const Ray &ray, HitRecord &record, float tMax) const {
+    return bbox->peek(ray, record, tMax);
+}
+
+bool KdTreeNode::occluded(const Ray &ray, float tMax) const {
+    // Any hit is enough, children check their own bboxes
+    return leftChild->occluded(ray, tMax) || rightChild->occluded(ray, tMax);
+}
+
+bool KdTreeNode::getBoundingBox(BBox &bbox) const {
+    BBox rightBox;
+    if (!leftChild->getBoundingBox(bbox) ||
+        !rightChild->getBoundingBox(rightBox)) {
+        return false;
+    }
+    bbox.extend(rightBox);
+    return true;
 }
 
-bool KdTreeNode::intersection(const Ray &ray, RayHit &hit) const {
+bool KdTreeNode::closestHit(const Ray &ray, HitRecord &record,
+                            float tMax) const {
     // Check if it only intersects with one box
-    RayHit firstPeek, secondPeek;
-    if (!leftChild->peek(ray, firstPeek)) {
-        return rightChild->intersection(ray, hit);
+    HitRecord firstPeek, secondPeek;
+    if (!leftChild->peek(ray, firstPeek, tMax)) {
+        return rightChild->closestHit(ray, record, tMax);
     }
-    if (!rightChild->peek(ray, secondPeek)) {
-        return leftChild->intersection(ray, hit);
+    if (!rightChild->peek(ray, secondPeek, tMax)) {
+        return leftChild->closestHit(ray, record, tMax);
     }
     // Determine order of intersections
     FigurePtr first = leftChild, second = rightChild;
@@ -309,22 +899,470 @@ bool KdTreeNode::intersection(const Ray &ray, RayHit &hit) const {
         std::swap(firstPeek, secondPeek);
     }
     // Intersect with boxes
-    if (!first->intersection(ray, hit)) {
+    if (!first->closestHit(ray, record, tMax)) {
         // Doesn't intersect with first box, return second
-        return second->intersection(ray, hit);
+        return second->closestHit(ray, record, tMax);
     } else {
-        // First intersection is saved in hit
+        // First intersection is saved in record
         // If first hit was closer that second peek,
         // we don't have to check the second child
-        RayHit secondHit;
-        if (secondPeek.distance < hit.distance &&
-            second->intersection(ray, secondHit) &&
-            secondHit.distance < hit.distance) {
+        HitRecord secondHit;
+        if (secondPeek.distance < record.distance &&
+            second->closestHit(ray, secondHit, record.distance)) {
             // Second hit was closer than first, should be replaced
-            std::swap(hit, secondHit);
+            record = secondHit;
         }
         return true;
     }
 }
 
+/// LinearBVH ///
+
+LinearBVH::LinearBVH(const FigurePtrVector &figures) {
+    // Split figures between the ones that can go inside the bvh or not
+    std::vector<BBox> bounds;
+    for (const FigurePtr &figure : figures) {
+        BBox bbox;
+        if (figure->getBoundingBox(bbox)) {
+            primitives.push_back(figure);
+            bounds.push_back(bbox);
+        } else {
+            unbounded.push_back(figure);
+        }
+    }
+    this->bvh = BVH(bounds);
+    this->bvh4 = BVH4(bvh);
+}
+
+bool LinearBVH::peek(const Ray &ray, HitRecord &record, float tMax) const {
+    if (!unbounded.empty()) {
+        return this->closestHit(ray, record, tMax);
+    }
+    BBox bbox = bvh.getBoundingBox();
+    return Box(bbox.bb0, bbox.bb1).peek(ray, record, tMax);
+}
+
+bool LinearBVH::getBoundingBox(BBox &bbox) const {
+    bbox = bvh.getBoundingBox();
+    return unbounded.empty();
+}
+
+bool LinearBVH::occluded(const Ray &ray, float tMax) const {
+    for (auto const &figure : this->unbounded) {
+        if (figure->occluded(ray, tMax)) {
+            return true;
+        }
+    }
+    return bvh4.occluded(ray.origin, ray.invDirection, tMax, [&](int i) {
+        return primitives[i]->occluded(ray, tMax);
+    });
+}
+
+bool LinearBVH::closestHit(const Ray &ray, HitRecord &record,
+                           float tMax) const {
+    // Only primitives in leaves closer than the current hit are checked,
+    // tMax is updated with every closer hit
+    bool found = bvh4.traverse(
+        ray.origin, ray.invDirection, tMax, [&](int i, float &tMax) {
+            HitRecord primitiveHit;
+            if (primitives[i]->closestHit(ray, primitiveHit, tMax)) {
+                tMax = primitiveHit.distance;
+                record = primitiveHit;
+                return true;
+            }
+            return false;
+        });
+    // Unbounded figures are checked one by one
+    for (auto const &figure : this->unbounded) {
+        HitRecord figureHit;
+        if (figure->closestHit(ray, figureHit, tMax)) {
+            tMax = figureHit.distance;
+            record = figureHit;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool LinearBVH::refit(float maxCostRatio) {
+    std::vector<BBox> bounds(primitives.size());
+    for (int i = 0; i < primitives.size(); i++) {
+        primitives[i]->getBoundingBox(bounds[i]);
+    }
+    bool rebuilt = bvh.refit(bounds, maxCostRatio);
+    this->bvh4 = BVH4(bvh);
+    return rebuilt;
+}
+
+int LinearBVH::closestHitPacket(const RayPacket &packet, int mask,
+                                HitRecord records[], float tMax[]) const {
+    if (!packet.coherent) {
+        // Rays go in different directions, trace them one by one
+        return Figure::closestHitPacket(packet, mask, records, tMax);
+    }
+    // Primitives are given the rays that hit their leaf, and only set the
+    // records of the rays they hit closer than the current ones
+    const std::vector<int> &indices = bvh4.getIndices();
+    int hits = bvh4.traversePacket(
+        packet, mask, tMax, [&](int first, int count, int mask, float tMax[]) {
+            int leafHits = 0;
+            for (int i = first; i < first + count; i++) {
+                if (indices[i] >= 0) {
+                    leafHits |= primitives[indices[i]]->closestHitPacket(
+                        packet, mask, records, tMax);
+                }
+            }
+            return leafHits;
+        });
+    for (auto const &figure : this->unbounded) {
+        hits |= figure->closestHitPacket(packet, mask, records, tMax);
+    }
+    return hits;
+}
+
+/// Grid ///
+
+const int Grid::MAX_RESOLUTION;  // std::min takes it by reference
+
+Grid::Grid(const FigurePtrVector &figures, bool twoLevel) {
+    std::vector<BBox> figureBounds;
+    for (const FigurePtr &figure : figures) {
+        BBox bbox;
+        if (figure->getBoundingBox(bbox)) {
+            primitives.push_back(figure);
+            figureBounds.push_back(bbox);
+            bounds.extend(bbox);
+        } else {
+            unbounded.push_back(figure);
+        }
+    }
+    this->build(figureBounds, twoLevel);
+}
+
+Grid::Grid(const FigurePtrVector &figures,
+           const std::vector<BBox> &figureBounds, const BBox &_bounds)
+    : primitives(figures), bounds(_bounds) {
+    this->build(figureBounds, false);
+}
+
+void Grid::build(const std::vector<BBox> &figureBounds, bool twoLevel) {
+    int numFigures = primitives.size();
+    // Cells are cubes (as far as possible) of the size that gives about
+    // GRID_DENSITY cells per figure, flat axes of the grid get only one
+    Vec4 size = bounds.diagonal();
+    float maxSize = 0.0f;
+    if (numFigures > 0) {
+        maxSize = std::max(size.x, std::max(size.y, size.z));
+    }
+    float measure = 1.0f;
+    int dimensions = 0;
+    for (int i = 0; i < 3; i++) {
+        if (size.raw[i] > maxSize * 1e-3f) {
+            measure *= size.raw[i];
+            dimensions++;
+        }
+    }
+    float cellsPerUnit =
+        dimensions == 0
+            ? 0.0f
+            : std::pow(GRID_DENSITY * numFigures / measure, 1.0f / dimensions);
+    for (int i = 0; i < 3; i++) {
+        // An empty box (no bounded figures) has size -inf, which would give
+        // NaN cells; clamp as a float, out of range values don't fit an int
+        int cells = 1;
+        if (size.raw[i] > 0.0f) {
+            cells = std::min((float)MAX_RESOLUTION,
+                             std::round(size.raw[i] * cellsPerUnit));
+        }
+        resolution[i] = std::max(1, std::min(MAX_RESOLUTION, cells));
+        cellSize[i] = maxSize > 0.0f ? size.raw[i] / resolution[i] : 0.0f;
+        invCellSize[i] = cellSize[i] > 0.0f ? 1.0f / cellSize[i] : 0.0f;
+    }
+
+    // Count the figures of every cell, then put them in their place
+    int numCells = this->numCells();
+    cellStart.assign(numCells + 1, 0);
+    auto forEachCell = [&](const BBox &bbox, std::function<void(int)> f) {
+        int lo[3], hi[3];
+        for (int i = 0; i < 3; i++) {
+            lo[i] = this->cellOf(i, bbox.bb0.raw[i]);
+            hi[i] = this->cellOf(i, bbox.bb1.raw[i]);
+        }
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    f(x + resolution[0] * (y + resolution[1] * z));
+                }
+            }
+        }
+    };
+    for (const BBox &bbox : figureBounds) {
+        forEachCell(bbox, [&](int cell) { cellStart[cell + 1]++; });
+    }
+    for (int cell = 0; cell < numCells; cell++) {
+        cellStart[cell + 1] += cellStart[cell];
+    }
+    std::vector<int> figureIndices(cellStart.back());
+    std::vector<int> filled(cellStart.begin(), cellStart.end() - 1);
+    for (int f = 0; f < numFigures; f++) {
+        forEachCell(figureBounds[f],
+                    [&](int cell) { figureIndices[filled[cell]++] = f; });
+    }
+
+    // Crowded cells get a grid with their figures, which is their only one
+    cellFigures.resize(figureIndices.size());
+    int references = 0;
+    for (int cell = 0; cell < numCells; cell++) {
+        int first = cellStart[cell], last = cellStart[cell + 1];
+        cellStart[cell] = references;
+        if (twoLevel && last - first > SUBGRID_MIN_FIGURES) {
+            FigurePtrVector figures;
+            std::vector<BBox> subBounds;
+            BBox used;
+            for (int i = first; i < last; i++) {
+                figures.push_back(primitives[figureIndices[i]]);
+                subBounds.push_back(figureBounds[figureIndices[i]]);
+                used.extend(subBounds.back());
+            }
+            // Its bounds are the cell's, a bit bigger so rays that are
+            // walked through the cell are never outside them by rounding
+            int position[3] = {cell % resolution[0],
+                               cell / resolution[0] % resolution[1],
+                               cell / resolution[0] / resolution[1]};
+            BBox cellBounds = used;
+            for (int i = 0; i < 3; i++) {
+                float margin = cellSize[i] * 1e-3f;
+                float lo = bounds.bb0.raw[i] + position[i] * cellSize[i];
+                float hi = lo + cellSize[i];
+                cellBounds.bb0.raw[i] = std::max(used.bb0.raw[i], lo - margin);
+                cellBounds.bb1.raw[i] = std::min(used.bb1.raw[i], hi + margin);
+            }
+            subgrids.push_back(
+                FigurePtr(new Grid(figures, subBounds, cellBounds)));
+            cellFigures[references++] = subgrids.back().get();
+            continue;
+        }
+        for (int i = first; i < last; i++) {
+            cellFigures[references++] = primitives[figureIndices[i]].get();
+        }
+    }
+    cellStart[numCells] = references;
+    cellFigures.resize(references);
+    cellFigures.shrink_to_fit();
+}
+
+template <typename F>
+void Grid::walk(const Ray &ray, const float &tMax, F fCell) const {
+    // Clip the ray to the grid's bounds
+    float tEntry = 0.0f, tExit = tMax;
+    for (int i = 0; i < 3; i++) {
+        float t1 = (bounds.bb0.raw[i] - ray.origin.raw[i]) *
+                   ray.invDirection.raw[i];
+        float t2 = (bounds.bb1.raw[i] - ray.origin.raw[i]) *
+                   ray.invDirection.raw[i];
+        float tNear = t1 < t2 ? t1 : t2, tFar = t1 < t2 ? t2 : t1;
+        // NaN (ray inside the slab plane) fails both comparisons
+        tEntry = tNear > tEntry ? tNear : tEntry;
+        tExit = tFar < tExit ? tFar : tExit;
+    }
+    if (tEntry > tExit || cellFigures.empty()) {
+        return;
+    }
+
+    // Cell where the ray enters, and distance to the next cell on each axis
+    int cell[3], step[3], end[3];
+    float tNext[3], tDelta[3];
+    for (int i = 0; i < 3; i++) {
+        float direction = ray.direction.raw[i];
+        cell[i] = this->cellOf(i, ray.origin.raw[i] + direction * tEntry);
+        if (direction > 0.0f) {
+            step[i] = 1;
+            end[i] = resolution[i];
+            float next = bounds.bb0.raw[i] + (cell[i] + 1) * cellSize[i];
+            tNext[i] = (next - ray.origin.raw[i]) * ray.invDirection.raw[i];
+            tDelta[i] = cellSize[i] * ray.invDirection.raw[i];
+        } else if (direction < 0.0f) {
+            step[i] = -1;
+            end[i] = -1;
+            float next = bounds.bb0.raw[i] + cell[i] * cellSize[i];
+            tNext[i] = (next - ray.origin.raw[i]) * ray.invDirection.raw[i];
+            tDelta[i] = -cellSize[i] * ray.invDirection.raw[i];
+        } else {
+            // Never leaves the cell on this axis
+            step[i] = 0;
+            end[i] = -1;
+            tNext[i] = std::numeric_limits<float>::max();
+            tDelta[i] = 0.0f;
+        }
+    }
+
+    while (true) {
+        int c = cell[0] + resolution[0] * (cell[1] + resolution[1] * cell[2]);
+        if (cellStart[c] < cellStart[c + 1] &&
+            fCell(cellStart[c], cellStart[c + 1])) {
+            return;
+        }
+        // Next cell is the closest one of the three axes
+        int axis = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2)
+                                       : (tNext[1] < tNext[2] ? 1 : 2);
+        if (tNext[axis] >= tMax) {
+            return;  // it starts after tMax (or after the closest hit)
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] == end[axis]) {
+            return;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+bool Grid::closestHit(const Ray &ray, HitRecord &record, float tMax) const {
+    // As tMax is updated with every hit, cells after it aren't walked
+    bool found = false;
+    this->walk(ray, tMax, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            HitRecord figureHit;
+            if (cellFigures[i]->closestHit(ray, figureHit, tMax)) {
+                tMax = figureHit.distance;
+                record = figureHit;
+                found = true;
+            }
+        }
+        return false;
+    });
+    for (auto const &figure : this->unbounded) {
+        HitRecord figureHit;
+        if (figure->closestHit(ray, figureHit, tMax)) {
+            tMax = figureHit.distance;
+            record = figureHit;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool Grid::occluded(const Ray &ray, float tMax) const {
+    for (auto const &figure : this->unbounded) {
+        if (figure->occluded(ray, tMax)) {
+            return true;
+        }
+    }
+    bool found = false;
+    this->walk(ray, tMax, [&](int first, int last) {
+        for (int i = first; i < last; i++) {
+            if (cellFigures[i]->occluded(ray, tMax)) {
+                found = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return found;
+}
+
+bool Grid::peek(const Ray &ray, HitRecord &record, float tMax) const {
+    if (!unbounded.empty()) {
+        return this->closestHit(ray, record, tMax);
+    }
+    return Box(bounds.bb0, bounds.bb1).peek(ray, record, tMax);
+}
+
+bool Grid::getBoundingBox(BBox &bbox) const {
+    bbox = bounds;
+    return unbounded.empty();
+}
+
+/// Instance ///
+
+Ray Instance::toObject(const Ray &ray, float &scale) const {
+    // Direction is normalized, distances are scaled back to world space
+    Vec4 direction = invTransform * ray.direction;
+    scale = direction.module();
+    return Ray(invTransform * ray.origin, direction * (1.0f / scale),
+               ray.medium, ray.distanceWithoutEvent);
+}
+
+bool Instance::occluded(const Ray &ray, float tMax) const {
+    float scale;
+    Ray objectRay = this->toObject(ray, scale);
+    return object->occluded(objectRay, tMax * scale);
+}
+
+bool Instance::closestHit(const Ray &ray, HitRecord &record,
+                          float tMax) const {
+    float scale;
+    Ray objectRay = this->toObject(ray, scale);
+    if (!object->closestHit(objectRay, record, tMax * scale)) {
+        return false;
+    }
+    // Back to world space
+    record.distance = record.distance / scale;
+    record.instance = this;
+    return true;
+}
+
+int Instance::closestHitPacket(const RayPacket &packet, int mask,
+                               HitRecord records[], float tMax[]) const {
+    if (!packet.coherent) {
+        return Figure::closestHitPacket(packet, mask, records, tMax);
+    }
+    // Same as closestHit for every ray, the affine transform keeps them
+    // close together (coherence is checked again in object space)
+    Ray objectRays[RayPacket::MAX_SIZE];
+    float scale[RayPacket::MAX_SIZE], objectTMax[RayPacket::MAX_SIZE];
+    for (int r = 0; r < packet.size; r++) {
+        if (mask & (1 << r)) {
+            objectRays[r] = this->toObject(packet.rays[r], scale[r]);
+            objectTMax[r] = tMax[r] * scale[r];
+        }
+    }
+    RayPacket objectPacket(objectRays, packet.size, mask);
+    int hits = object->closestHitPacket(objectPacket, mask, records,
+                                        objectTMax);
+    for (int r = 0; r < packet.size; r++) {
+        if (hits & (1 << r)) {
+            // Back to world space
+            records[r].distance = records[r].distance / scale[r];
+            records[r].instance = this;
+            tMax[r] = records[r].distance;
+        }
+    }
+    return hits;
+}
+
+void Instance::finalize(const Ray &ray, const HitRecord &record,
+                        RayHit &hit) const {
+    // Finalize primitive's hit in object space
+    float scale;
+    Ray objectRay = this->toObject(ray, scale);
+    HitRecord objectRecord = record;
+    objectRecord.distance = record.distance * scale;
+    record.figure->finalize(objectRay, objectRecord, hit);
+    // Back to world space
+    hit.distance = record.distance;
+    hit.point = ray.project(hit.distance);
+    hit.normal = normalTransform * hit.normal;
+    hit.normal.w = 0.0f;
+    hit.normal = hit.normal.normalize();
+    if (material != nullptr) {
+        hit.material = material;
+    }
+}
+
+bool Instance::getBoundingBox(BBox &bbox) const {
+    BBox objectBox;
+    if (!object->getBoundingBox(objectBox)) {
+        return false;
+    }
+    // Transform all 8 corners of the object's box
+    bbox = BBox();
+    for (int i = 0; i < 8; i++) {
+        Vec4 corner(i & 1 ? objectBox.bb1.x : objectBox.bb0.x,
+                    i & 2 ? objectBox.bb1.y : objectBox.bb0.y,
+                    i & 4 ? objectBox.bb1.z : objectBox.bb0.z, 1.0f);
+        bbox.extend(transform * corner);
+    }
+    return true;
+}
+
 }  // namespace Figures
@@ -12,13 +12,21 @@ typedef std::shared_ptr<Figures::TexturedPlane> FigurePortalPtr;
 typedef std::vector<FigurePtr> FigurePtrVector;
 
 #include <cmath>
+#include <functional>
 #include <limits>
 #include "camera/ray.h"
 #include "camera/rayhit.h"
+#include "camera/raypacket.h"
+#include "io/mappedfile.h"
 #include "io/plymodel.h"
+#include "math/bbox.h"
 #include "math/geometry.h"
 #include "math/random.h"
 #include "math/rgbcolor.h"
+#include "scene/bvh.h"
+#include "scene/bvh4.h"
+#include "scene/kdtree.h"
+#include "scene/lazybvh.h"
 #include "scene/material.h"
 #include "scene/uvmaterial.h"
 
@@ -27,21 +35,52 @@ namespace Figures {
 // Basic figure, doesn't represent any geometric objects
 class Figure {
    public:
-    // Has to be able to intersect with a ray
-    virtual bool intersection(const Ray &ray, RayHit &hit) const = 0;
+    // Intersection is done in two phases:
+    // - closestHit: has to be able to intersect with a ray, only hits
+    //   closer than tMax are returned, saving the minimum information
+    //   needed to identify them (distance, primitive, etc.)
+    // - finalize: calculates the full hit information (point, normal,
+    //   material, etc.) of the primitive's record, once per ray
+    virtual bool closestHit(const Ray &ray, HitRecord &record,
+                            float tMax) const = 0;
+    virtual void finalize(const Ray &ray, const HitRecord &record,
+                          RayHit &hit) const {
+        throw std::domain_error("Finalize isn't implemented for this figure");
+    }
+    // Both phases together
+    bool intersection(const Ray &ray, RayHit &hit, float tMax) const;
+    inline bool intersection(const Ray &ray, RayHit &hit) const {
+        return this->intersection(ray, hit, std::numeric_limits<float>::max());
+    }
+    // Same as closestHit for the rays of the packet in mask, each one with
+    // its own tMax (updated with every closer hit). Records are only set
+    // for the rays that hit, returns a mask with them
+    // By default, rays are intersected one by one
+    virtual int closestHitPacket(const RayPacket &packet, int mask,
+                                 HitRecord records[], float tMax[]) const;
+    // Both phases together for all the rays of the packet, returns a mask
+    // with the rays that hit (only their hits are set)
+    int intersection(const RayPacket &packet, RayHit hits[]) const;
     // Check hit distance with bounding box (if the figure doesn't have
-    // a bounding box, unlike KdTreeNode, it defaults to intersection)
-    virtual bool peek(const Ray &ray, RayHit &hit) const {
-        return this->intersection(ray, hit);
+    // a bounding box, unlike KdTreeNode, it defaults to closestHit)
+    // The box is hit if it overlaps [0, tMax), distance is 0 from inside
+    virtual bool peek(const Ray &ray, HitRecord &record, float tMax) const {
+        return this->closestHit(ray, record, tMax);
     }
+    // Check if the ray hits the figure closer than tMax (any hit, used for
+    // shadow rays), groups of figures override it to stop at the first one
+    virtual bool occluded(const Ray &ray, float tMax) const;
+    // Axis-aligned bounding box of the figure, returns false if the
+    // figure is unbounded (it can't be put inside a bounding volume)
+    virtual bool getBoundingBox(BBox &bbox) const { return false; }
 
     // Random point chosen in the figure's area
-    virtual Vec4 randomPoint() const {
+    virtual Vec4 randomPoint(Sampler &sampler) const {
         throw std::domain_error(
             "Random point isn't implemented for this figure");
     }
     // Random direction for a given point in the figure
-    virtual Vec4 randomDirection(const Vec4 &point) const {
+    virtual Vec4 randomDirection(const Vec4 &point, Sampler &sampler) const {
         throw std::domain_error(
             "Random direction isn't implemented for this figure");
     }
@@ -66,7 +105,10 @@ class Plane : public Figure {
         : normal(_normal), distToOrigin(_distToOrigin) {}
 
    public:
-    bool intersection(const Ray &ray, RayHit &hit) const override;
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    void finalize(const Ray &ray, const HitRecord &record,
+                  RayHit &hit) const override;
     virtual bool getMaterial(const Vec4 &hitPoint,
                              MaterialPtr &materialPtr) const = 0;
 };
@@ -118,8 +160,8 @@ class TexturedPlane : public Plane {
                        const Vec4 &_uvX, const Vec4 &_uvY);
 
     // Point & direction sampling
-    Vec4 randomPoint() const override;
-    Vec4 randomDirection(const Vec4 &point) const override;
+    Vec4 randomPoint(Sampler &sampler) const override;
+    Vec4 randomDirection(const Vec4 &point, Sampler &sampler) const override;
     float getTotalArea() const override;
 
     void print(std::ostream &os, const std::string &padding) const override {
@@ -138,11 +180,19 @@ class Sphere : public Figure {
    public:
     Sphere(const MaterialPtr _material, const Vec4 &_center, float _radius)
         : material(_material), center(_center), radius(_radius) {}
-    bool intersection(const Ray &ray, RayHit &hit) const override;
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    void finalize(const Ray &ray, const HitRecord &record,
+                  RayHit &hit) const override;
+    bool getBoundingBox(BBox &bbox) const override {
+        Vec4 r(radius, radius, radius, 0.0f);
+        bbox = BBox(center - r, center + r);
+        return true;
+    }
 
     // Point & direction sampling
-    Vec4 randomPoint() const override;
-    Vec4 randomDirection(const Vec4 &point) const override;
+    Vec4 randomPoint(Sampler &sampler) const override;
+    Vec4 randomDirection(const Vec4 &point, Sampler &sampler) const override;
     float getTotalArea() const override;
 
     void print(std::ostream &os, const std::string &padding) const override {
@@ -159,13 +209,19 @@ class Triangle : public Figure {
     const Vec4 edge0, edge1, normal;
     const PLYModel *model;
 
-    // barycentric coordinates of p inside triangle v0-v1-v2
-    // see implementation for more details
-    Vec4 getBarycentric(const Vec4 &p) const;
-
    public:
     Triangle(const PLYModel *_model, int _v0i, int _v1i, int _v2i);
-    bool intersection(const Ray &ray, RayHit &hit) const override;
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    void finalize(const Ray &ray, const HitRecord &record,
+                  RayHit &hit) const override;
+    bool getBoundingBox(BBox &bbox) const override {
+        bbox = BBox();
+        bbox.extend(v0);
+        bbox.extend(v1);
+        bbox.extend(v2);
+        return true;
+    }
 
     void print(std::ostream &os, const std::string &padding) const override {
         os << padding << "| Triangle | v0: " << this->v0 << ", v1: " << this->v1
@@ -173,6 +229,154 @@ class Triangle : public Figure {
     }
 };
 
+/// Mesh ///
+
+// Triangle mesh stored as a structure of arrays: vertices, UV coordinates
+// and faces are saved only once (no Triangle figures, no shared pointers)
+// and intersected directly from these arrays, using a BVH over its faces
+// (or a k-d tree, to compare both acceleration structures)
+class Mesh : public Figure {
+    std::vector<float> vx, vy, vz;    // vertex positions
+    std::vector<float> uvx, uvy;      // vertex texture coordinates
+    std::vector<int> f0, f1, f2;      // vertex indices of each face
+    const UVMaterialPtr uvMaterial;
+    // Extra face references allowed for spatial splits, 0 if not used
+    float maxDuplication;
+    BVH bvh;    // binary tree, kept to refit it
+    BVH4 bvh4;  // same tree collapsed to 4-wide nodes, used to traverse
+    // bvh4 has compressed nodes, and bvh is freed once it's been built
+    // (then the mesh can't be refit, its tree is always built again)
+    bool compressTree;
+    // Used instead of both BVHs if useKdTree
+    bool useKdTree;
+    KdTree kdtree;
+    // Used instead of all of them if lazyTree, it's built while it's
+    // traversed (faces are intersected one by one, there are no packets)
+    bool lazyTree;
+    LazyBVH lazyBvh;
+
+    // Faces of the tree's leaves (bvh4 or kdtree), packed in groups of 4 in
+    // the same order as its indices, so a ray is intersected against 4
+    // faces at once
+    // Compressed trees don't store them (they'd take 40 bytes per face,
+    // several times the tree), their leaves are packed when they're
+    // reached instead (see getPacket)
+    static const int PACKET_SIZE = 4;
+    struct FacePacket {
+        float v0[3][4];     // first vertex (axis, face)
+        float edge0[3][4];  // second vertex - first vertex
+        float edge1[3][4];  // third vertex - first vertex
+        int face[4];        // face index, -1 for padding
+    };
+    std::vector<FacePacket> packets;
+
+    inline Vec4 vertex(int i) const {
+        return Vec4(vx[i], vy[i], vz[i], 1.0f);
+    }
+    // Ray-face intersection closer than tMax, returning its distance (t)
+    // and barycentric coordinates of the face's 2nd and 3rd vertices (u, v)
+    bool hitFace(int face, const Ray &ray, float tMax, float &t, float &u,
+                 float &v) const;
+    // Pack the faces of indices[p * PACKET_SIZE...] in packet
+    void packFaces(const std::vector<int> &indices, int p,
+                   FacePacket &packet) const;
+    // Packet p of the leaves, packed in gathered if it isn't stored
+    inline const FacePacket &getPacket(int p, FacePacket &gathered) const {
+        if (!compressTree || useKdTree) {
+            return packets[p];
+        }
+        this->packFaces(bvh4.getIndices(), p, gathered);
+        return gathered;
+    }
+    // Same as hitFace for the 4 faces of a packet, returns a mask with the
+    // faces hit (bit i for face i), t, u and v are only valid for those
+    int hitPacket(const FacePacket &packet, const Ray &ray, float tMax,
+                  float t[4], float u[4], float v[4]) const;
+    // Bounding box of each face, to build the tree
+    std::vector<BBox> faceBounds() const;
+    // Whether the arrays read from a file have the same size and the faces'
+    // vertices are in range (see load, the trees check their own indices)
+    bool isValid() const;
+    // Whether the packets read from a file are the tree's leaves' faces
+    bool validPackets() const;
+    // Build the tree, with spatial splits if maxDuplication > 0
+    void buildTree();
+    // Collapse the tree into bvh4 (if it's a BVH) and pack its leaves' faces
+    // (unless the tree is compressed)
+    void buildPackets();
+    // Empty mesh, to be read from a file (see load)
+    Mesh(const UVMaterialPtr &_uvMaterial)
+        : uvMaterial(_uvMaterial),
+          maxDuplication(0.0f),
+          compressTree(false),
+          useKdTree(false),
+          lazyTree(false) {}
+
+   public:
+    // uvs can be empty if the mesh doesn't have texture coordinates
+    // If maxDuplication > 0 its tree is built with spatial splits, with up
+    // to that ratio of extra references to faces (see BVH's SBVH builder)
+    // If useKdTree, a k-d tree is built instead (maxDuplication is ignored,
+    // k-d trees always reference faces from every leaf they overlap)
+    // If compressTree, the BVH takes about 8 times less memory (see
+    // BVH4::CompressedNode, its leaves' faces aren't packed in advance
+    // either), but traversing it is slower
+    // If lazyTree, only the root of the BVH is built, the rest of it is
+    // built as rays reach it (see LazyBVH), other settings are ignored
+    Mesh(const std::vector<Vec4> &verts,
+         const std::vector<std::array<int, 3>> &faces,
+         const std::vector<std::array<float, 2>> &uvs,
+         const UVMaterialPtr &_uvMaterial, float _maxDuplication = 0.0f,
+         bool _useKdTree = false, bool _compressTree = false,
+         bool _lazyTree = false);
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    int closestHitPacket(const RayPacket &packet, int mask,
+                         HitRecord records[], float tMax[]) const override;
+    void finalize(const Ray &ray, const HitRecord &record,
+                  RayHit &hit) const override;
+    bool occluded(const Ray &ray, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override {
+        bbox = lazyTree    ? lazyBvh.getBoundingBox()
+               : useKdTree ? kdtree.getBoundingBox()
+                           : bvh4.getBoundingBox();
+        return true;
+    }
+
+    inline int nfaces() const { return f0.size(); }
+    // SAH cost of the faces' hierarchy (0 if it's built lazily, it isn't
+    // known until the whole tree has been built)
+    inline float getCost() const {
+        return lazyTree ? 0.0f : useKdTree ? kdtree.getCost() : bvh4.getCost();
+    }
+
+    // Move the vertices of the mesh (e.g. animations), verts must have the
+    // same size as the original ones. Its tree is refit instead of built
+    // again, unless its SAH cost grows too much (see BVH::refit)
+    // k-d trees, compressed trees and lazy ones can't be refit, they're
+    // always built again
+    // Returns true if the tree has been built again
+    bool setVertices(const std::vector<Vec4> &verts,
+                     float maxCostRatio = 0.0f);
+
+    // Write the mesh and its trees to a file, so it can be loaded later
+    // instead of built again (see PLYModel::getFigure)
+    void save(BinaryWriter &file) const;
+    // Read a mesh written by save, returns nullptr if the file is invalid
+    // or its trees were built with other settings
+    static std::shared_ptr<Mesh> load(MappedFile &file,
+                                      const UVMaterialPtr &uvMaterial);
+
+    void print(std::ostream &os, const std::string &padding) const override {
+        os << padding << "| Mesh | triangles: " << this->nfaces()
+           << ", nodes: "
+           << (lazyTree    ? lazyBvh.getNumNodes()
+               : useKdTree ? kdtree.numNodes()
+                           : bvh4.numNodes())
+           << std::endl;
+    }
+};
+
 /// Box ///
 
 // Only Axis-Aligned Bounding Boxes (AABB), doesn't support Oriented ones, see:
@@ -183,7 +387,15 @@ class Box : public Figure {
 
    public:
     Box(const Vec4 &_bb0, const Vec4 &_bb1) : bb0(_bb0), bb1(_bb1) {}
-    bool intersection(const Ray &ray, RayHit &hit) const override;
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    void finalize(const Ray &ray, const HitRecord &record,
+                  RayHit &hit) const override;
+    bool peek(const Ray &ray, HitRecord &record, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override {
+        bbox = BBox(bb0, bb1);
+        return true;
+    }
 
     void print(std::ostream &os, const std::string &padding) const override {
         os << padding << "| Box | bb0: " << this->bb0 << ", bb1: " << this->bb1
@@ -206,8 +418,11 @@ class BVNode : public Figure {
         : alwaysHits(true), bbox(nullptr), children(_children) {}
     BVNode(const FigurePtrVector &_children, const FigurePtr &_bbox)
         : alwaysHits(false), bbox(_bbox), children(_children) {}
-    bool intersection(const Ray &ray, RayHit &hit) const override;
-    bool peek(const Ray &ray, RayHit &hit) const override;
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    bool peek(const Ray &ray, HitRecord &record, float tMax) const override;
+    bool occluded(const Ray &ray, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override;
 
     void print(std::ostream &os, const std::string &padding) const override {
         os << padding << "| BVNode |" << std::endl;
@@ -229,8 +444,11 @@ class KdTreeNode : public Figure {
     KdTreeNode(const FigurePtr &_leftChild, const FigurePtr &_rightChild,
                const FigurePtr &_bbox)
         : bbox(_bbox), leftChild(_leftChild), rightChild(_rightChild) {}
-    bool intersection(const Ray &ray, RayHit &hit) const override;
-    bool peek(const Ray &ray, RayHit &hit) const override;
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    bool peek(const Ray &ray, HitRecord &record, float tMax) const override;
+    bool occluded(const Ray &ray, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override;
 
     void print(std::ostream &os, const std::string &padding) const override {
         os << padding << "| KdTreeNode |" << std::endl;
@@ -242,4 +460,166 @@ class KdTreeNode : public Figure {
     }
 };
 
+/// LinearBVH ///
+
+// Bounding volume hierarchy over a set of figures, stored as a flat array
+// of nodes (see BVH) instead of a tree of BVNode/KdTreeNode figures
+// Unbounded figures (e.g. infinite planes) can't be inside the hierarchy,
+// they are kept apart and always checked after it
+class LinearBVH : public Figure {
+    FigurePtrVector primitives;  // bounded figures, referenced by the bvh
+    FigurePtrVector unbounded;   // figures without bounding box
+    BVH bvh;                     // binary tree, for its cost and bounds
+    BVH4 bvh4;                   // same tree with 4-wide nodes, traversed
+
+   public:
+    LinearBVH(const FigurePtrVector &figures);
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    int closestHitPacket(const RayPacket &packet, int mask,
+                         HitRecord records[], float tMax[]) const override;
+    bool peek(const Ray &ray, HitRecord &record, float tMax) const override;
+    bool occluded(const Ray &ray, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override;
+
+    // Update the hierarchy after some of its figures have moved (as in
+    // BVH::refit), returns true if it has been built again
+    bool refit(float maxCostRatio = 0.0f);
+
+    // SAH cost of the hierarchy
+    inline float getCost() const { return bvh.getCost(); }
+
+    void print(std::ostream &os, const std::string &padding) const override {
+        BBox bbox = bvh.getBoundingBox();
+        os << padding << "| LinearBVH | bb0: " << bbox.bb0
+           << ", bb1: " << bbox.bb1 << ", nodes: " << bvh.numNodes()
+           << std::endl;
+        os << padding << "> Children:" << std::endl;
+        for (const FigurePtr &f : primitives) {
+            f->print(os, padding + " ");
+        }
+        os << padding << "> Unbounded:" << std::endl;
+        for (const FigurePtr &f : unbounded) {
+            f->print(os, padding + " ");
+        }
+    }
+};
+
+/// Grid ///
+
+// Uniform grid over a set of figures, traversed with a 3D-DDA: the ray
+// walks the cells it goes through front to back, stopping at the first
+// cell with a hit before its exit. Faster than a tree in scenes with many
+// figures of similar size and evenly spread (e.g. fields of spheres), as
+// cells never overlap. Figures are referenced by every cell their bounding
+// box overlaps, and unbounded ones are kept apart (as in LinearBVH), see:
+// http://www.cse.yorku.ca/~amana/research/grid.pdf
+// The resolution is chosen from the number of figures and the shape of
+// their bounds. In a two-level grid, crowded cells get their own grid
+class Grid : public Figure {
+    // Resolution: about GRID_DENSITY cells per figure, and never more than
+    // MAX_RESOLUTION cells on an axis
+    static constexpr float GRID_DENSITY = 4.0f;
+    static const int MAX_RESOLUTION = 128;
+    // In two-level grids, cells with more figures than this get a grid
+    static const int SUBGRID_MIN_FIGURES = 16;
+
+    FigurePtrVector primitives;  // bounded figures
+    FigurePtrVector unbounded;   // figures without bounding box
+    FigurePtrVector subgrids;    // grids of crowded cells (two-level grid)
+    BBox bounds;
+    int resolution[3];
+    float cellSize[3], invCellSize[3];
+    // Figures of cell c are cellFigures[cellStart[c], cellStart[c + 1])
+    // (cells in x, then y, then z order), owned by primitives or subgrids
+    std::vector<int> cellStart;
+    std::vector<const Figure *> cellFigures;
+
+    // One-level grid over figures (all bounded) clipped to bounds
+    Grid(const FigurePtrVector &figures, const std::vector<BBox> &figureBounds,
+         const BBox &_bounds);
+    // Sets the resolution and fills the cells, given primitives' bounds
+    void build(const std::vector<BBox> &figureBounds, bool twoLevel);
+    // Cell that has the point on axis, clamped to the grid
+    inline int cellOf(int axis, float position) const {
+        int cell = (position - bounds.bb0.raw[axis]) * invCellSize[axis];
+        return cell < 0 ? 0 : cell >= resolution[axis]
+                                  ? resolution[axis] - 1
+                                  : cell;
+    }
+    // Walks the cells the ray goes through front to back, calling
+    // fCell(first, last) with the range of cellFigures of each one until
+    // it returns true, or the next cell starts after tMax (it can change
+    // during the walk, e.g. with every closer hit)
+    template <typename F>
+    void walk(const Ray &ray, const float &tMax, F fCell) const;
+
+   public:
+    Grid(const FigurePtrVector &figures, bool twoLevel = false);
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    bool peek(const Ray &ray, HitRecord &record, float tMax) const override;
+    bool occluded(const Ray &ray, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override;
+
+    // Number of cells (of this level) and references to figures in them
+    inline int numCells() const {
+        return resolution[0] * resolution[1] * resolution[2];
+    }
+    inline int numReferences() const { return cellFigures.size(); }
+
+    void print(std::ostream &os, const std::string &padding) const override {
+        os << padding << "| Grid | bb0: " << bounds.bb0
+           << ", bb1: " << bounds.bb1 << ", cells: " << resolution[0] << "x"
+           << resolution[1] << "x" << resolution[2] << std::endl;
+        os << padding << "> Children:" << std::endl;
+        for (const FigurePtr &f : primitives) {
+            f->print(os, padding + " ");
+        }
+        os << padding << "> Unbounded:" << std::endl;
+        for (const FigurePtr &f : unbounded) {
+            f->print(os, padding + " ");
+        }
+        os << padding << "> Subgrids: " << subgrids.size() << std::endl;
+    }
+};
+
+/// Instance ///
+
+// Transformed copy of a figure (usually a PLY model's LinearBVH) that
+// shares its geometry: rays are moved to the figure's object space instead
+// of transforming and duplicating all of its triangles and nodes
+// The figure can't contain other instances (only one level is supported)
+class Instance : public Figure {
+    const FigurePtr object;
+    // object to world transform, its inverse and the normals' transform
+    const Mat4 transform, invTransform, normalTransform;
+    const MaterialPtr material;  // replaces object's one, if not null
+
+    // Ray in object space, scale converts world distances to object ones
+    Ray toObject(const Ray &ray, float &scale) const;
+
+   public:
+    Instance(const FigurePtr &_object, const Mat4 &_transform,
+             const MaterialPtr &_material = nullptr)
+        : object(_object),
+          transform(_transform),
+          invTransform(_transform.inverse()),
+          normalTransform(_transform.inverse().transpose()),
+          material(_material) {}
+    bool closestHit(const Ray &ray, HitRecord &record,
+                    float tMax) const override;
+    int closestHitPacket(const RayPacket &packet, int mask,
+                         HitRecord records[], float tMax[]) const override;
+    void finalize(const Ray &ray, const HitRecord &record,
+                  RayHit &hit) const override;
+    bool occluded(const Ray &ray, float tMax) const override;
+    bool getBoundingBox(BBox &bbox) const override;
+
+    void print(std::ostream &os, const std::string &padding) const override {
+        os << padding << "| Instance |" << std::endl;
+        object->print(os, padding + " ");
+    }
+};
+
 }  // namespace Figures
\ No newline at end of file
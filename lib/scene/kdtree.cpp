@@ -0,0 +1,311 @@
+#include "kdtree.h"
+
+const int KdTree::MAX_DEPTH;  // std::min takes it by reference
+
+KdTree::KdTree(const std::vector<BBox> &primitiveBounds, int _groupSize)
+    : groupSize(_groupSize), cost(0.0f) {
+    if (primitiveBounds.empty()) {
+        return;
+    }
+    std::vector<int> primitives(primitiveBounds.size());
+    for (int i = 0; i < primitiveBounds.size(); i++) {
+        primitives[i] = i;
+        bounds.extend(primitiveBounds[i]);
+    }
+    int maxDepth = std::min(
+        MAX_DEPTH,
+        (int)(8.0f + 1.3f * std::log2((float)primitiveBounds.size())));
+    int threads = ThreadPool::global().size();
+    Subtree tree;
+    this->cost = this->buildNode(primitiveBounds, primitives, bounds,
+                                 maxDepth, threads, tree);
+    nodes = std::move(tree.nodes);
+    leaves = std::move(tree.leaves);
+    indices = std::move(tree.indices);
+    int ropes[6] = {-1, -1, -1, -1, -1, -1};
+    this->buildRopes(0, ropes, bounds);
+}
+
+void KdTree::Subtree::append(const Subtree &other) {
+    int nodeBase = nodes.size(), leafBase = leaves.size();
+    int indexBase = indices.size();
+    for (Node node : other.nodes) {
+        node.data += (node.leaf() ? leafBase : nodeBase) << 2;
+        nodes.push_back(node);
+    }
+    for (Leaf leaf : other.leaves) {
+        leaf.offset += indexBase;
+        leaves.push_back(leaf);
+    }
+    indices.insert(indices.end(), other.indices.begin(), other.indices.end());
+}
+
+void KdTree::save(BinaryWriter &file) const {
+    file.write((float)TRAVERSAL_COST);
+    file.write((float)INTERSECTION_COST);
+    file.write((float)EMPTY_BONUS);
+    file.write(groupSize);
+    file.write(cost);
+    file.write(bounds);
+    file.write(nodes);
+    file.write(leaves);
+    file.write(indices);
+}
+
+bool KdTree::load(MappedFile &file, int numPrimitives) {
+    float traversalCost, intersectionCost, emptyBonus;
+    KdTree tree;
+    if (!file.read(traversalCost) || !file.read(intersectionCost) ||
+        !file.read(emptyBonus) || !file.read(tree.groupSize) ||
+        !file.read(tree.cost) || !file.read(tree.bounds) ||
+        !file.read(tree.nodes) || !file.read(tree.leaves) ||
+        !file.read(tree.indices)) {
+        return false;
+    }
+    if (traversalCost != TRAVERSAL_COST ||
+        intersectionCost != INTERSECTION_COST || emptyBonus != EMPTY_BONUS ||
+        !tree.isValid(numPrimitives)) {
+        return false;
+    }
+    *this = std::move(tree);
+    return true;
+}
+
+bool KdTree::isValid(int numPrimitives) const {
+    if (groupSize < 1) {
+        return false;
+    }
+    for (int primitive : indices) {
+        if (primitive < -1 || primitive >= numPrimitives) {
+            return false;
+        }
+    }
+    int numNodes = nodes.size(), numLeaves = leaves.size();
+    int numIndices = indices.size();
+    for (int i = 0; i < numNodes; i++) {
+        const Node &node = nodes[i];
+        if (node.leaf() ? node.index() < 0 || node.index() >= numLeaves
+                        : node.index() <= i + 1 || node.index() >= numNodes) {
+            return false;
+        }
+    }
+    for (const Leaf &leaf : leaves) {
+        for (int rope : leaf.ropes) {
+            if (rope < -1 || rope >= numNodes) {
+                return false;
+            }
+        }
+        if (leaf.count < 0 ||
+            (leaf.count > 0 &&
+             (leaf.offset < 0 || leaf.offset % groupSize != 0 ||
+              leaf.count % groupSize != 0 ||
+              leaf.offset > numIndices - leaf.count))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+float KdTree::splitCost(const BBox &cell, int axis, float position,
+                        int numLeft, int numRight) const {
+    if (position <= cell.bb0.raw[axis] || position >= cell.bb1.raw[axis]) {
+        return std::numeric_limits<float>::max();
+    }
+    BBox left = cell, right = cell;
+    left.bb1.raw[axis] = position;
+    right.bb0.raw[axis] = position;
+    float cost =
+        TRAVERSAL_COST +
+        INTERSECTION_COST *
+            (left.surfaceArea() * this->groups(numLeft) +
+             right.surfaceArea() * this->groups(numRight)) /
+            cell.surfaceArea();
+    // Cutting off empty space is cheap (rays go through it without tests)
+    return numLeft == 0 || numRight == 0 ? cost * EMPTY_BONUS : cost;
+}
+
+float KdTree::buildNode(const std::vector<BBox> &primitiveBounds,
+                        std::vector<int> &primitives, const BBox &cell,
+                        int depthLeft, int threads, Subtree &out) {
+    int numPrimitives = primitives.size();
+    // Cost of not splitting the node (intersect with all of its primitives)
+    float leafCost = this->groups(numPrimitives) * INTERSECTION_COST;
+
+    // Sweep all the planes where a primitive's bounds (clipped to the cell)
+    // start or end, on all axes. At the same position, primitives that end
+    // are counted before flat ones, and those before the ones that start
+    int bestAxis = -1;
+    float bestPosition = 0.0f, bestCost = leafCost;
+    bool planarLeft = false;  // flat primitives on the plane go left
+    if (depthLeft > 0 && numPrimitives > 0 && cell.surfaceArea() > 0.0f) {
+        const int END = 0, PLANAR = 1, START = 2;
+        struct Event {
+            float position;
+            int type;
+        };
+        std::vector<Event> events;
+        events.reserve(2 * numPrimitives);
+        for (int axis = 0; axis < 3; axis++) {
+            events.clear();
+            for (int p : primitives) {
+                BBox clipped = primitiveBounds[p].intersection(cell);
+                float lo = clipped.bb0.raw[axis], hi = clipped.bb1.raw[axis];
+                if (lo == hi) {
+                    events.push_back({lo, PLANAR});
+                } else {
+                    events.push_back({lo, START});
+                    events.push_back({hi, END});
+                }
+            }
+            std::sort(events.begin(), events.end(),
+                      [](const Event &lhs, const Event &rhs) {
+                          return lhs.position < rhs.position ||
+                                 (lhs.position == rhs.position &&
+                                  lhs.type < rhs.type);
+                      });
+            int numLeft = 0, numRight = numPrimitives;
+            for (int i = 0; i < events.size();) {
+                float position = events[i].position;
+                int count[3] = {0, 0, 0};
+                for (; i < events.size() && events[i].position == position;
+                     i++) {
+                    count[events[i].type]++;
+                }
+                numRight -= count[END] + count[PLANAR];
+                // Flat primitives on the plane go to the cheapest side
+                float leftCost =
+                    this->splitCost(cell, axis, position,
+                                    numLeft + count[PLANAR], numRight);
+                float rightCost =
+                    this->splitCost(cell, axis, position, numLeft,
+                                    numRight + count[PLANAR]);
+                if (std::min(leftCost, rightCost) < bestCost) {
+                    bestAxis = axis;
+                    bestPosition = position;
+                    bestCost = std::min(leftCost, rightCost);
+                    planarLeft = leftCost <= rightCost;
+                }
+                numLeft += count[START] + count[PLANAR];
+            }
+        }
+    }
+
+    int nodeIndex = out.nodes.size();
+    out.nodes.push_back(Node());
+    if (bestAxis == -1) {
+        // Leaf with all primitives, padded to a multiple of groupSize
+        Leaf leaf;
+        for (int i = 0; i < 3; i++) {
+            leaf.bb0[i] = cell.bb0.raw[i];
+            leaf.bb1[i] = cell.bb1.raw[i];
+        }
+        int count = this->groups(numPrimitives) * groupSize;
+        leaf.offset = out.indices.size();
+        leaf.count = count;
+        for (int i = 0; i < count; i++) {
+            out.indices.push_back(i < numPrimitives ? primitives[i] : -1);
+        }
+        out.nodes[nodeIndex].split = 0.0f;
+        out.nodes[nodeIndex].data = (out.leaves.size() << 2) | 3;
+        out.leaves.push_back(leaf);
+        return leafCost;
+    }
+
+    // Primitives that cross the plane go to both sides
+    std::vector<int> left, right;
+    for (int p : primitives) {
+        BBox clipped = primitiveBounds[p].intersection(cell);
+        float lo = clipped.bb0.raw[bestAxis], hi = clipped.bb1.raw[bestAxis];
+        if (lo == bestPosition && hi == bestPosition) {
+            (planarLeft ? left : right).push_back(p);
+            continue;
+        }
+        if (lo < bestPosition) {
+            left.push_back(p);
+        }
+        if (hi > bestPosition) {
+            right.push_back(p);
+        }
+    }
+    std::vector<int>().swap(primitives);
+    BBox leftCell = cell, rightCell = cell;
+    leftCell.bb1.raw[bestAxis] = bestPosition;
+    rightCell.bb0.raw[bestAxis] = bestPosition;
+
+    // First child goes right after this node, second one after the subtree
+    float leftCost, rightCost;
+    int rightIndex;
+    if (threads > 1 &&
+        std::min(left.size(), right.size()) >=
+            (size_t)PARALLEL_MIN_PRIMITIVES) {
+        Subtree leftTree, rightTree;
+        int leftThreads = threads / 2;
+        std::future<float> leftBuild = ThreadPool::global().submit([&]() {
+            return this->buildNode(primitiveBounds, left, leftCell,
+                                   depthLeft - 1, leftThreads, leftTree);
+        });
+        rightCost =
+            this->buildNode(primitiveBounds, right, rightCell, depthLeft - 1,
+                            threads - leftThreads, rightTree);
+        leftCost = ThreadPool::global().wait(leftBuild);
+        out.append(leftTree);
+        rightIndex = out.nodes.size();
+        out.append(rightTree);
+    } else {
+        leftCost = this->buildNode(primitiveBounds, left, leftCell,
+                                   depthLeft - 1, threads, out);
+        rightIndex = out.nodes.size();
+        rightCost = this->buildNode(primitiveBounds, right, rightCell,
+                                    depthLeft - 1, threads, out);
+    }
+    out.nodes[nodeIndex].split = bestPosition;
+    out.nodes[nodeIndex].data = (rightIndex << 2) | bestAxis;
+
+    return TRAVERSAL_COST + (leftCell.surfaceArea() * leftCost +
+                             rightCell.surfaceArea() * rightCost) /
+                                cell.surfaceArea();
+}
+
+void KdTree::buildRopes(int node, const int ropes[6], const BBox &cell) {
+    if (nodes[node].leaf()) {
+        Leaf &leaf = leaves[nodes[node].index()];
+        std::copy(ropes, ropes + 6, leaf.ropes);
+        return;
+    }
+    int axis = nodes[node].axis();
+    int left = node + 1, right = nodes[node].index();
+    BBox leftCell = cell, rightCell = cell;
+    leftCell.bb1.raw[axis] = nodes[node].split;
+    rightCell.bb0.raw[axis] = nodes[node].split;
+
+    // Move rope down the node it points to while only one of its children
+    // has the whole face of the cell
+    auto optimize = [&](int rope, int face, const BBox &childCell) {
+        int faceAxis = face / 2;
+        while (rope != -1 && !nodes[rope].leaf()) {
+            const Node &target = nodes[rope];
+            int targetAxis = target.axis();
+            if (targetAxis == faceAxis) {
+                // Parallel to the face, take the child next to it
+                rope = face % 2 == 1 ? rope + 1 : target.index();
+            } else if (target.split >= childCell.bb1.raw[targetAxis]) {
+                rope = rope + 1;
+            } else if (target.split <= childCell.bb0.raw[targetAxis]) {
+                rope = target.index();
+            } else {
+                break;
+            }
+        }
+        return rope;
+    };
+    // Children are each other's neighbour on the split plane
+    int leftRopes[6], rightRopes[6];
+    for (int face = 0; face < 6; face++) {
+        leftRopes[face] = face == 2 * axis + 1 ? right : ropes[face];
+        rightRopes[face] = face == 2 * axis ? left : ropes[face];
+        leftRopes[face] = optimize(leftRopes[face], face, leftCell);
+        rightRopes[face] = optimize(rightRopes[face], face, rightCell);
+    }
+    this->buildRopes(left, leftRopes, leftCell);
+    this->buildRopes(right, rightRopes, rightCell);
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "io/mappedfile.h"
+#include "math/bbox.h"
+#include "math/geometry.h"
+#include "parallel/threadpool.h"
+
+// k-d tree built over a set of primitives given their bounding boxes, using
+// the surface area heuristic (SAH) with an exact sweep over all candidate
+// planes, see: http://www.sci.utah.edu/~wald/Publications/2006/NlogN/download/kdtree.pdf
+// Unlike a BVH, nodes split space by a plane (axis and position), so
+// children never overlap and primitives that cross the plane are in both
+// Every leaf has ropes to its neighbour on each face of its cell, so the
+// tree is traversed front to back without a stack: the ray walks from leaf
+// to leaf, and stops as soon as it has a hit inside the current one, see:
+// https://graphics.cg.uni-saarland.de/fileadmin/cguds/papers/2007/popov_07_GPURT/Popov_et_al._-_Stackless_KD-Tree_Traversal_for_High_Performance_GPU_Ray_Tracing.pdf
+class KdTree {
+   public:
+    // 8 bytes, eight nodes fit in a cache line
+    struct Node {
+        float split;  // position of the split plane (interior nodes)
+        int data;     // lowest 2 bits: split axis (3 for leaves), the rest:
+                      // second child (interior nodes) or index in leaves
+
+        inline bool leaf() const { return (data & 3) == 3; }
+        inline int axis() const { return data & 3; }
+        inline int index() const { return data >> 2; }
+    };
+
+    struct Leaf {
+        float bb0[3], bb1[3];  // cell of the leaf (not of its primitives)
+        // Node on the other side of each face of the cell (-x, +x, -y, +y,
+        // -z, +z), -1 if it's outside of the tree
+        int ropes[6];
+        int offset, count;  // primitives in indices
+    };
+
+   private:
+    // SAH settings: relative costs of traversing a node and intersecting a
+    // primitive, and bonus for splits that cut off empty space
+    static const constexpr float TRAVERSAL_COST = 1.0f;
+    static const constexpr float INTERSECTION_COST = 1.5f;
+    static const constexpr float EMPTY_BONUS = 0.8f;
+    // Primitives are duplicated, so depth is limited to 8 + 1.3 log2(n)
+    static const int MAX_DEPTH = 48;
+    // Subtrees are only built in their own thread if both have at least
+    // this many primitives
+    static const int PARALLEL_MIN_PRIMITIVES = 4096;
+
+    // Nodes in depth-first order (first child is always the next node),
+    // root is nodes[0]
+    std::vector<Node> nodes;
+    std::vector<Leaf> leaves;
+    // Primitive indices, leaves reference a contiguous range of them
+    // Each leaf's range starts at a multiple of groupSize and is padded
+    // with -1 up to a multiple of it
+    std::vector<int> indices;
+    int groupSize;
+    BBox bounds;
+    float cost;
+
+    // Nodes, leaves and indices of a subtree built apart
+    struct Subtree {
+        std::vector<Node> nodes;
+        std::vector<Leaf> leaves;
+        std::vector<int> indices;
+        // Adds other subtree after this one
+        void append(const Subtree &other);
+    };
+
+    inline int groups(int numPrimitives) const {
+        return (numPrimitives + groupSize - 1) / groupSize;
+    }
+    // SAH cost of splitting cell by a plane, given the number of primitives
+    // on each side. Planes on the cell's bounds don't split it
+    float splitCost(const BBox &cell, int axis, float position, int numLeft,
+                    int numRight) const;
+    // Adds node for primitives (emptied, they're moved to its children)
+    // inside cell, and its subtree, to out. Returns the node's SAH cost
+    float buildNode(const std::vector<BBox> &primitiveBounds,
+                    std::vector<int> &primitives, const BBox &cell,
+                    int depthLeft, int threads, Subtree &out);
+    // Whether nodes, leaves and indices read from a file are in range:
+    // second children after the first one, ropes to nodes or -1, leaves'
+    // ranges inside indices (aligned to groups) and primitives below
+    // numPrimitives (or -1, padding), so a damaged file can't make
+    // traversal read out of bounds
+    bool isValid(int numPrimitives) const;
+    // Sets the ropes of all leaves under node, given the node's ones
+    // Ropes point to the smallest node that has the whole face
+    void buildRopes(int node, const int ropes[6], const BBox &cell);
+
+    // Distances where the ray enters and exits the tree's bounding box,
+    // false if it doesn't before tMax
+    inline bool clip(const Vec4 &origin, const Vec4 &invDirection,
+                     float tMax, float &tEntry, float &tExit) const {
+        tEntry = 0.0f;
+        tExit = tMax;
+        for (int i = 0; i < 3; i++) {
+            float t1 =
+                (bounds.bb0.raw[i] - origin.raw[i]) * invDirection.raw[i];
+            float t2 =
+                (bounds.bb1.raw[i] - origin.raw[i]) * invDirection.raw[i];
+            float tNear = t1 < t2 ? t1 : t2, tFar = t1 < t2 ? t2 : t1;
+            // NaN (ray inside the slab plane) fails both comparisons
+            tEntry = tNear > tEntry ? tNear : tEntry;
+            tExit = tFar < tExit ? tFar : tExit;
+        }
+        return tEntry <= tExit;
+    }
+    // Leaf under node that has the point of the ray at distance t, points
+    // on a split plane go to the side the ray is going to
+    inline int descend(int node, const Vec4 &origin, const Vec4 &direction,
+                       float t) const {
+        while (!nodes[node].leaf()) {
+            int axis = nodes[node].axis();
+            float p = origin.raw[axis] + direction.raw[axis] * t;
+            float split = nodes[node].split;
+            bool left =
+                p < split || (p == split && direction.raw[axis] <= 0.0f);
+            node = left ? node + 1 : nodes[node].index();
+        }
+        return nodes[node].index();
+    }
+    // Distance where the ray leaves the cell of the leaf, and its face
+    // (-1 if the ray doesn't move at all)
+    static inline float leave(const Leaf &leaf, const Vec4 &origin,
+                              const Vec4 &invDirection, int &face) {
+        float tLeave = std::numeric_limits<float>::max();
+        face = -1;
+        for (int i = 0; i < 3; i++) {
+            bool forward = invDirection.raw[i] >= 0.0f;
+            float plane = forward ? leaf.bb1[i] : leaf.bb0[i];
+            float t = (plane - origin.raw[i]) * invDirection.raw[i];
+            if (t < tLeave) {
+                tLeave = t;
+                face = 2 * i + forward;
+            }
+        }
+        return tLeave;
+    }
+
+   public:
+    KdTree() : groupSize(1), cost(0.0f) {}
+    // Build tree over primitives 0..bounds.size()-1
+    KdTree(const std::vector<BBox> &primitiveBounds, int _groupSize = 1);
+
+    // Write the tree to a file / read a tree over numPrimitives primitives
+    // written by save, returns false if the file is invalid (see isValid,
+    // then the tree is left unchanged)
+    void save(BinaryWriter &file) const;
+    bool load(MappedFile &file, int numPrimitives);
+
+    inline bool empty() const { return nodes.empty(); }
+    inline float getCost() const { return cost; }
+    inline int getGroupSize() const { return groupSize; }
+    inline int numNodes() const { return nodes.size(); }
+    inline const BBox &getBoundingBox() const { return bounds; }
+    inline const std::vector<int> &getIndices() const { return indices; }
+
+    // Front-to-back stackless traversal of the leaves the ray goes through
+    // before tMax. fLeaf(first, count, tMax) is called with the range of
+    // indices of each leaf, and returns true if it has found a closer hit
+    // (it should update tMax with its distance). Leaves after tMax aren't
+    // visited. Returns true if any of the calls to fLeaf has returned true
+    template <typename F>
+    bool traverseLeaves(const Vec4 &origin, const Vec4 &direction,
+                        const Vec4 &invDirection, float &tMax,
+                        F fLeaf) const {
+        float tEntry, tExit;
+        if (nodes.empty() ||
+            !clip(origin, invDirection, tMax, tEntry, tExit)) {
+            return false;
+        }
+        bool hit = false;
+        int current = 0;
+        while (true) {
+            const Leaf &leaf = leaves[descend(current, origin, direction,
+                                              tEntry)];
+            if (leaf.count > 0 && fLeaf(leaf.offset, leaf.count, tMax)) {
+                hit = true;
+            }
+            int face;
+            float tLeave = leave(leaf, origin, invDirection, face);
+            // Next leaves are further than the hit (or than tMax)
+            if (tMax <= tLeave || face == -1 ||
+                (current = leaf.ropes[face]) == -1) {
+                return hit;
+            }
+            tEntry = tLeave > tEntry ? tLeave : tEntry;
+        }
+    }
+
+    // Any-hit traversal, stops as soon as fLeaf(first, count) returns true
+    // for the indices of a leaf the ray goes through before tMax
+    template <typename F>
+    bool occludedLeaves(const Vec4 &origin, const Vec4 &direction,
+                        const Vec4 &invDirection, const float tMax,
+                        F fLeaf) const {
+        float tEntry, tExit;
+        if (nodes.empty() ||
+            !clip(origin, invDirection, tMax, tEntry, tExit)) {
+            return false;
+        }
+        int current = 0;
+        while (true) {
+            const Leaf &leaf = leaves[descend(current, origin, direction,
+                                              tEntry)];
+            if (leaf.count > 0 && fLeaf(leaf.offset, leaf.count)) {
+                return true;
+            }
+            int face;
+            float tLeave = leave(leaf, origin, invDirection, face);
+            if (tMax <= tLeave || face == -1 ||
+                (current = leaf.ropes[face]) == -1) {
+                return false;
+            }
+            tEntry = tLeave > tEntry ? tLeave : tEntry;
+        }
+    }
+};
@@ -0,0 +1,113 @@
+#include "lazybvh.h"
+
+LazyBVH::LazyBVH(const std::vector<BBox> &_bounds, int _groupSize)
+    : bounds(_bounds), numNodes(0), groupSize(_groupSize) {
+    if (bounds.empty()) {
+        return;
+    }
+    indices.resize(bounds.size());
+    for (int i = 0; i < bounds.size(); i++) {
+        indices[i] = i;
+    }
+    // Not initialized (nodes are trivially constructible), so the pages
+    // of nodes that are never built aren't even touched
+    nodes.reset(new Node[2 * bounds.size()]);
+    numNodes = 1;
+    this->addNode(0, 0, bounds.size(), 1);
+}
+
+LazyBVH &LazyBVH::operator=(LazyBVH &&other) {
+    bounds = std::move(other.bounds);
+    indices = std::move(other.indices);
+    nodes = std::move(other.nodes);
+    numNodes = other.numNodes.load();
+    groupSize = other.groupSize;
+    other.numNodes = 0;
+    return *this;
+}
+
+BBox LazyBVH::getBoundingBox() const {
+    if (this->empty()) {
+        return BBox();
+    }
+    const Node &root = nodes[0];
+    return BBox(Vec4(root.bb0[0], root.bb0[1], root.bb0[2], 1.0f),
+                Vec4(root.bb1[0], root.bb1[1], root.bb1[2], 1.0f));
+}
+
+void LazyBVH::addNode(int node, int begin, int end, int depth) const {
+    BBox nodeBounds;
+    for (int i = begin; i < end; i++) {
+        nodeBounds.extend(bounds[indices[i]]);
+    }
+    Node &out = nodes[node];
+    for (int i = 0; i < 3; i++) {
+        out.bb0[i] = nodeBounds.bb0.raw[i];
+        out.bb1[i] = nodeBounds.bb1.raw[i];
+    }
+    out.offset = begin;
+    out.count = end - begin;
+    out.axis = 0;
+    out.depth = depth;
+    out.state.store(UNBUILT, std::memory_order_relaxed);
+}
+
+void LazyBVH::buildNode(int nodeIndex) const {
+    Node &node = nodes[nodeIndex];
+    int expected = UNBUILT;
+    if (!node.state.compare_exchange_strong(expected, BUILDING,
+                                            std::memory_order_acquire)) {
+        // Another thread got it first, it's usually a small node
+        while (node.state.load(std::memory_order_acquire) == BUILDING) {
+            std::this_thread::yield();
+        }
+        return;
+    }
+
+    // Same as BVH::buildNode, for this node only
+    int begin = node.offset, end = node.offset + node.count;
+    int numPrimitives = end - begin;
+    BBox nodeBounds(Vec4(node.bb0[0], node.bb0[1], node.bb0[2], 1.0f),
+                    Vec4(node.bb1[0], node.bb1[1], node.bb1[2], 1.0f));
+    BBox centroidBounds;
+    for (int i = begin; i < end; i++) {
+        centroidBounds.extend(bounds[indices[i]].centroid());
+    }
+    float leafCost = (numPrimitives + groupSize - 1) / groupSize *
+                     BVH::INTERSECTION_COST;
+    BVH::Split best;
+    if (numPrimitives > 1) {
+        best = BVH::objectSplit(bounds, indices, begin, end, groupSize,
+                                nodeBounds, centroidBounds);
+    }
+    if (numPrimitives == 1 ||
+        (best.cost >= leafCost && numPrimitives <= BVH::MAX_LEAF_SIZE)) {
+        node.state.store(LEAF, std::memory_order_release);
+        return;
+    }
+
+    int split, bestAxis = best.axis;
+    if (bestAxis == -1 || node.depth > BVH::MAX_DEPTH / 2) {
+        // Split in half on the biggest axis, so the subtree is balanced
+        bestAxis = centroidBounds.maxAxis();
+        split = begin + numPrimitives / 2;
+        std::nth_element(indices.begin() + begin, indices.begin() + split,
+                         indices.begin() + end, [&](int lhs, int rhs) {
+                             return bounds[lhs].centroid().raw[bestAxis] <
+                                    bounds[rhs].centroid().raw[bestAxis];
+                         });
+    } else {
+        auto isLeft = [&](int pi) { return best.isLeft(bounds[pi]); };
+        std::vector<int>::iterator mid = std::partition(
+            indices.begin() + begin, indices.begin() + end, isLeft);
+        split = mid - indices.begin();
+    }
+    // Both children are added at once, next to each other
+    int child = numNodes.fetch_add(2);
+    this->addNode(child, begin, split, node.depth + 1);
+    this->addNode(child + 1, split, end, node.depth + 1);
+    node.offset = child;
+    node.axis = bestAxis;
+    // Children are ready before other threads can see them
+    node.state.store(INTERIOR, std::memory_order_release);
+}
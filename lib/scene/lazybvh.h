@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "math/bbox.h"
+#include "math/geometry.h"
+#include "scene/bvh.h"
+
+// Binary BVH built on demand: it starts with only the root, and nodes are
+// split (with the same binned SAH as BVH) the first time a ray hits them,
+// so the parts of a big model that are never seen are never built
+// Rays from several threads can traverse and split it at the same time:
+// each node has an atomic state, the first thread that reaches an unbuilt
+// node splits it, and the rest wait until it's done (a node only moves
+// the primitives in its own range, so splits of other nodes can go on)
+class LazyBVH {
+   public:
+    // 40 bytes
+    struct Node {
+        float bb0[3];  // bounding box min
+        int offset;    // interior: first child (the second one is next),
+                       // else first primitive in indices
+        float bb1[3];  // bounding box max
+        int count;     // number of primitives in the node's subtree
+        std::atomic<int> state;
+        short axis;   // split axis, used to traverse children in order
+        short depth;  // to keep the tree under BVH::MAX_DEPTH
+    };
+    // States of a node: not split yet, being split by a thread, split
+    // (it has children) or leaf
+    enum State { UNBUILT, BUILDING, INTERIOR, LEAF };
+
+   private:
+    // Bounding boxes of the primitives, kept to split nodes later
+    std::vector<BBox> bounds;
+    // Nodes are built from const methods (traversals), they don't change
+    // what the tree has, only how much of it is known
+    // Primitive indices, nodes reference a contiguous range of them
+    mutable std::vector<int> indices;
+    // Room for the biggest possible tree (less than 2n nodes), its memory
+    // is only used as nodes are added to it
+    std::unique_ptr<Node[]> nodes;
+    mutable std::atomic<int> numNodes;
+    // Primitives intersected at the cost of one (see BVH::groupSize)
+    int groupSize;
+
+    // Adds node with primitives indices[begin, end), not built yet
+    void addNode(int node, int begin, int end, int depth) const;
+    // Splits node or makes it a leaf (waits for it if another thread is
+    // already doing it)
+    void buildNode(int node) const;
+
+    // Same as BVH::hitsNode
+    static inline bool hitsNode(const Node &node, const Vec4 &origin,
+                                const Vec4 &invDirection, const float tMax) {
+        float tmin = 0.0f, tmax = tMax;
+        for (int i = 0; i < 3; i++) {
+            float t1 = (node.bb0[i] - origin.raw[i]) * invDirection.raw[i];
+            float t2 = (node.bb1[i] - origin.raw[i]) * invDirection.raw[i];
+            float tNear = t1 < t2 ? t1 : t2, tFar = t1 < t2 ? t2 : t1;
+            // NaN (ray inside the slab plane) fails both comparisons
+            tmin = tNear > tmin ? tNear : tmin;
+            tmax = tFar < tmax ? tFar : tmax;
+        }
+        return tmin <= tmax;
+    }
+    // State of node once it's built (building it first if it isn't)
+    inline int build(int node) const {
+        int state = nodes[node].state.load(std::memory_order_acquire);
+        if (state < INTERIOR) {
+            this->buildNode(node);
+            state = nodes[node].state.load(std::memory_order_acquire);
+        }
+        return state;
+    }
+
+   public:
+    LazyBVH() : numNodes(0), groupSize(1) {}
+    // Tree over primitives 0..bounds.size()-1, with only its root
+    LazyBVH(const std::vector<BBox> &_bounds, int _groupSize = 1);
+    // Only to replace a tree that isn't being traversed
+    LazyBVH &operator=(LazyBVH &&other);
+
+    inline bool empty() const { return numNodes.load() == 0; }
+    // Nodes built so far
+    inline int getNumNodes() const { return numNodes.load(); }
+    BBox getBoundingBox() const;
+
+    // Same as BVH::traverse, building the nodes it reaches
+    template <typename F>
+    bool traverse(const Vec4 &origin, const Vec4 &invDirection, float &tMax,
+                  F fIntersect) const {
+        if (this->empty()) {
+            return false;
+        }
+        bool hit = false;
+        int stack[BVH::MAX_DEPTH];
+        int stackSize = 0;
+        int current = 0;
+        while (true) {
+            const Node &node = nodes[current];
+            if (hitsNode(node, origin, invDirection, tMax)) {
+                if (this->build(current) == LEAF) {
+                    for (int i = node.offset; i < node.offset + node.count;
+                         i++) {
+                        hit = fIntersect(indices[i], tMax) || hit;
+                    }
+                } else if (invDirection.raw[node.axis] < 0.0f) {
+                    // Ray goes backwards on split axis, visit second first
+                    stack[stackSize++] = node.offset;
+                    current = node.offset + 1;
+                    continue;
+                } else {
+                    stack[stackSize++] = node.offset + 1;
+                    current = node.offset;
+                    continue;
+                }
+            }
+            if (stackSize == 0) {
+                break;
+            }
+            current = stack[--stackSize];
+        }
+        return hit;
+    }
+
+    // Same as BVH::occluded, building the nodes it reaches
+    template <typename F>
+    bool occluded(const Vec4 &origin, const Vec4 &invDirection,
+                  const float tMax, F fOccluded) const {
+        if (this->empty()) {
+            return false;
+        }
+        int stack[BVH::MAX_DEPTH];
+        int stackSize = 0;
+        int current = 0;
+        while (true) {
+            const Node &node = nodes[current];
+            if (hitsNode(node, origin, invDirection, tMax)) {
+                if (this->build(current) == LEAF) {
+                    for (int i = node.offset; i < node.offset + node.count;
+                         i++) {
+                        if (fOccluded(indices[i])) {
+                            return true;
+                        }
+                    }
+                } else {
+                    stack[stackSize++] = node.offset + 1;
+                    current = node.offset;
+                    continue;
+                }
+            }
+            if (stackSize == 0) {
+                return false;
+            }
+            current = stack[--stackSize];
+        }
+    }
+};
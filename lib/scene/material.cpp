@@ -7,7 +7,7 @@ inline Vec4 reflectDirection(const Vec4 &incoming, const Vec4 &normal) {
 }
 
 // Generate a valid orthonormal base with normal as z
-inline Vec4 baseFromNormal(const Vec4 &normal, Vec4 &x, Vec4 &y, Vec4 &z) {
+inline void baseFromNormal(const Vec4 &normal, Vec4 &x, Vec4 &y, Vec4 &z) {
     z = normal;
     if (std::fabs(z.x) > std::fabs(z.y)) {
         x = Vec4(z.z, 0.0f, z.x * -1.0f, 0.0f).normalize();
@@ -19,12 +19,13 @@ inline Vec4 baseFromNormal(const Vec4 &normal, Vec4 &x, Vec4 &y, Vec4 &z) {
 
 /// Phong Diffuse ///
 
-bool PhongDiffuse::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) {
+bool PhongDiffuse::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                           Sampler &sampler) {
     // Local base to hit point
     Vec4 x, y, z;
     baseFromNormal(hit.normal, x, y, z);
     Mat4 cob = Mat4::changeOfBasis(x, y, z, Vec4());
-    Vec4 outDirection = Random::CosHemisphere(cob);
+    Vec4 outDirection = Random::CosHemisphere(cob, sampler);
     outRay = inRay.copy(hit.point, outDirection, hit);
     return true;
 }
@@ -43,10 +44,11 @@ RGBColor PhongDiffuse::applyNextEvent(const RGBColor &lightIn,
 
 /// Phong Specular ///
 
-bool PhongSpecular::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) {
+bool PhongSpecular::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                            Sampler &sampler) {
     // Random inclination & azimuth
-    float randIncl = Random::ZeroOne();
-    float randAzim = Random::ZeroOne();
+    float randIncl = sampler.zeroOne();
+    float randAzim = sampler.zeroOne();
     // Phong Specular lobe sampling
     float incl = acosf(powf(randIncl, 1.0f / (this->alpha + 1.0f)));
     float azim = 2 * M_PI * randAzim;
@@ -91,8 +93,8 @@ RGBColor PhongSpecular::applyNextEvent(const RGBColor &lightIn,
 
 /// Perfect Specular (delta BRDF) ///
 
-bool PerfectSpecular::nextRay(const Ray &inRay, const RayHit &hit,
-                              Ray &outRay) {
+bool PerfectSpecular::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                              Sampler &sampler) {
     Vec4 outDirection = reflectDirection(inRay.direction, hit.normal);
     outRay = inRay.copy(hit.point, outDirection, hit);
     return true;
@@ -119,7 +121,7 @@ bool PerfectRefraction::isFresnelDisabled = false;
 
 // https://www.scratchapixel.com/lessons/3d-basic-rendering/introduction-to-shading/reflection-refraction-fresnel
 bool PerfectRefraction::nextRay(const Ray &inRay, const RayHit &hit,
-                                Ray &outRay) {
+                                Ray &outRay, Sampler &sampler) {
     // Incoming ray's cosine and sine with respect to hit.normal
     float incCos = dot(inRay.direction, hit.normal) * -1.0f;
     // add epsilon to prevent negative sqrts
@@ -153,7 +155,7 @@ bool PerfectRefraction::nextRay(const Ray &inRay, const RayHit &hit,
     }
     // select a random event (like roussian roulette)
     // perfect specular has probability kr, perfect refraction 1 - kr
-    if (Random::ZeroOne() < kr) {
+    if (sampler.zeroOne() < kr) {
         // specular
         Vec4 outDirection = reflectDirection(inRay.direction, hit.normal);
         outRay = inRay.copy(hit.point, outDirection, hit, inMedium);
@@ -188,7 +190,8 @@ RGBColor PerfectRefraction::applyNextEvent(const RGBColor &lightIn,
 
 /// Portal ///
 
-bool Portal::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) {
+bool Portal::nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                     Sampler &sampler) {
     // Out portal basis
     Vec4 x = this->outPortal->uvX.normalize();
     Vec4 y = this->outPortal->uvY.normalize();
@@ -255,8 +258,8 @@ MaterialBuilder MaterialBuilder::add(const EventPtr &event) {
     return *this;
 }
 
-EventPtr Material::selectEvent() {
-    float event = Random::ZeroOne();
+EventPtr Material::selectEvent(Sampler &sampler) {
+    float event = sampler.zeroOne();
     for (int i = 0; i < this->probs.size(); i++) {
         if (event < this->probs[i]) {
             return this->events[i];
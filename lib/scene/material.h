@@ -28,7 +28,9 @@ class Event {
    public:
     const bool isDelta;
     const float prob;
-    virtual bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) = 0;
+    // Sample the event's outgoing ray, false if it isn't valid
+    virtual bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                         Sampler &sampler) = 0;
     virtual RGBColor applyMonteCarlo(const RGBColor &lightIn, const RayHit &hit,
                                      const Vec4 &wi, const Vec4 &wo) const = 0;
     virtual RGBColor applyNextEvent(const RGBColor &lightIn, const RayHit &hit,
@@ -40,7 +42,8 @@ class PhongDiffuse : public Event {
     const RGBColor kd;
 
     PhongDiffuse(const RGBColor &_kd) : Event(_kd.max(), false), kd(_kd) {}
-    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) override;
+    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                 Sampler &sampler) override;
     RGBColor applyMonteCarlo(const RGBColor &lightIn, const RayHit &hit,
                              const Vec4 &wi, const Vec4 &wo) const override;
     RGBColor applyNextEvent(const RGBColor &lightIn, const RayHit &hit,
@@ -52,7 +55,8 @@ class PhongSpecular : public Event {
     const float alpha;
 
     PhongSpecular(float _ks, float _alpha) : Event(_ks, false), alpha(_alpha) {}
-    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) override;
+    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                 Sampler &sampler) override;
     RGBColor applyMonteCarlo(const RGBColor &lightIn, const RayHit &hit,
                              const Vec4 &wi, const Vec4 &wo) const override;
     RGBColor applyNextEvent(const RGBColor &lightIn, const RayHit &hit,
@@ -62,7 +66,8 @@ class PhongSpecular : public Event {
 class PerfectSpecular : public Event {
    public:
     PerfectSpecular(float _ksp) : Event(_ksp, true) {}
-    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) override;
+    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                 Sampler &sampler) override;
     RGBColor applyMonteCarlo(const RGBColor &lightIn, const RayHit &hit,
                              const Vec4 &wi, const Vec4 &wo) const override;
     RGBColor applyNextEvent(const RGBColor &lightIn, const RayHit &hit,
@@ -76,7 +81,8 @@ class PerfectRefraction : public Event {
    public:
     PerfectRefraction(float _krp, const MediumPtr &_medium)
         : Event(_krp, true), medium(_medium) {}
-    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) override;
+    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                 Sampler &sampler) override;
     RGBColor applyMonteCarlo(const RGBColor &lightIn, const RayHit &hit,
                              const Vec4 &wi, const Vec4 &wo) const override;
     RGBColor applyNextEvent(const RGBColor &lightIn, const RayHit &hit,
@@ -95,7 +101,8 @@ class Portal : public Event {
     Portal(float _kpp, const FigurePortalPtr &_inPortal,
            const FigurePortalPtr &_outPortal)
         : Event(_kpp, true), inPortal(_inPortal), outPortal(_outPortal) {}
-    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay) override;
+    bool nextRay(const Ray &inRay, const RayHit &hit, Ray &outRay,
+                 Sampler &sampler) override;
     RGBColor applyMonteCarlo(const RGBColor &lightIn, const RayHit &hit,
                              const Vec4 &wi, const Vec4 &wo) const override;
     RGBColor applyNextEvent(const RGBColor &lightIn, const RayHit &hit,
@@ -146,7 +153,7 @@ class Material {
     static MaterialPtr none() { return MaterialPtr(new Material()); }
 
     // Roussian roulette event selector
-    EventPtr selectEvent();
+    EventPtr selectEvent(Sampler &sampler);
 
     // Get first delta material
     EventPtr getFirstDelta() const;
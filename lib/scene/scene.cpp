@@ -5,6 +5,14 @@ bool Scene::intersection(const Ray& ray, RayHit& hit) const {
     return this->root->intersection(ray, hit);
 }
 
+int Scene::intersection(const RayPacket& packet, RayHit hits[]) const {
+    return this->root->intersection(packet, hits);
+}
+
+bool Scene::occluded(const Ray& ray, float tMax) const {
+    return this->root->occluded(ray, tMax);
+}
+
 RGBColor Scene::directLight(const RayHit& hit, const Vec4& wo) const {
     RGBColor result(0.0f, 0.0f, 0.0f);
     // Check all lights in the scene
@@ -12,12 +20,11 @@ RGBColor Scene::directLight(const RayHit& hit, const Vec4& wo) const {
         Vec4 wi = hit.point - light.point;
         float norm = wi.module();
         wi = wi.normalize();
-        RayHit hit;
         Ray ray(light.point, wi, this->air);
-        // Check if theres direct view from light to point
-        if (this->intersection(ray, hit) &&
-            std::abs(hit.distance - norm) < 1e-3f &&
-            dot(hit.normal, ray.direction) < 1e-5f) {
+        // Check if the light is on the visible side of the surface and
+        // theres direct view from light to point (shadow ray)
+        if (dot(hit.normal, ray.direction) < 1e-5f &&
+            !this->occluded(ray, norm - 1e-3f)) {
             // Add light's emission to the result
             RGBColor inEmission = light.emission * (1.0f / (norm * norm)) *
                                   dot(hit.normal, wi) * -1.0f;
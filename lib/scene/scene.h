@@ -6,6 +6,7 @@ class Scene;
 #include "camera/medium.h"
 #include "camera/ray.h"
 #include "camera/rayhit.h"
+#include "camera/raypacket.h"
 #include "math/geometry.h"
 #include "math/rgbcolor.h"
 #include "scene/figures.h"
@@ -37,6 +38,11 @@ class Scene {
     }
 
     bool intersection(const Ray &ray, RayHit &hit) const;
+    // Intersect all the rays of the packet together, returns a mask with
+    // the ones that hit (see Figure::intersection)
+    int intersection(const RayPacket &packet, RayHit hits[]) const;
+    // Check if there's anything in the ray's path closer than tMax
+    bool occluded(const Ray &ray, float tMax) const;
     // Calculate direct light incoming from point lights
     virtual RGBColor directLight(const RayHit &hit, const Vec4 &wo) const;
 };
\ No newline at end of file
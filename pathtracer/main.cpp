@@ -24,6 +24,7 @@
 #include "camera/camera.h"
 #include "camera/medium.h"
 #include "io/plymodel.h"
+#include "parallel/threadpool.h"
 #include "pathtracer.h"
 #include "scene/figures.h"
 #include "scene/material.h"
@@ -44,6 +45,7 @@ void addDebugHits(FigurePtrVector &root, Ray ray, const EventPtr &event,
 
     // Debug spheres on ray hit
     RayHit hit;
+    Sampler sampler(0, 0);
     FigurePtrVector extra;
     int n = 0;
     while (n < 1000 && rootNode->intersection(ray, hit) && !out(hit.point)) {
@@ -51,7 +53,7 @@ void addDebugHits(FigurePtrVector &root, Ray ray, const EventPtr &event,
             FigurePtr(new Figures::Sphere(material, hit.point, 0.05f)));
         std::cout << "Ray hits at " << hit.point << " w/ normal " << hit.normal
                   << std::endl;
-        while (!event->nextRay(ray, hit, ray)) {
+        while (!event->nextRay(ray, hit, ray, sampler)) {
             std::cout << "Event's next ray is invalid. Trying again..."
                       << std::endl;
         }
@@ -71,19 +73,28 @@ void addDebugHits(FigurePtrVector &root, Ray ray, const EventPtr &event,
 int main(int argc, char **argv) {
     if (argc < 9) {
         std::cerr << "Usage: " << argv[0]
-                  << " -w <width> -h <height> -p <ppp> -o <out_ppm>"
-                  << std::endl;
+                  << " -w <width> -h <height> -p <ppp> -o <out_ppm> [-s]"
+                  << " [-r <seed>] [-t <threads>] [-a]" << std::endl;
         std::cerr << std::endl;
         std::cerr << "-w Output image width" << std::endl;
         std::cerr << "-h Output image height" << std::endl;
         std::cerr << "-p Paths per pixel" << std::endl;
         std::cerr << "-o Output file (PPM format)" << std::endl;
+        std::cerr << "-s Sort secondary rays (faster on big scenes)"
+                  << std::endl;
+        std::cerr << "-r Random seed (same seed, same image)" << std::endl;
+        std::cerr << "-t Threads (default: one per core)" << std::endl;
+        std::cerr << "-a Pin each thread to a core" << std::endl;
         return 1;
     }
 
     // Read options
     int width, height, ppp;
     std::string filenameOut;
+    uint64_t seed = 0;
+    bool sortRays = false;
+    int threads = 0;
+    bool pinThreads = false;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-w") == 0) {
             width = std::stoi(argv[i + 1]);
@@ -97,8 +108,19 @@ int main(int argc, char **argv) {
         } else if (strcmp(argv[i], "-o") == 0) {
             filenameOut = argv[i + 1];
             i++;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            seed = std::stoull(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            threads = std::stoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            pinThreads = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            sortRays = true;
         }
     }
+    ThreadPool::configure(threads, pinThreads);
 
     // Set up camera & scene
 
@@ -124,8 +146,8 @@ int main(int argc, char **argv) {
 
     Film film(width, height, origin, forward, up);
     // film.setDoFRadius(0.015f); // depth of field effect
-    RayTracerPtr pathTracer = RayTracerPtr(new PathTracer(ppp, film));
-    Camera camera(film, pathTracer);
+    RayTracerPtr pathTracer = RayTracerPtr(new PathTracer(ppp, film, sortRays));
+    Camera camera(film, pathTracer, seed);
 
     // Maximum light value (use this instead of constant numbers)
     float maxLight = 10000.0f;
@@ -152,31 +174,37 @@ int main(int argc, char **argv) {
             .addPhongSpecular(0.3f, 75.0f)
             // .addPerfectSpecular(0.9f)
             .build();
-    UVMaterialPtr magentaUvTexture =
-        UVMaterial::builder(1, 1)
-            .addPhongDiffuse(RGBColor(0.45f, 0.1f, 0.45f))
-            .addPhongSpecular(0.3f, 5.0f)
-            // .addPerfectSpecular(0.9f)
+    MaterialPtr magentaBunnyMaterial =
+        Material::builder()
+            .add(phongDiffuse(RGBColor(0.45f, 0.1f, 0.45f)))
+            .add(phongSpecular(0.3f, 5.0f))
+            // .add(perfectSpecular(0.9f))
             .build();
-    UVMaterialPtr yellowUvTexture =
-        UVMaterial::builder(1, 1)
-            .addPhongDiffuse(RGBColor(0.45f, 0.45f, 0.1f))
-            .addPhongSpecular(0.3f, 1000.0f)
-            // .addPerfectSpecular(0.9f)
+    MaterialPtr yellowBunnyMaterial =
+        Material::builder()
+            .add(phongDiffuse(RGBColor(0.45f, 0.45f, 0.1f)))
+            .add(phongSpecular(0.3f, 1000.0f))
+            // .add(perfectSpecular(0.9f))
             .build();
     PLYModel cyanBunnyModel("ply/bunny.ply", cyanUvTexture);
     cyanBunnyModel.transform(
         Mat4::translation(0.8f, -2.0f, 0.0f) * Mat4::rotationY(M_PI_2 * -1.0f) *
         Mat4::rotationX(M_PI_2 * -1.0f) * Mat4::scale(2.0f, 2.0f, 2.0f));
-    PLYModel magentaBunnyModel("ply/bunny_low.ply", magentaUvTexture);
-    magentaBunnyModel.transform(Mat4::translation(1.0f, 1.0f, -2.0f));
-    PLYModel yellowBunnyModel("ply/bunny_low.ply", yellowUvTexture);
-    yellowBunnyModel.transform(Mat4::translation(1.0f, 0.5f, 2.0f) *
-                               Mat4::rotationZ(M_PI) * Mat4::rotationY(M_PI) *
-                               Mat4::scale(1.5f, 1.5f, 1.5f));
-    FigurePtr cyanBunny = cyanBunnyModel.getFigure(12);
-    FigurePtr magentaBunny = magentaBunnyModel.getFigure(12);
-    FigurePtr yellowBunny = yellowBunnyModel.getFigure(12);
+    // low poly bunny is loaded once and shared by two instances
+    PLYModel lowBunnyModel("ply/bunny_low.ply",
+                           UVMaterial::fill(1, 1, magentaBunnyMaterial));
+    // both meshes are built at the same time
+    std::vector<FigurePtr> bunnies =
+        PLYModel::getFigures({&cyanBunnyModel, &lowBunnyModel});
+    FigurePtr cyanBunny = bunnies[0];
+    FigurePtr lowBunny = bunnies[1];
+    FigurePtr magentaBunny = FigurePtr(new Figures::Instance(
+        lowBunny, Mat4::translation(1.0f, 1.0f, -2.0f)));
+    FigurePtr yellowBunny = FigurePtr(new Figures::Instance(
+        lowBunny,
+        Mat4::translation(1.0f, 0.5f, 2.0f) * Mat4::rotationZ(M_PI) *
+            Mat4::rotationY(M_PI) * Mat4::scale(1.5f, 1.5f, 1.5f),
+        yellowBunnyMaterial));
 #elif SCENE_NUMBER == 5
     UVMaterialPtr spaceshipTexture =
         UVMaterial::builder(512, 512)
@@ -193,8 +221,11 @@ int main(int argc, char **argv) {
         Mat4::translation(7.0f, 1.5f, 1.25f) * Mat4::rotationX(0.05f) *
         Mat4::rotationY(M_PI_4 * 0.25f) * Mat4::rotationZ(M_PI_4 * -1.8f) *
         Mat4::scale(2.0f, 2.0f, 2.0f));
-    FigurePtr spaceship = spaceshipModel.getFigure(4);
-    FigurePtr spaceship2 = spaceshipModel2.getFigure(4);
+    // both meshes are built at the same time
+    std::vector<FigurePtr> spaceships =
+        PLYModel::getFigures({&spaceshipModel, &spaceshipModel2});
+    FigurePtr spaceship = spaceships[0];
+    FigurePtr spaceship2 = spaceships[1];
 #endif
 
 #if SCENE_NUMBER == 0 || SCENE_NUMBER == 1 || SCENE_NUMBER == 3 || \
@@ -463,8 +494,8 @@ int main(int argc, char **argv) {
     //              Ray(origin, forward.normalize(), Medium::air),
     //              debugEvent, debugSphere);
 
-    // Scene's root node is a BVNode (figure group)
-    FigurePtr rootNode = FigurePtr(new Figures::BVNode(sceneElements));
+    // Scene's root node is a bounding volume hierarchy over all figures
+    FigurePtr rootNode = FigurePtr(new Figures::LinearBVH(sceneElements));
 
 #if SCENE_NUMBER == 5
     Scene scene(rootNode, RGBColor::White * 0.001f * maxLight, maxLight);
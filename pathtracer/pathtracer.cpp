@@ -2,76 +2,257 @@
 
 // Debug settings
 // #define DEBUG_PATH      // show path's hits and moment of stopping
+// #define DEBUG_NO_PACKETS  // trace primary rays one by one
 
-RGBColor PathTracer::traceRay(const Ray &ray, const Scene &scene) const {
+RGBColor PathTracer::traceRay(const Ray &ray, const Scene &scene,
+                              Sampler &sampler) const {
     // Ray from camera's origin to pixel's center
     RayHit hit;
     if (scene.intersection(ray, hit)) {
-        // Special case: hit a light
-        if (hit.material->emitsLight) {
+        return this->traceHit(ray, hit, scene, sampler);
+    }
+#ifdef DEBUG_PATH
+    std::cout << "Ray didn't collide with anything" << std::endl;
+#endif
+    return scene.backgroundColor;
+}
+
+RGBColor PathTracer::traceHit(const Ray &ray, const RayHit &hit,
+                              const Scene &scene, Sampler &sampler) const {
+    // Special case: hit a light
+    if (hit.material->emitsLight) {
 // Return the light emission
 #ifdef DEBUG_PATH
-            std::cout << "Light hit on point " << hit.point << " with normal "
-                      << hit.normal << std::endl;
+        std::cout << "Light hit on point " << hit.point << " with normal "
+                  << hit.normal << std::endl;
 #endif
-            return hit.material->emission;
-        }
+        return hit.material->emission;
+    }
 
-        // Calculate russian roulette event
-        EventPtr event = hit.material->selectEvent();
-        // Only calculate direct light if event is not perfect refraction
-        Ray nextRay;
-        if (event != nullptr && event->nextRay(ray, hit, nextRay)) {
+    // Calculate russian roulette event
+    EventPtr event = hit.material->selectEvent(sampler);
+    // Only calculate direct light if event is not perfect refraction
+    Ray nextRay;
+    if (event != nullptr && event->nextRay(ray, hit, nextRay, sampler)) {
 #ifdef DEBUG_PATH
-            std::cout << "Event on point " << hit.point << " with normal "
-                      << hit.normal << std::endl;
+        std::cout << "Event on point " << hit.point << " with normal "
+                  << hit.normal << std::endl;
 #endif
-            // Wo, direction where light is going out
-            Vec4 backDir = ray.direction * -1.0f;
-            // Wi, direction where light is coming in next iteration
-            Vec4 nextDir = nextRay.direction * -1.0f;
-            // Get direct light & next event contributions
-            RGBColor directLight = scene.directLight(hit, backDir);
-            RGBColor nextEventLight = event->applyMonteCarlo(
-                traceRay(nextRay, scene), hit, nextDir, backDir);
-            return nextEventLight + directLight;
+        // Wo, direction where light is going out
+        Vec4 backDir = ray.direction * -1.0f;
+        // Wi, direction where light is coming in next iteration
+        Vec4 nextDir = nextRay.direction * -1.0f;
+        // Get direct light & next event contributions
+        RGBColor directLight = scene.directLight(hit, backDir);
+        RGBColor nextEventLight = event->applyMonteCarlo(
+            traceRay(nextRay, scene, sampler), hit, nextDir, backDir);
+        return nextEventLight + directLight;
 #ifdef DEBUG_PATH
-        } else {
-            std::cout << "Path died :(" << std::endl;
+    } else {
+        std::cout << "Path died :(" << std::endl;
 #endif
-        }
+    }
 
-        // Path died for one reason or another
-        return RGBColor::Black;
+    // Path died for one reason or another
+    return RGBColor::Black;
+}
+
+Ray PathTracer::cameraRay(const Vec4 &pixelCenter, const Film &film,
+                          const Scene &scene, Sampler &sampler) const {
+    float randX = sampler.zeroOne();
+    float randY = sampler.zeroOne();
+    Vec4 dof = film.getDoFDisplacement(sampler);
+    Vec4 direction = pixelCenter + film.deltaX * randX + film.deltaY * randY;
+    return Ray(film.origin + dof, (direction - dof).normalize(), scene.air);
+}
+
+int PathTracer::tracePrimary(const Ray rays[], const int size,
+                             const Scene &scene, RayHit hits[]) const {
+#ifdef DEBUG_NO_PACKETS
+    int mask = 0;
+    for (int r = 0; r < size; r++) {
+        mask |= scene.intersection(rays[r], hits[r]) << r;
     }
-#ifdef DEBUG_PATH
-    std::cout << "Ray didn't collide with anything" << std::endl;
+    return mask;
+#else
+    return scene.intersection(RayPacket(rays, size), hits);
 #endif
-    return scene.backgroundColor;
 }
 
-void PathTracer::tracePixel(const int px, const int py, const Film &film,
-                            const Scene &scene) {
+RGBColor PathTracer::tracePixel(const int px, const int py, const Film &film,
+                                const Scene &scene, Sampler &sampler) {
     RGBColor pixelColor(0.0f, 0.0f, 0.0f);
     Vec4 pixelCenter = film.getPixelCenter(px, py);
-    for (int p = 0; p < ppp; ++p) {
-        float randX = Random::ZeroOne();
-        float randY = Random::ZeroOne();
-        Vec4 dof = film.getDoFDisplacement();
-        Vec4 direction =
-            pixelCenter + film.deltaX * randX + film.deltaY * randY;
-        // Trace ray and store mean in result
-        Ray ray(film.origin + dof, (direction - dof).normalize(), scene.air);
+    // Primary rays of a pixel are almost the same one, so they're traced
+    // together in packets until their first hit (see RayPacket)
+    Ray rays[RayPacket::MAX_SIZE];
+    RayHit hits[RayPacket::MAX_SIZE];
+    for (int first = 0; first < ppp; first += RayPacket::MAX_SIZE) {
+        int size = ppp - first < RayPacket::MAX_SIZE ? ppp - first
+                                                     : RayPacket::MAX_SIZE;
+        for (int r = 0; r < size; r++) {
+            rays[r] = this->cameraRay(pixelCenter, film, scene, sampler);
+        }
+        int mask = this->tracePrimary(rays, size, scene, hits);
+        // Trace rest of the paths and store mean in result
+        for (int r = 0; r < size; r++) {
 #ifdef DEBUG_PATH
-        std::cout << std::endl << "> Ray begins" << std::endl;
+            std::cout << std::endl << "> Ray begins" << std::endl;
 #endif
-        RGBColor rayColor = this->traceRay(ray, scene);
-        if (rayColor.max() > scene.maxLightEmission) {
-            rayColor = rayColor * (scene.maxLightEmission / rayColor.max());
+            RGBColor rayColor = mask & (1 << r)
+                                    ? this->traceHit(rays[r], hits[r], scene,
+                                                     sampler)
+                                    : scene.backgroundColor;
+            if (rayColor.max() > scene.maxLightEmission) {
+                rayColor =
+                    rayColor * (scene.maxLightEmission / rayColor.max());
+            }
+            pixelColor = pixelColor + rayColor * (1.0f / ppp);
         }
-        pixelColor = pixelColor + rayColor * (1.0f / ppp);
     }
-    this->render.setPixel(px, py, pixelColor);
+    return pixelColor;
+}
+
+bool PathTracer::shadeHit(Path &path, const Scene &scene) const {
+    const RayHit &hit = path.hit;
+    if (hit.material->emitsLight) {
+        path.color = path.color + path.throughput * hit.material->emission;
+        return false;
+    }
+    EventPtr event = hit.material->selectEvent(path.sampler);
+    Ray nextRay;
+    if (event == nullptr ||
+        !event->nextRay(path.ray, hit, nextRay, path.sampler)) {
+        return false;
+    }
+    Vec4 backDir = path.ray.direction * -1.0f;
+    Vec4 nextDir = nextRay.direction * -1.0f;
+    path.color =
+        path.color + path.throughput * scene.directLight(hit, backDir);
+    // Monte Carlo estimators only scale the incoming light, so applying
+    // them to the throughput now is the same as to the light later
+    path.throughput =
+        event->applyMonteCarlo(path.throughput, hit, nextDir, backDir);
+    path.ray = nextRay;
+    return true;
+}
+
+void PathTracer::sortPaths(const std::vector<Path> &paths,
+                           std::vector<int> &alive,
+                           std::vector<std::pair<uint64_t, int>> &keys) {
+    BBox bounds;
+    for (int p : alive) {
+        bounds.extend(paths[p].ray.origin);
+    }
+    Vec4 size = bounds.diagonal();
+    float scale[3];
+    for (int i = 0; i < 3; i++) {
+        scale[i] = size.raw[i] > 0.0f ? 1.0f / size.raw[i] : 0.0f;
+    }
+    keys.clear();
+    for (int p : alive) {
+        const Ray &ray = paths[p].ray;
+        uint64_t octant = (ray.direction.x < 0.0f) |
+                          (ray.direction.y < 0.0f) << 1 |
+                          (ray.direction.z < 0.0f) << 2;
+        uint32_t cell[3];
+        for (int i = 0; i < 3; i++) {
+            cell[i] = Morton::quantize(ray.origin.raw[i], bounds.bb0.raw[i],
+                                       scale[i]);
+        }
+        uint64_t code = Morton::encode3(cell[0], cell[1], cell[2]);
+        keys.push_back(std::make_pair(octant << 30 | code, p));
+    }
+    std::sort(keys.begin(), keys.end());
+    for (int i = 0; i < keys.size(); i++) {
+        alive[i] = keys[i].second;
+    }
+}
+
+void PathTracer::traceTile(const int x0, const int y0, const int x1,
+                           const int y1, const Film &film, const Scene &scene,
+                           const uint64_t seed, RGBColor pixels[]) {
+    if (!sortRays) {
+        RayTracer::traceTile(x0, y0, x1, y1, film, scene, seed, pixels);
+        return;
+    }
+    int tileWidth = x1 - x0, numPixels = tileWidth * (y1 - y0);
+    std::fill(pixels, pixels + numPixels, RGBColor::Black);
+    int samplesPerPass = std::max(1, SORT_BATCH_SIZE / numPixels);
+    std::vector<Path> paths;
+    std::vector<int> alive;  // paths with a hit to continue from
+    std::vector<std::pair<uint64_t, int>> keys;
+    Ray rays[RayPacket::MAX_SIZE];
+    RayHit hits[RayPacket::MAX_SIZE];
+    for (int first = 0; first < ppp; first += samplesPerPass) {
+        int samples = std::min(samplesPerPass, ppp - first);
+        paths.clear();
+        alive.clear();
+        // Primary rays, in packets for each pixel like tracePixel does
+        for (int pixel = 0; pixel < numPixels; pixel++) {
+            int px = x0 + pixel % tileWidth, py = y0 + pixel / tileWidth;
+            Vec4 pixelCenter = film.getPixelCenter(px, py);
+            uint64_t firstStream = ((uint64_t)py * film.width + px) * ppp;
+            for (int s = 0; s < samples; s += RayPacket::MAX_SIZE) {
+                int size = std::min(samples - s, (int)RayPacket::MAX_SIZE);
+                for (int r = 0; r < size; r++) {
+                    Sampler sampler(seed, firstStream + first + s + r);
+                    rays[r] = this->cameraRay(pixelCenter, film, scene,
+                                              sampler);
+                    paths.push_back({rays[r], RayHit(), RGBColor::Black,
+                                     RGBColor::White, pixel, sampler});
+                }
+                int mask = this->tracePrimary(rays, size, scene, hits);
+                for (int r = 0; r < size; r++) {
+                    int p = pixel * samples + s + r;
+                    Path &path = paths[p];
+                    if (mask & (1 << r)) {
+                        path.hit = hits[r];
+                        alive.push_back(p);
+                    } else {
+                        path.color = scene.backgroundColor;
+                    }
+                }
+            }
+        }
+
+        // One bounce of all the paths at a time
+        while (!alive.empty()) {
+            int numAlive = 0;
+            for (int p : alive) {
+                if (this->shadeHit(paths[p], scene)) {
+                    alive[numAlive++] = p;
+                }
+            }
+            alive.resize(numAlive);
+            sortPaths(paths, alive, keys);
+            numAlive = 0;
+            for (int p : alive) {
+                Path &path = paths[p];
+                if (scene.intersection(path.ray, path.hit)) {
+                    alive[numAlive++] = p;
+                } else {
+                    path.color = path.color +
+                                 path.throughput * scene.backgroundColor;
+                }
+            }
+            alive.resize(numAlive);
+        }
+
+        for (const Path &path : paths) {
+            RGBColor rayColor = path.color;
+            if (rayColor.max() > scene.maxLightEmission) {
+                rayColor =
+                    rayColor * (scene.maxLightEmission / rayColor.max());
+            }
+            pixels[path.pixel] = pixels[path.pixel] + rayColor * (1.0f / ppp);
+        }
+    }
+}
+
+void PathTracer::storeTile(const int x0, const int y0, const int x1,
+                           const int y1, const RGBColor pixels[]) {
+    this->render.setPixels(x0, y0, x1, y1, pixels);
 }
 
 PPMImage &PathTracer::result() {
@@ -1,23 +1,76 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
 #include "camera/raytracer.h"
 #include "io/ppmimage.h"
+#include "math/morton.h"
 
 // monte-carlo based pathtracer
 class PathTracer : public RayTracer {
+    // Max. number of paths traced together by traceTile, a tile's samples
+    // are split in passes so it never keeps more than this in memory
+    static const int SORT_BATCH_SIZE = 4096;
+
     PPMImage render;
     const int ppp;
+    // Trace tiles bounce by bounce, sorting their rays (see traceTile)
+    const bool sortRays;
+
+    // State of a path traced by traceTile
+    struct Path {
+        Ray ray;
+        RayHit hit;           // ray's hit, if it's still alive
+        RGBColor color;       // light gathered so far
+        RGBColor throughput;  // weight of the light gathered by ray
+        int pixel;            // in the tile
+        Sampler sampler;      // each path has its own random stream
+    };
 
     // Trace the path followed by the cameraRay (multiple hits etc)
-    RGBColor traceRay(const Ray &ray, const Scene &scene) const;
+    RGBColor traceRay(const Ray &ray, const Scene &scene,
+                      Sampler &sampler) const;
+    // Same as traceRay, once its first hit is known
+    RGBColor traceHit(const Ray &ray, const RayHit &hit, const Scene &scene,
+                      Sampler &sampler) const;
+    // Ray from the camera through a random point of the pixel
+    Ray cameraRay(const Vec4 &pixelCenter, const Film &film,
+                  const Scene &scene, Sampler &sampler) const;
+    // Intersect size primary rays of a pixel together, returns a mask with
+    // the ones that hit (see Scene::intersection)
+    int tracePrimary(const Ray rays[], const int size, const Scene &scene,
+                     RayHit hits[]) const;
+    // Same as traceHit, but only for the current hit of the path: gathers
+    // its light and leaves the next ray in path.ray (false if it dies)
+    bool shadeHit(Path &path, const Scene &scene) const;
+    // Sort the paths by the Morton code of their ray's direction octant
+    // and origin (in the bounds of all the origins), so rays that start
+    // close and go the same way are traced one after the other
+    static void sortPaths(const std::vector<Path> &paths,
+                          std::vector<int> &alive,
+                          std::vector<std::pair<uint64_t, int>> &keys);
 
    public:
-    PathTracer(int _ppp, const Film &film)
+    PathTracer(int _ppp, const Film &film, bool _sortRays = false)
         : ppp(_ppp),
+          sortRays(_sortRays),
           render(film.width, film.height, std::numeric_limits<int>::max()) {}
 
-    void tracePixel(const int px, const int py, const Film &film,
-                    const Scene &scene) override;
+    RGBColor tracePixel(const int px, const int py, const Film &film,
+                        const Scene &scene, Sampler &sampler) override;
+    // Secondary rays are incoherent, tracing them one path at a time jumps
+    // all over the scene. With sortRays, all the paths of the tile advance
+    // one bounce at a time instead, and the rays of each bounce are sorted
+    // before tracing them, so consecutive traversals touch the same nodes
+    // Paths have their own random streams of the seed, so the render
+    // doesn't depend on how they're grouped either
+    void traceTile(const int x0, const int y0, const int x1, const int y1,
+                   const Film &film, const Scene &scene, const uint64_t seed,
+                   RGBColor pixels[]) override;
+    void storeTile(const int x0, const int y0, const int x1, const int y1,
+                   const RGBColor pixels[]) override;
 
     PPMImage &result() override;
 };
\ No newline at end of file
@@ -1,22 +1,24 @@
 #include "homisomedium.h"
 
 bool HomIsoMedium::fRayEmit(const Scene &scene, const RGBColor &light, Ray &ray,
-                            RayHit &hit, PhotonKdTreeBuilder &volume) const {
-    float d = -1.0f * logf(Random::ZeroOne()) / this->kExtinction;
+                            RayHit &hit, PhotonKdTreeBuilder::Buffer &volume,
+                            Sampler &sampler) const {
+    float d = -1.0f * logf(sampler.zeroOne()) / this->kExtinction;
     float total = ray.distanceWithoutEvent + hit.distance;
     if (d < total) {  // event occurs before hit
         float travelled = total - d;
         // Russian roulette
-        float random = Random::ZeroOne();
+        float random = sampler.zeroOne();
         ray = ray.event(travelled);
         RGBColor transmitted = fApplyTransmittance(light, travelled);
         volume.add(Photon(ray.origin, ray.direction, transmitted));
         if (random < this->kScattering / this->kExtinction) {
             // Add to volume map
             // Scattering event: new ray
-            ray.direction = Random::Sphere();
+            ray.direction = Random::Sphere(sampler);
             if (scene.intersection(ray, hit)) {
-                return fRayEmit(scene, transmitted, ray, hit, volume);
+                return fRayEmit(scene, transmitted, ray, hit, volume,
+                                sampler);
             } else {
                 // Didn't hit with anything, "absorbed"
                 return true;
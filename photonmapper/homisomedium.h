@@ -34,7 +34,8 @@ struct HomIsoMedium : public Medium {
 
     // true if ray is absorbed
     bool fRayEmit(const Scene &scene, const RGBColor &light, Ray &ray,
-                  RayHit &hit, PhotonKdTreeBuilder &volume) const;
+                  RayHit &hit, PhotonKdTreeBuilder::Buffer &volume,
+                  Sampler &sampler) const;
     RGBColor fApplyTransmittance(const RGBColor &light,
                                  const float distance) const;
     RGBColor fRayMarchTrace(const RGBColor &lightIn, const Ray &ray,
@@ -50,11 +51,12 @@ struct HomIsoMedium : public Medium {
 
     static inline bool rayEmit(const Scene &scene, const RGBColor &light,
                                Ray &ray, RayHit &hit,
-                               PhotonKdTreeBuilder &volume) {
+                               PhotonKdTreeBuilder::Buffer &volume,
+                               Sampler &sampler) {
         // Participative media
         HomIsoMediumPtr pmedium = cast(ray.medium);
         if (pmedium != nullptr) {
-            return pmedium->fRayEmit(scene, light, ray, hit, volume);
+            return pmedium->fRayEmit(scene, light, ray, hit, volume, sampler);
         }
         return false;
     }
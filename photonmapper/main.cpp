@@ -22,6 +22,7 @@
 #include "filter.h"
 #include "homisomedium.h"
 #include "math/geometry.h"
+#include "parallel/threadpool.h"
 #include "photonemitter.h"
 #include "photonmapper.h"
 #include "scene/light.h"
@@ -64,18 +65,24 @@ int main(int argc, char** argv) {
     if (argc < 9) {
         std::cerr << "Usage: " << argv[0]
                   << " -w <width> -h <height> -p <ppp> -o <out_ppm>"
-                  << std::endl;
+                  << " [-r <seed>] [-t <threads>] [-a]" << std::endl;
         std::cerr << std::endl;
         std::cerr << "-w Output image width" << std::endl;
         std::cerr << "-h Output image height" << std::endl;
         std::cerr << "-p Paths per pixel" << std::endl;
         std::cerr << "-o Output file (PPM format)" << std::endl;
+        std::cerr << "-r Random seed (same seed, same image)" << std::endl;
+        std::cerr << "-t Threads (default: one per core)" << std::endl;
+        std::cerr << "-a Pin each thread to a core" << std::endl;
         return 1;
     }
 
     // Read options
     int width, height, ppp;
     std::string filenameOut;
+    uint64_t seed = 0;
+    int threads = 0;
+    bool pinThreads = false;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-w") == 0) {
             width = std::stoi(argv[i + 1]);
@@ -89,8 +96,17 @@ int main(int argc, char** argv) {
         } else if (strcmp(argv[i], "-o") == 0) {
             filenameOut = argv[i + 1];
             i++;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            seed = std::stoull(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            threads = std::stoi(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            pinThreads = true;
         }
     }
+    ThreadPool::configure(threads, pinThreads);
 
     /// Paritcipative media configuration ///
     // Medium::air = HomAmbMedium::create(  // homogeneous ambient
@@ -132,7 +148,7 @@ int main(int argc, char** argv) {
 
     // Configure scene
     Film film(width, height, origin, forward, up);
-    PhotonEmitter emitter(photonsGlobal, storeDirectLight, numRays);
+    PhotonEmitter emitter(photonsGlobal, storeDirectLight, numRays, seed);
     if (useCausticMap) {
         emitter.setCaustic(photonsCaustic);
     }
@@ -169,7 +185,7 @@ int main(int argc, char** argv) {
     teapotModel.transform(
         Mat4::translation(0.0f, -0.5f, 0.0f) * Mat4::rotationX(M_PI_2 * -1.0f) *
         Mat4::rotationZ(M_PI_2) * Mat4::scale(0.4f, 0.4f, 0.4f));
-    FigurePtr teapot = teapotModel.getFigure(8);
+    FigurePtr teapot = teapotModel.getFigure();
 
     // Materials for walls
     MaterialPtr whiteLight =
@@ -239,7 +255,8 @@ int main(int argc, char** argv) {
 #endif
     };
 
-    FigurePtr rootNode = FigurePtr(new Figures::BVNode(sceneElements));
+    // Scene's root node is a bounding volume hierarchy over all figures
+    FigurePtr rootNode = FigurePtr(new Figures::LinearBVH(sceneElements));
     Scene scene(rootNode, RGBColor::Black, maxLight);
 
 #undef plane
@@ -268,7 +285,7 @@ int main(int argc, char** argv) {
         // Radiance estimate step, save image
         RayTracerPtr mapper = RayTracerPtr(new PhotonMapper(
             ppp, film, emitter, kGlobal, kCaustic, kVolume, filter));
-        Camera camera(film, mapper);
+        Camera camera(film, mapper, seed);
         camera.tracePixels(scene);
         camera.storeResult(filenameOut);
     }
@@ -3,15 +3,23 @@
 // Debug settings
 // #define DEBUG_ONE_CORE  // don't use multithreading
 
-void PhotonEmitter::savePhoton(const Photon &photon, const bool isCaustic) {
+void PhotonEmitter::PhotonBatch::endRay(int ray) {
+    photons.endRay(ray);
+    caustics.endRay(ray);
+    volume.endRay(ray);
+}
+
+void PhotonEmitter::savePhoton(PhotonBatch &batch, const Photon &photon,
+                               const bool isCaustic) {
     if (isCaustic) {
-        this->caustics.add(photon);
+        batch.caustics.add(photon);
     } else {
-        this->photons.add(photon);
+        batch.photons.add(photon);
     }
 }
 
-void PhotonEmitter::traceRay(Ray ray, const Scene &scene, RGBColor flux) {
+void PhotonEmitter::traceRay(Ray ray, const Scene &scene, RGBColor flux,
+                             Sampler &sampler, PhotonBatch &batch) {
     // Save original flux
     float initialFlux = flux.max();
     // Ignore first ray
@@ -20,21 +28,24 @@ void PhotonEmitter::traceRay(Ray ray, const Scene &scene, RGBColor flux) {
         return;
     }
     flux = HomAmbMedium::applyLight(flux, ray, hit);
-    if (HomIsoMedium::rayEmit(scene, flux, ray, hit, volume)) {
+    if (HomIsoMedium::rayEmit(scene, flux, ray, hit, batch.volume,
+                              sampler)) {
         // Absorbed, already added to volume map
         return;
     }
     // Absorption event
-    EventPtr event = hit.material->selectEvent();
-    if (event == nullptr || !event->nextRay(ray, hit, ray)) {
+    EventPtr event = hit.material->selectEvent(sampler);
+    if (event == nullptr || !event->nextRay(ray, hit, ray, sampler)) {
         if (storeDirectLight && hit.material->getFirstDelta() == nullptr) {
-            this->savePhoton(Photon(hit.point, ray.direction, flux), false);
+            this->savePhoton(batch, Photon(hit.point, ray.direction, flux),
+                             false);
         }
         return;
     }
     // Arrived at destination: store & apply BSDF
     if (storeDirectLight && !event->isDelta) {
-        this->savePhoton(Photon(hit.point, ray.direction, flux), false);
+        this->savePhoton(batch, Photon(hit.point, ray.direction, flux),
+                         false);
     }
     flux = event->applyMonteCarlo(flux, hit, ray.direction, ray.direction);
 
@@ -44,29 +55,31 @@ void PhotonEmitter::traceRay(Ray ray, const Scene &scene, RGBColor flux) {
     while (scene.intersection(ray, hit) && flux.max() > initialFlux * CUT_PCT) {
         // Participative media
         flux = HomAmbMedium::applyLight(flux, ray, hit);
-        if (HomIsoMedium::rayEmit(scene, flux, ray, hit, volume)) {
+        if (HomIsoMedium::rayEmit(scene, flux, ray, hit, batch.volume,
+                                  sampler)) {
             // Absorbed, already added to volume map
             return;
         }
         if (hit.material->emitsLight) {
             // Save INCOMING flux and ignore light
-            this->savePhoton(Photon(hit.point, ray.direction, flux),
-                             wasLastCaustic);
+            this->savePhoton(
+                batch, Photon(hit.point, ray.direction, flux), wasLastCaustic);
             return;
         }
         // Select event for next photon
-        event = hit.material->selectEvent();
+        event = hit.material->selectEvent(sampler);
         // Save INCOMING flux to the point
-        if (event == nullptr || !event->nextRay(ray, hit, nextRay)) {
+        if (event == nullptr || !event->nextRay(ray, hit, nextRay, sampler)) {
             if (hit.material->getFirstDelta() == nullptr) {
-                this->savePhoton(Photon(hit.point, ray.direction, flux),
+                this->savePhoton(batch,
+                                 Photon(hit.point, ray.direction, flux),
                                  wasLastCaustic);
             }
             return;
         }
         if (!event->isDelta) {
-            this->savePhoton(Photon(hit.point, ray.direction, flux),
-                             wasLastCaustic);
+            this->savePhoton(
+                batch, Photon(hit.point, ray.direction, flux), wasLastCaustic);
         }
         // Apply event and modify flux and ray
         flux =
@@ -78,33 +91,37 @@ void PhotonEmitter::traceRay(Ray ray, const Scene &scene, RGBColor flux) {
 
 void PhotonEmitter::traceRays(
     const Scene &scene, const RGBColor &emission, const MediumPtr &medium,
-    const std::function<void(Vec4 &, Vec4 &)> &fGetSample) {
-    static std::mutex mutex;
-    // Spawn one core per thread and make them consume work as they finish
-    volatile std::atomic<int> photonsEmitted(0), generalShots(0);
+    const std::function<void(Vec4 &, Vec4 &, Sampler &)> &fGetSample) {
+    // One task per thread of the pool, consuming photons as they finish
+    // Each one stores them in its own buffers of the maps
+    volatile std::atomic<int> photonsEmitted(0);
 #ifdef DEBUG_ONE_CORE
     int cores = 1;  // only one core, for debug purposes
 #else
-    int cores = std::thread::hardware_concurrency();  // max no. of threads
+    int cores = ThreadPool::global().size();  // max no. of threads
 #endif
+    photons.setThreads(cores);
+    caustics.setThreads(cores);
+    volume.setThreads(cores);
     std::vector<std::future<void>> threadFutures;  // waits for them to finish
     for (int core = 0; core < cores; core++) {
-        threadFutures.emplace_back(std::async([&]() {
-            while (true) {
+        threadFutures.emplace_back(ThreadPool::global().submit([&, core]() {
+            PhotonBatch batch = {photons.buffer(core), caustics.buffer(core),
+                                 volume.buffer(core)};
+            while (!this->isFull()) {
                 // Get next job ID (or stop if there aren't any)
                 int currentRay = photonsEmitted++;
-                if (currentRay >= totalRays || this->isFull()) {
+                if (currentRay >= totalRays) {
                     break;
                 }
-                if (!this->photons.isFull()) {
-                    generalShots++;
-                }
-                mutex.lock();
+                Sampler sampler(seed,
+                                (uint64_t)emissions * totalRays + currentRay);
                 Vec4 origin, direction;
-                fGetSample(origin, direction);
+                fGetSample(origin, direction, sampler);
                 // Generate photons for the point light
-                traceRay(Ray(origin, direction, medium), scene, emission);
-                mutex.unlock();
+                traceRay(Ray(origin, direction, medium), scene, emission,
+                         sampler, batch);
+                batch.endRay(currentRay);
             }
         }));
     }
@@ -127,10 +144,17 @@ void PhotonEmitter::traceRays(
             }
         }
     }
+    // The rest of them are finishing their last job
+    for (auto &future : threadFutures) {
+        ThreadPool::global().wait(future);
+    }
     std::cout << std::endl;  // space for more progress bars
 
     // Save shot rays for later normalization
-    this->shotRays = generalShots;  // every core adds one
+    this->shotRays = photons.merge();
+    caustics.merge();
+    volume.merge();
+    this->emissions++;
 }
 
 void PhotonEmitter::emitPointLights(const Scene &scene,
@@ -151,9 +175,10 @@ void PhotonEmitter::emitPointLights(const Scene &scene,
         weights.push_back(accumWeight);
     }
     // Origin & direction sampling
-    const auto fGetSample = [&scene, &weights](Vec4 &point, Vec4 &direction) {
+    const auto fGetSample = [&scene, &weights](Vec4 &point, Vec4 &direction,
+                                               Sampler &sampler) {
         // Shoot photons from point lights using importance weighting
-        float random = Random::ZeroOne();
+        float random = sampler.zeroOne();
         for (int i = 0; i < weights.size(); i++) {
             if (random < weights[i]) {
                 point = scene.lights[i].point;
@@ -161,7 +186,7 @@ void PhotonEmitter::emitPointLights(const Scene &scene,
             }
         }
         // Direction uniform sampling on unit sphere
-        direction = Random::Sphere();
+        direction = Random::Sphere(sampler);
     };
     // Shoot random photons
     traceRays(scene, totalEmission, medium, fGetSample);
@@ -170,9 +195,10 @@ void PhotonEmitter::emitPointLights(const Scene &scene,
 void PhotonEmitter::emitAreaLight(const Scene &scene, const FigurePtr &figure,
                                   const RGBColor &areaEmission,
                                   const MediumPtr &medium) {
-    const auto fGetSample = [&figure](Vec4 &point, Vec4 &direction) {
-        point = figure->randomPoint();
-        direction = figure->randomDirection(point);
+    const auto fGetSample = [&figure](Vec4 &point, Vec4 &direction,
+                                      Sampler &sampler) {
+        point = figure->randomPoint(sampler);
+        direction = figure->randomDirection(point, sampler);
     };
     traceRays(scene, areaEmission, medium, fGetSample);
 }
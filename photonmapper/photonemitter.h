@@ -3,10 +3,13 @@
 #include <chrono>
 #include <future>
 #include <memory>
+#include <thread>
+#include <vector>
 #include "camera/film.h"
 #include "camera/homambmedium.h"
 #include "camera/progress.h"
 #include "homisomedium.h"
+#include "parallel/threadpool.h"
 #include "photonkdtree.h"
 #include "scene/figures.h"
 #include "scene/scene.h"
@@ -18,6 +21,13 @@ class PhotonEmitter {
     // Rays shot (current & max)
     const int totalRays;
     int shotRays;
+    // Photons have their own random stream of the seed, for every call to
+    // traceRays (see Sampler). The seed is keyed with EMISSION_KEY, since the
+    // camera numbers its pixel streams from 0 too and photon k would
+    // otherwise draw the same samples as pixel k
+    static const uint64_t EMISSION_KEY = 0x70686f746f6e73ULL;  // "photons"
+    const uint64_t seed;
+    int emissions;
     friend class PhotonMapper;  // read shotRays
     // Whether to store photon's first hit
     const bool storeDirectLight;
@@ -25,14 +35,24 @@ class PhotonEmitter {
     bool wantCaustics, wantVolume;
     PhotonKdTreeBuilder photons, caustics, volume;
 
-    void savePhoton(const Photon& photon, const bool isCaustic);
-    void traceRay(Ray ray, const Scene& scene, RGBColor flux);
-    void traceRays(const Scene& scene, const RGBColor& emission,
-                   const MediumPtr& medium,
-                   const std::function<void(Vec4&, Vec4&)>& fGetSample);
+    // Buffers of the maps used by one thread of traceRays, merged into
+    // them in ray order when all of them finish
+    struct PhotonBatch {
+        PhotonKdTreeBuilder::Buffer &photons, &caustics, &volume;
+        void endRay(int ray);
+    };
+
+    void savePhoton(PhotonBatch& batch, const Photon& photon,
+                    const bool isCaustic);
+    void traceRay(Ray ray, const Scene& scene, RGBColor flux,
+                  Sampler& sampler, PhotonBatch& batch);
+    void traceRays(
+        const Scene& scene, const RGBColor& emission, const MediumPtr& medium,
+        const std::function<void(Vec4&, Vec4&, Sampler&)>& fGetSample);
 
    public:
-    PhotonEmitter(int _maxPhotons, bool _storeDirectLight, int _totalRays)
+    PhotonEmitter(int _maxPhotons, bool _storeDirectLight, int _totalRays,
+                  uint64_t _seed = 0)
         : wantCaustics(false),
           wantVolume(false),
           photons(_maxPhotons),
@@ -40,6 +60,8 @@ class PhotonEmitter {
           volume(0),
           totalRays(_totalRays),
           shotRays(0),
+          seed(_seed ^ EMISSION_KEY),
+          emissions(0),
           storeDirectLight(_storeDirectLight) {}
 
     void setCaustic(const int max) {
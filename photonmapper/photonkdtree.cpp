@@ -2,6 +2,48 @@
 
 /// Builder ///
 
+void PhotonKdTreeBuilder::Buffer::endRay(int ray) {
+    builder->numBuffered += photons.size() - (ends.empty() ? 0 : ends.back());
+    rays.push_back(ray);
+    ends.push_back(photons.size());
+}
+
+void PhotonKdTreeBuilder::setThreads(const int numThreads) {
+    buffers.reset(new Buffer[numThreads]);
+    numBuffers = numThreads;
+    for (int i = 0; i < numBuffers; i++) {
+        buffers[i].builder = this;
+    }
+    numBuffered = 0;
+}
+
+int PhotonKdTreeBuilder::merge() {
+    // Buffer of every ray and its position there
+    int numRays = 0;
+    for (int b = 0; b < numBuffers; b++) {
+        numRays += buffers[b].rays.size();
+    }
+    std::vector<std::pair<int, int>> rays(numRays);
+    for (int b = 0; b < numBuffers; b++) {
+        for (int i = 0; i < buffers[b].rays.size(); i++) {
+            rays[buffers[b].rays[i]] = std::make_pair(b, i);
+        }
+    }
+    int raysNotFull = 0;
+    for (const std::pair<int, int> &ray : rays) {
+        const Buffer &buffer = buffers[ray.first];
+        if (max == -1 || photons.size() < max) {
+            raysNotFull++;
+        }
+        int begin = ray.second == 0 ? 0 : buffer.ends[ray.second - 1];
+        for (int p = begin; p < buffer.ends[ray.second]; p++) {
+            this->add(buffer.photons[p]);
+        }
+    }
+    this->setThreads(numBuffers);
+    return raysNotFull;
+}
+
 PhotonKdTree::NodePtr PhotonKdTreeBuilder::dividePhotons(
     std::vector<Photon>::iterator &vbegin,
     std::vector<Photon>::iterator &vend) {
@@ -53,6 +95,7 @@ PhotonKdTree::NodePtr PhotonKdTreeBuilder::dividePhotons(
 }
 
 PhotonKdTree PhotonKdTreeBuilder::build(const int shotRays) {
+    this->merge();
     for (Photon &photon : photons) {
         photon.flux = photon.flux * (1.0f / shotRays);
     }
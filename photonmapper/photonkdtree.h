@@ -1,9 +1,11 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <iterator>
+#include <limits>
 #include <memory>
-#include <mutex>
+#include <vector>
 #include "math/geometry.h"
 #include "scene/light.h"
 
@@ -64,7 +66,40 @@ class PhotonKdTree {
 };
 
 class PhotonKdTreeBuilder {
+   public:
+    // Photons stored by one thread (see setThreads), without locks
+    // Rays must be numbered 0, 1, 2... across all threads, and each one
+    // ended (endRay) in the buffer of the thread that traced it
+    class Buffer {
+        std::vector<Photon> photons;
+        // Traced rays, and size of photons after each of them
+        std::vector<int> rays, ends;
+        PhotonKdTreeBuilder *builder;
+        char padding[64];  // threads don't share the lines they write
+        friend class PhotonKdTreeBuilder;
+
+       public:
+        // Drops the photon if the map is already filled by the merged
+        // photons and those of this buffer: they all come from earlier
+        // rays, so merge would drop it too. Each buffer then holds at most
+        // max photons (none for maps that aren't wanted), however many
+        // rays are traced, and the maps don't depend on thread timing
+        void add(const Photon &photon) {
+            if (builder->max == -1 ||
+                builder->photons.size() + photons.size() < builder->max) {
+                photons.push_back(photon);
+            }
+        }
+        void endRay(int ray);
+    };
+
    private:
+    std::unique_ptr<Buffer[]> buffers;
+    int numBuffers;
+    // Photons in the buffers, not merged yet (so threads know when to
+    // stop without looking at other buffers)
+    std::atomic<int> numBuffered;
+
     PhotonKdTree::NodePtr dividePhotons(std::vector<Photon>::iterator &vbegin,
                                         std::vector<Photon>::iterator &vend);
 
@@ -72,19 +107,29 @@ class PhotonKdTreeBuilder {
     int max;
     std::vector<Photon> photons;
 
-    PhotonKdTreeBuilder(const int _max = -1) : max(_max), photons() {}
+    PhotonKdTreeBuilder(const int _max = -1)
+        : numBuffers(0), numBuffered(0), max(_max), photons() {}
 
+    // Only from one thread at a time (see Buffer)
     void add(const Photon &photon) {
-        static std::mutex mutex;
-        mutex.lock();
         if (max == -1 || photons.size() < max) {
             photons.push_back(photon);
         }
-        mutex.unlock();
     }
     void setMax(const int _max) { this->max = _max; }
-    bool isFull() const { return this->photons.size() == max; }
+    // Whether the merged and buffered photons reach max
+    bool isFull() const {
+        return max != -1 && photons.size() + numBuffered.load() >= max;
+    }
+
+    // Clears the buffers and makes one for each of numThreads threads
+    void setThreads(const int numThreads);
+    Buffer &buffer(const int thread) { return buffers[thread]; }
+    // Adds the photons of the buffers in ray order (as if a single thread
+    // traced them all) up to max, and empties them
+    // Returns the number of rays traced before it was full
+    int merge();
 
     // clears photons vector and returns new vector
     PhotonKdTree build(const int shotRays = 1);
-};
\ No newline at end of file
+};
@@ -8,18 +8,20 @@ RGBColor PhotonMapper::directLightMedium(const Scene &scene, const RayHit &hit,
         Vec4 wi = hit.point - light.point;
         float norm = wi.module();
         wi = wi.normalize();
-        RayHit hit;
         Ray ray(light.point, wi, scene.air);
-        // Check if theres direct view from light to point
-        if (scene.intersection(ray, hit) &&
-            std::abs(hit.distance - norm) < 1e-3f &&
-            dot(hit.normal, ray.direction) < 1e-5f) {
+        // Check if the light is on the visible side of the surface and
+        // theres direct view from light to point (shadow ray)
+        if (dot(hit.normal, ray.direction) < 1e-5f &&
+            !scene.occluded(ray, norm - 1e-3f)) {
             // Add light's emission to the result
             RGBColor inEmission = light.emission * (1.0f / (norm * norm)) *
                                   dot(hit.normal, wi) * -1.0f;
-            inEmission = HomAmbMedium::applyLight(inEmission, ray, hit);
-            inEmission = HomIsoMedium::rayMarch(inEmission, ray, hit, volume,
-                                                kvNeighbours);
+            // Media are applied along the path from the light
+            RayHit lightHit = hit;
+            lightHit.distance = norm;
+            inEmission = HomAmbMedium::applyLight(inEmission, ray, lightHit);
+            inEmission = HomIsoMedium::rayMarch(inEmission, ray, lightHit,
+                                                volume, kvNeighbours);
             result = result + hit.material->evaluate(inEmission, hit, wi, wo);
         }
     }
@@ -56,7 +58,7 @@ RGBColor PhotonMapper::treeSearch(const PhotonKdTree &tree, const int kNN,
 }
 
 RGBColor PhotonMapper::traceRay(const Ray &ray, const Scene &scene,
-                                const int level) const {
+                                Sampler &sampler, const int level) const {
     RayHit hit;
     Vec4 outDirection = ray.direction * -1.0f;
     if (scene.intersection(ray, hit)) {
@@ -68,13 +70,14 @@ RGBColor PhotonMapper::traceRay(const Ray &ray, const Scene &scene,
         // Check for delta surfaces
         EventPtr delta = hit.material->getFirstDelta();
         Ray nextRay;
-        if (delta != nullptr && delta->nextRay(ray, hit, nextRay)) {
+        if (delta != nullptr && delta->nextRay(ray, hit, nextRay, sampler)) {
             // Delta event, emitted light doesn't matter
             if (level > MAX_LEVEL) {
                 // Don't go too far in recursion
                 return RGBColor::Black;
             }
-            RGBColor next = traceRay(nextRay, scene, level + 1) * delta->prob;
+            RGBColor next =
+                traceRay(nextRay, scene, sampler, level + 1) * delta->prob;
             next = HomAmbMedium::applyLight(next, ray, hit);
             next = HomIsoMedium::rayMarch(next, ray, hit, volume, kvNeighbours);
             return next;
@@ -98,24 +101,30 @@ RGBColor PhotonMapper::traceRay(const Ray &ray, const Scene &scene,
     return scene.backgroundColor;
 }
 
-void PhotonMapper::tracePixel(const int px, const int py, const Film &film,
-                              const Scene &scene) {
+RGBColor PhotonMapper::tracePixel(const int px, const int py,
+                                  const Film &film, const Scene &scene,
+                                  Sampler &sampler) {
     RGBColor pixelColor(0.0f, 0.0f, 0.0f);
     Vec4 pixelCenter = film.getPixelCenter(px, py);
     for (int p = 0; p < ppp; ++p) {
-        float randX = Random::ZeroOne();
-        float randY = Random::ZeroOne();
+        float randX = sampler.zeroOne();
+        float randY = sampler.zeroOne();
         Vec4 direction =
             pixelCenter + film.deltaX * randX + film.deltaY * randY;
         // Trace ray and store mean in result
         Ray ray(film.origin, direction.normalize(), scene.air);
-        RGBColor rayColor = this->traceRay(ray, scene);
+        RGBColor rayColor = this->traceRay(ray, scene, sampler);
         if (rayColor.max() > scene.maxLightEmission) {
             rayColor = rayColor * (scene.maxLightEmission / rayColor.max());
         }
         pixelColor = pixelColor + rayColor * (1.0f / ppp);
     }
-    this->render.setPixel(px, py, pixelColor);
+    return pixelColor;
+}
+
+void PhotonMapper::storeTile(const int x0, const int y0, const int x1,
+                             const int y1, const RGBColor pixels[]) {
+    this->render.setPixels(x0, y0, x1, y1, pixels);
 }
 
 PPMImage &PhotonMapper::result() {
@@ -25,7 +25,7 @@ class PhotonMapper : public RayTracer {
                         const RayHit &hit, const Vec4 &outDirection) const;
 
     // Trace the path followed by the cameraRay (multiple hits etc)
-    RGBColor traceRay(const Ray &ray, const Scene &scene,
+    RGBColor traceRay(const Ray &ray, const Scene &scene, Sampler &sampler,
                       const int level = 1) const;
 
    public:
@@ -44,8 +44,10 @@ class PhotonMapper : public RayTracer {
           volume(_emitter.getVolumeTree()),
           filter(_filter) {}
 
-    void tracePixel(const int px, const int py, const Film &film,
-                    const Scene &scene) override;
+    RGBColor tracePixel(const int px, const int py, const Film &film,
+                        const Scene &scene, Sampler &sampler) override;
+    void storeTile(const int x0, const int y0, const int x1, const int y1,
+                   const RGBColor pixels[]) override;
 
     PPMImage &result() override;
 };
\ No newline at end of file